@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+# Counter loop: 100k passes of i=$((i + 1)), evaluated inside smallsh, against the fork-per-expr baseline
+# of i=$(expr $i + 1). The baseline runs fewer passes (it forks for every one) and is scaled up.
+#
+#     bench/arithmetic.sh [path/to/smallsh] [iterations] [baseline iterations]
+
+SMALLSH=${1:-./smallsh}
+ITERATIONS=${2:-100000}
+BASELINE=${3:-2000}
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+# run NAME PASSES BODY: times a while loop running BODY PASSES times, and reports the time for ITERATIONS
+run() {
+    printf 'i=0\nwhile let i<%d; do %s; done\n' "$2" "$3" > "$SCRATCH/input"
+    local start=$EPOCHREALTIME
+    "$SMALLSH" < "$SCRATCH/input" > /dev/null
+    local end=$EPOCHREALTIME
+    awk -v name="$1" -v passes="$2" -v total="$ITERATIONS" -v start="$start" -v end="$end" 'BEGIN {
+        printf "%-6s %7d passes %8.3fs  (%.2fs per %d)\n", name, passes, end - start, (end - start) * total / passes, total
+    }'
+}
+
+run arith "$ITERATIONS" 'i=$((i + 1))'
+run let "$ITERATIONS" 'let i+=1'
+run expr "$BASELINE" 'i=$(expr $i + 1)'
@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+# Expansion throughput: runs lines heavy in $VAR, ${VAR}, $$ and $? through smallsh and reports how many
+# parameters it expands per second, echo writes included. "mixed" and "pid" read each line as typed input,
+# which is compiled line by line; "loop" runs the mixed line as a loop body, compiled once.
+#
+#     bench/expansion.sh [path/to/smallsh] [lines]
+
+SMALLSH=${1:-./smallsh}
+LINES=${2:-50000}
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+# run NAME PARAMETERS LINE: times LINES copies of LINE, read from stdin as typed commands would be
+run() {
+    { echo 'A=alpha B=beta C=gamma'; for ((i = 0; i < LINES; i++)); do echo "$3"; done; } > "$SCRATCH/input"
+    measure "$@"
+}
+
+# loop NAME PARAMETERS LINE: times a while loop running LINE LINES times
+loop() {
+    printf 'A=alpha B=beta C=gamma i=0\nwhile let i<%d; do let i+=1; %s; done\n' "$LINES" "$3" > "$SCRATCH/input"
+    measure "$@"
+}
+
+measure() {
+    local start=$EPOCHREALTIME
+    "$SMALLSH" < "$SCRATCH/input" > /dev/null
+    local end=$EPOCHREALTIME
+    awk -v name="$1" -v count=$((LINES * $2)) -v start="$start" -v end="$end" 'BEGIN {
+        printf "%-10s %6.3fs  %5.2fM parameters/s\n", name, end - start, count / (end - start) / 1e6
+    }'
+}
+
+run mixed 13 'echo $HOME $A $B $C ${A}x $$ $? $A$B$C $HOME/$A/$B > /dev/null'
+run pid 10 'echo $$ $$ $$ $$ $$ $$ $$ $$ $$ $$ > /dev/null'
+loop loop 13 'echo $HOME $A $B $C ${A}x $$ $? $A$B$C $HOME/$A/$B > /dev/null'
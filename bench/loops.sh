@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+# Loop throughput: iterations per second of while, until and for loops whose bodies are builtins only,
+# so nothing forks and the time is the shell's own. Other shells found on PATH (bash, dash) run the
+# same loops for comparison; they may not have `let`, so theirs use $(( )) tests and updates.
+#
+#     bench/loops.sh [path/to/smallsh] [iterations]
+
+SMALLSH=${1:-./smallsh}
+ITERATIONS=${2:-100000}
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+# run NAME SHELL SCRIPT: times SHELL running SCRIPT (read from stdin) and reports iterations per second
+run() {
+    printf '%s\n' "$3" > "$SCRATCH/input"
+    local start=$EPOCHREALTIME
+    "$2" < "$SCRATCH/input" > /dev/null
+    local end=$EPOCHREALTIME
+    awk -v name="$1" -v count="$ITERATIONS" -v start="$start" -v end="$end" 'BEGIN {
+        printf "%-14s %7.3fs  %6.0fk iterations/s\n", name, end - start, count / (end - start) / 1e3
+    }'
+}
+
+# One statement per line, the form every version of the loops has accepted
+run while "$SMALLSH" "i=0
+while let i<$ITERATIONS
+do
+    let i+=1
+    echo \$i > /dev/null
+done"
+run until "$SMALLSH" "i=0
+until let i>=$ITERATIONS
+do
+    let i+=1
+done"
+run for "$SMALLSH" "for i in $(seq -s ' ' "$ITERATIONS")
+do
+    : \$i
+done"
+
+# The while loop in POSIX syntax, for the shells there are
+for shell in bash dash; do
+    command -v "$shell" > /dev/null || continue
+    run "while ($shell)" "$shell" "i=0
+while [ \$i -lt $ITERATIONS ]; do i=\$((i + 1)); echo \$i > /dev/null; done"
+done
@@ -1,452 +1,9468 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <fcntl.h>
-#include <signal.h>
-
-#define MAX_CMD_LEN 2048
-#define MAX_ARGS 512
-
-// Global flag to indicate if the shell is in "foreground-only" mode.
-// This flag is controlled by the SIGTSTP signal handler and forces all commands to run in the foreground, even if '&' is specified. (This was HARD)
-int fgOnlyMode = 0;
-
-// Stores the exit status or signal termination status of the last foreground process.
-// This is used by the "status" built-in command to report the result of the last foreground command execution.
-int lastStatus = 0;
-
-
-// Prototype for the SIGTSTP signal handler.
-// This function controls via toggle the "foreground-only" mode of the shell when the user presses Ctrl+Z.
-void handle_SIGTSTP(int signo);
-
-// Prototype for the SIGINT signal handler.
-// This function allows foreground child processes to be terminated by Ctrl+C, while the parent shell ignores this signal.
-void handle_SIGINT(int signo);
-
-
-// Parses the user's input string into a command and its arguments.
-// - input: The raw command line input from the user.
-// - args: Array to store individual command arguments.
-// - inputFile: Pointer to hold the input file name for redirection (if specified).
-// - outputFile: Pointer to hold the output file name for redirection (if specified).
-// - background: Pointer to a flag indicating if the command should run in the background.
-// Returns 0 for blank lines or comments, and 1 for valid commands.
-int parseInput(char *input, char **args, char **inputFile, char **outputFile, int *background);
-
-// Replaces instances of "$$" in a command argument with the process ID of the shell.
-// - token: The command argument to be expanded.
-// Returns a dynamically allocated string with "$$" replaced by the shell's PID.
-char *expandPID(char *token);
-
-// Changes the shell's current working directory.
-// - args: Array of arguments; args[1] is the target directory path.
-// If no argument is provided, it changes to the HOME directory.
-void changeDirectory(char **args);
-
-// Displays the status of the last foreground process.
-// Reports the exit value if the process terminated normally, or the signal number if it was killed by a signal.
-void displayStatus();
-
-// Executes a command by creating a new process.
-// - args: Array of command arguments.
-// - inputFile: Input redirection file (if any).
-// - outputFile: Output redirection file (if any).
-// - background: Flag indicating if the process should run in the background.
-// Handles input/output redirection and executes the command using `execvp`.
-void executeCommand(char **args, char *inputFile, char *outputFile, int background);
-
-// Checks for completed background processes and cleans up their resources.
-// Prints the exit status or termination signal of each completed background process.
-void checkBackgroundProcesses();
-
-// Kills all remaining background processes when the shell exits.
-// Sends a SIGKILL signal to terminate any lingering child processes.
-void killBackgroundProcesses();
-
-
-int main() {
-    // Buffer for storing user input
-    char input[MAX_CMD_LEN]; 
-    // Array to hold arguments of the command
-    char *args[MAX_ARGS]; 
-    // Variables for input and output redirection
-    char *inputFile = NULL; 
-    char *outputFile = NULL; 
-    // Flag to indicate if the process should run in the background
-    int background = 0; 
-    
-    // Setting up signal handlers for SIGINT and SIGTSTP
-    struct sigaction SIGINT_action = {{0}}, SIGTSTP_action = {{0}}; 
-
-    // Ignore SIGINT (Ctrl+C) in the parent shell to prevent it from terminating
-    SIGINT_action.sa_handler = SIG_IGN;
-    sigaction(SIGINT, &SIGINT_action, NULL);
-
-    // Handle SIGTSTP (Ctrl+Z) to toggle foreground-only mode
-    // SA_RESTART ensures interrupted system calls restart instead of failing
-    SIGTSTP_action.sa_handler = handle_SIGTSTP;
-    SIGTSTP_action.sa_flags = SA_RESTART;
-    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-
-    // Main shell loop
-    while (1) {
-        // Check if any background processes have completed
-        checkBackgroundProcesses();
-
-        // Display the shell prompt
-        printf(": ");
-        fflush(stdout);
-
-        // Read user input into the buffer
-        if (fgets(input, MAX_CMD_LEN, stdin) == NULL) {
-            // Handle EOF or read errors gracefully
-            clearerr(stdin);
-            continue;
-        }
-
-        // Remove the trailing newline character from input
-        input[strcspn(input, "\n")] = '\0';
-
-        // Parse the input into command arguments and redirection files
-        // If the input is a comment or blank line, skip the iteration
-        if (!parseInput(input, args, &inputFile, &outputFile, &background)) continue;
-
-        // Check if the command is a built-in command
-        if (strcmp(args[0], "exit") == 0) {
-            // "exit" command: terminate the shell
-            break;
-        } else if (strcmp(args[0], "cd") == 0) {
-            // "cd" command: change directory
-            // Use HOME directory if no argument is provided
-            chdir(args[1] ? args[1] : getenv("HOME"));
-        } else if (strcmp(args[0], "status") == 0) {
-            // "status" command: print the exit status of the last foreground process
-            printf("exit value %d\n", WEXITSTATUS(lastStatus));
-        } else {
-            // Execute an external command
-            executeCommand(args, inputFile, outputFile, background);
-        }
-
-        // Reset redirection files and background flag for the next command
-        inputFile = outputFile = NULL;
-        background = 0;
-    }
-
-    // Return 0 to indicate successful shell termination
-    return 0;
-}
-
-int parseInput(char *input, char **args, char **inputFile, char **outputFile, int *background) {
-    char *token;         // Token pointer to iterate through input string
-    int argCount = 0;    // Counter for the number of arguments parsed
-
-    *background = 0; // Reset background flag for each command
-    // WHY: Ensures the background flag does not persist across commands
-    // WHAT: Explicitly sets the `background` flag to 0 before processing the current command.
-
-    token = strtok(input, " "); // Split input string by spaces
-    // WHY: Breaks the input into tokens (words) for easier parsing of commands, arguments, and redirection operators.
-
-    while (token != NULL && argCount < MAX_ARGS - 1) { 
-        // WHY: Continue parsing until there are no more tokens or the maximum argument limit is reached.
-        // WHAT: Ensures we process each word in the input.
-
-        // Handle input redirection: '<' is followed by the input file name
-        if (strcmp(token, "<") == 0) {
-            token = strtok(NULL, " "); // Get the next token, which should be the input file name
-            *inputFile = token; // Store the input file name
-            // WHY: Assigns the input redirection file name to `inputFile`.
-            // WHAT: Enables the program to use this file as standard input for the command.
-
-        // Handle output redirection: '>' is followed by the output file name
-        } else if (strcmp(token, ">") == 0) {
-            token = strtok(NULL, " "); // Get the next token, which should be the output file name
-            *outputFile = token; // Store the output file name
-            // WHY: Assigns the output redirection file name to `outputFile`.
-            // WHAT: Enables the program to redirect command output to this file.
-
-        // Handle background execution: '&' only if it is the last token
-        } else if (strcmp(token, "&") == 0 && strtok(NULL, " ") == NULL) {
-            if (fgOnlyMode == 0) *background = 1; 
-            // WHY: Sets the `background` flag to 1 if the shell is not in foreground-only mode.
-            // WHAT: Indicates the command should run in the background.
-
-        // Treat everything else as a regular argument
-        } else {
-            char *expanded = expandPID(token); // Expand any occurrences of `$$` in the token
-            args[argCount] = expanded; // Store the expanded token in the `args` array
-            argCount++; // Increment the argument counter
-            // WHY: Processes normal command arguments, including resolving any `$$` into the current process ID.
-            // WHAT: Prepares arguments for execution by storing them in the `args` array.
-        }
-
-        token = strtok(NULL, " "); // Move to the next token
-        // WHY: Continues parsing until all tokens are processed.
-        // WHAT: Ensures the loop progresses and doesn't get stuck on the same token.
-    }
-
-    args[argCount] = NULL; // Null-terminate the arguments array
-    // WHY: Null-termination is required for `execvp` to execute the command properly.
-    // WHAT: Marks the end of the command arguments.
-
-    // Check for blank input or comments (starting with `#`)
-    return args[0] == NULL || args[0][0] == '#' ? 0 : 1;
-    // WHY: Skips processing if the input is empty or starts with a comment.
-    // WHAT: Returns `0` to indicate that the shell should skip this iteration.
-}
-
-char *expandPID(char *token) {
-    // Locate the first occurrence of "$$" in the token
-    char *pos = strstr(token, "$$");
-    if (pos == NULL) {
-        return strdup(token);  // No "$$" found, return a duplicate of the original token
-        // WHY: If there is no "$$", the token is returned unchanged.
-        // WHAT: Ensures the function works for all tokens, even those without "$$".
-    }
-
-    // Get the current process ID
-    int pid = getpid();
-    char pid_str[16];  // Buffer to hold the string representation of the PID
-    snprintf(pid_str, sizeof(pid_str), "%d", pid);
-    // WHY: Converts the PID to a string so it can replace "$$".
-    // WHAT: Enables substitution of "$$" with the actual process ID.
-
-    // Calculate the length of the new string
-    int new_length = strlen(token) - 2 + strlen(pid_str);  // Original length - 2 (for "$$") + PID length
-    char *expanded = malloc(new_length + 1);  // Allocate memory for the expanded string
-    if (expanded == NULL) {
-        perror("malloc");  // Print an error message if memory allocation fails
-        exit(1);  // Terminate the program as this is a critical error
-        // WHY: Dynamically allocates memory for the expanded string to ensure it fits.
-        // WHAT: Ensures the expanded string can store the original token with "$$" replaced by the PID.
-    }
-
-    // Construct the expanded string
-    snprintf(expanded, new_length + 1, "%.*s%s%s", 
-        (int)(pos - token),  // Length of the portion before "$$"
-        token,               // Original token up to "$$"
-        pid_str,             // Replace "$$" with the PID
-        pos + 2);            // Rest of the token after "$$"
-    // WHY: Combines the parts of the original string (before and after "$$") with the PID.
-    // WHAT: Replaces "$$" with the actual process ID while preserving the rest of the token.
-
-    return expanded;  // Return the expanded string with "$$" replaced by the PID
-    // WHY: The caller needs the modified string to use as an argument.
-    // WHAT: Allows the shell to process tokens with "$$" as the current process ID.
-}
-
-void changeDirectory(char **args) {
-    // Check if the user provided a directory argument (args[1])
-    if (args[1] == NULL) {
-        // No directory specified, change to the user's home directory
-        chdir(getenv("HOME"));
-        // WHY: If no argument is given, the default behavior of the `cd` command is to navigate to the home directory.
-        // WHAT: Uses the `getenv` function to get the "HOME" environment variable, which contains the path to the home directory.
-    } else {
-        // Attempt to change to the specified directory
-        if (chdir(args[1]) != 0) {
-            perror("smallsh"); // Print an error message if the directory change fails
-            // WHY: `chdir` returns 0 on success and -1 on failure. If it fails, an error message is displayed.
-            // WHAT: The `perror` function prints an error message to stderr describing why the change failed.
-        }
-    }
-}
-
-void displayStatus() {
-    // Check if the last foreground process exited normally
-    if (WIFEXITED(lastStatus)) {
-        // If the process exited normally, print its exit value
-        printf("exit value %d\n", WEXITSTATUS(lastStatus));
-        // WHY: `WIFEXITED` checks if the process terminated normally, and `WEXITSTATUS` extracts its exit code.
-        // WHAT: This provides the user with the exit status of the last foreground command.
-    } else {
-        // If the process was terminated by a signal, print the signal number
-        printf("terminated by signal %d\n", WTERMSIG(lastStatus));
-        // WHY: `WIFSIGNALED` checks if the process was terminated by a signal, and `WTERMSIG` extracts the signal number.
-        // WHAT: This informs the user of the signal (e.g., SIGINT) that caused the process to terminate abnormally.
-    }
-
-    // Ensure the output is immediately displayed on the screen
-    fflush(stdout);
-    // WHY: `fflush(stdout)` forces the output buffer to be flushed to the screen.
-    // WHAT: This ensures that the status message is printed promptly, even if output buffering is enabled.
-}
-
-void executeCommand(char **args, char *inputFile, char *outputFile, int background) {
-    // Force foreground execution if in foreground-only mode
-    if (fgOnlyMode == 1) {
-        background = 0;  // Ignore background requests when foreground-only mode is active
-        // WHY: Foreground-only mode disables background execution by ignoring the '&' operator.
-        // WHAT: Ensures all commands run in the foreground when this mode is enabled.
-    }
-
-    pid_t spawnpid = fork();  // Create a child process to execute the command
-
-    if (spawnpid == -1) {
-        perror("fork");  // Print error if fork fails
-        exit(1);  // Exit the program as we cannot continue without forking
-        // WHY: Forking creates a new process to run the command; failure means no process is available.
-        // WHAT: The shell cannot execute further commands if forking fails.
-    } else if (spawnpid == 0) {  // Child process block
-        // Child process: set up signal handling for foreground and background
-        struct sigaction SIGINT_action = {{0}};
-        sigemptyset(&SIGINT_action.sa_mask);
-
-        // Background processes ignore SIGINT; foreground processes handle it normally
-        SIGINT_action.sa_handler = (background) ? SIG_IGN : SIG_DFL;
-        sigaction(SIGINT, &SIGINT_action, NULL);
-        // WHY: SIGINT (Ctrl+C) should not terminate background processes.
-        // WHAT: Foreground processes can be interrupted by the user; background processes cannot.
-
-        // Handle input redirection
-        if (inputFile != NULL) {  // If input redirection is specified
-            int inputFD = open(inputFile, O_RDONLY);  // Open the input file for reading
-            if (inputFD == -1) {
-                perror("cannot open input file");  // Print error if file cannot be opened
-                exit(1);  // Exit with failure
-            }
-            if (dup2(inputFD, 0) == -1) {  // Redirect standard input to the file
-                perror("dup2 input");  // Print error if redirection fails
-                close(inputFD);
-                exit(1);  // Exit with failure
-            }
-            close(inputFD);  // Close the file descriptor after redirection
-            // WHY: Redirects standard input from the specified file, enabling input redirection.
-            // WHAT: Allows the command to read input from a file instead of the terminal.
-        } else if (background) {  // For background processes without input redirection
-            int devNull = open("/dev/null", O_RDONLY);  // Redirect input to /dev/null
-            if (devNull == -1 || dup2(devNull, 0) == -1) {
-                perror("dup2 input to /dev/null");
-                close(devNull);
-                exit(1);
-            }
-            close(devNull);
-            // WHY: Background processes should not wait for user input.
-            // WHAT: Redirects input to /dev/null to avoid waiting for input.
-        }
-
-        // Handle output redirection
-        if (outputFile != NULL) {  // If output redirection is specified
-            int outputFD = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);  // Open or create the output file
-            if (outputFD == -1) {
-                perror("cannot open output file");  // Print error if file cannot be opened
-                exit(1);  // Exit with failure
-            }
-            if (dup2(outputFD, 1) == -1) {  // Redirect standard output to the file
-                perror("dup2 output");  // Print error if redirection fails
-                close(outputFD);
-                exit(1);  // Exit with failure
-            }
-            close(outputFD);  // Close the file descriptor after redirection
-            // WHY: Redirects standard output to the specified file, enabling output redirection.
-            // WHAT: Allows the command to write output to a file instead of the terminal.
-        } else if (background) {  // For background processes without output redirection
-            int devNull = open("/dev/null", O_WRONLY);  // Redirect output to /dev/null
-            if (devNull == -1 || dup2(devNull, 1) == -1) {
-                perror("dup2 output to /dev/null");
-                close(devNull);
-                exit(1);
-            }
-            close(devNull);
-            // WHY: Prevents background processes from cluttering the terminal with output.
-            // WHAT: Redirects output to /dev/null to suppress it.
-        }
-
-        // Execute the command
-        execvp(args[0], args);  // Replace the child process with the specified command
-        perror(args[0]);  // Print error if execvp fails
-        exit(1);  // Exit with failure if command execution fails
-        // WHY: execvp runs the specified command, replacing the child process image.
-        // WHAT: If execvp returns, it means execution failed, so the child exits with an error.
-    } else {  // Parent process block
-        if (background && fgOnlyMode == 0) {  // For background processes not in foreground-only mode
-            printf("background pid is %d\n", spawnpid);  // Print the PID of the background process
-            fflush(stdout);
-            // WHY: Notifies the user that a command is running in the background.
-            // WHAT: Provides feedback about the background process PID.
-        } else {  // For foreground processes
-            spawnpid = waitpid(spawnpid, &lastStatus, 0);  // Wait for the process to finish
-            if (WIFSIGNALED(lastStatus)) {  // Check if process terminated due to a signal
-                printf("terminated by signal %d\n", WTERMSIG(lastStatus));  // Print the signal number
-                fflush(stdout);
-                // WHY: Informs the user if a process was terminated abnormally by a signal.
-                // WHAT: Provides feedback about unexpected terminations.
-            }
-        }
-    }
-}
-
-void handle_SIGTSTP(int signo) {
-    // Check if foreground-only mode is currently disabled
-    if (fgOnlyMode == 0) {
-        fgOnlyMode = 1;  // Enable foreground-only mode
-        char *message = "\nEntering foreground-only mode (& is now ignored)\n";
-        // Write the message to the standard output (terminal)
-        if (write(STDOUT_FILENO, message, strlen(message)) == -1) {
-            perror("write");  // Print an error if the write operation fails
-        }
-        // WHY: Enables foreground-only mode, which forces all commands to run in the foreground.
-        // WHAT: Notifies the user that foreground-only mode has been activated.
-    } else {
-        fgOnlyMode = 0;  // Disable foreground-only mode
-        char *message = "\nExiting foreground-only mode\n";
-        // Write the message to the standard output (terminal)
-        if (write(STDOUT_FILENO, message, strlen(message)) == -1) {
-            perror("write");  // Print an error if the write operation fails
-        }
-        // WHY: Disables foreground-only mode, allowing background execution with '&'.
-        // WHAT: Notifies the user that foreground-only mode has been deactivated.
-    }
-}
-
-void checkBackgroundProcesses() {
-    int childStatus;  // Variable to store the status of a child process
-    pid_t pid;        // Variable to store the PID of a finished child process
-
-    // Loop to reap all finished background processes
-    while ((pid = waitpid(-1, &childStatus, WNOHANG)) > 0) {
-        // WHY: `waitpid` is called with `-1` to check all child processes,
-        // and `WNOHANG` ensures it doesn't block if no processes have finished.
-        // WHAT: This loop retrieves the status of all completed background processes.
-
-        // Only print status if a background process has finished
-        if (!fgOnlyMode) {  // Print background completion status only if not in fgOnlyMode
-            printf("background pid %d is done: ", pid);
-            // WHY: In foreground-only mode, background processes aren't relevant, so we skip reporting them.
-
-            // Check if the process terminated normally
-            if (WIFEXITED(childStatus)) {
-                printf("exit value %d\n", WEXITSTATUS(childStatus));
-                // WHY: If the process exited normally, we report its exit value.
-                // WHAT: `WEXITSTATUS(childStatus)` extracts the exit code from `childStatus`.
-            } else if (WIFSIGNALED(childStatus)) {
-                printf("terminated by signal %d\n", WTERMSIG(childStatus));
-                // WHY: If the process was terminated by a signal, we report the signal number.
-                // WHAT: `WTERMSIG(childStatus)` extracts the signal that caused the termination.
-            }
-            fflush(stdout);  // Ensure all output is immediately displayed
-            // WHY: We flush the output to prevent delays in displaying the status.
-        }
-    }
-}
-
-void killBackgroundProcesses() {
-    pid_t pid; // Variable to store the PID of any child process
-
-    // Loop through all background processes and terminate them
-    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-        // WHY: `waitpid` with `-1` checks all child processes, and `WNOHANG` ensures
-        // it doesn't block if no processes are ready. This retrieves PIDs of all
-        // background processes still running.
-        // WHAT: The loop finds all child processes that haven't been reaped yet.
-
-        kill(pid, SIGKILL);
-        // WHY: Send the `SIGKILL` signal to forcibly terminate the process with the given PID.
-        // This ensures no lingering background processes remain when the shell exits.
-        // WHAT: `SIGKILL` is a non-catchable signal that immediately stops the process.
-    }
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <link.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <ucontext.h>
+
+#define MAX_CMD_LEN 2048
+#define MAX_ARGS 512
+#define MAX_REDIRS 16
+#define DIR_CACHE_SIZE 16
+#define MAX_SPLIT_JOBS 1024
+#define DEFAULT_DEBOUNCE_MS 100
+#define NSEC_PER_SEC 1000000000LL
+#define DEFAULT_KILL_GRACE (5 * NSEC_PER_SEC)
+#define SHUTDOWN_GRACE_MS 2000
+#define ARENA_BLOCK_SIZE 65536
+#define CAPTURE_CHUNK 4096
+#define CAPTURE_FD -2
+#define MIN_VARIABLE_SLOTS 64
+#define NODE_BACKGROUND 1
+#define CACHE_MAGIC "smallsh"
+#define CACHE_VERSION 5
+#define CACHE_MIN_SCRIPT_SIZE 65536
+#define CACHE_MAX_BYTES (64LL << 20)
+#define MAX_FUNCTION_DEPTH 1000
+#define GLOB_CACHE_SIZE 8
+#define GLOB_CACHE_SECONDS 5
+#define GLOB_BATCH_SIZE (1 << 18)
+#define MAX_WALK_THREADS 32
+#define WALK_BATCH_SIZE 65536
+#define WALK_MAX_OPEN 256
+#define EDITOR_INPUT_SIZE (1 << 20)
+#define ESCAPE_TIMEOUT_MS 50
+#define HISTORY_SYNC_SECONDS 5
+#define HISTORY_BLOCK_SIZE 16384
+#define HISTORY_FILTER_SHIFT 14
+#define MAX_QUERY_LEN 256
+#define MAX_COMPLETIONS_SHOWN 500
+#define MAX_PROMPT_LEN 1024
+#define PROMPT_SEGMENT_SIZE 256
+#define PROMPT_QUEUE_SIZE 8
+#define PROMPT_CACHE_SIZE 8
+#define FRECENCY_MAGIC "smallshz"
+#define FRECENCY_PATH_MAX 240
+#define FRECENCY_MAX_ENTRIES 4096
+#define FRECENCY_HALF_LIFE (7 * 24 * 3600)
+#define BUILD_ID_MAX 32
+#define COROUTINE_STACK_SIZE (8 << 20)
+#define COROUTINE_STACK_CACHE 8
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Global flag to indicate if the shell is in "foreground-only" mode.
+// This flag is controlled by the SIGTSTP signal handler and forces all commands to run in the foreground, even if '&' is specified. (This was HARD)
+int fgOnlyMode = 0;
+
+// Stores the exit status or signal termination status of the last foreground process.
+// This is used by the "status" built-in command to report the result of the last foreground command execution.
+int lastStatus = 0;
+
+// Set when the last foreground process was stopped by `timeout`, so "status" can say so.
+int lastTimedOut = 0;
+
+// Process group of the foreground `timeout` job, which handle_SIGINT forwards Ctrl+C to (0 if none).
+volatile sig_atomic_t timedGroup = 0;
+
+// Set by handle_SIGINT so an in-process builtin (e.g. cat reading the terminal) stops on Ctrl+C.
+volatile sig_atomic_t builtinInterrupted = 0;
+
+// Set by handle_SIGWINCH so the line editor redraws for the new terminal width.
+volatile sig_atomic_t terminalResized = 0;
+
+// A file descriptor watched by the shell's event loop, and the function to call when it becomes readable.
+// Event sources are embedded in the object they belong to (a job, a watcher), which `data` points back to.
+struct eventSource {
+    int fd;
+    void (*handler)(struct eventSource *source);
+    void *data;
+};
+
+// One step of a command's redirections. Steps are applied in order, so "> out 2>&1" and "2>&1 > out" differ.
+// - REDIR_OPEN: open `path` with `flags` as descriptor `fd`.
+// - REDIR_DUP: make `fd` a copy of descriptor `source` ("2>&1").
+// - REDIR_CLOSE: close `fd` ("2>&-").
+// - REDIR_DATA: feed `fd` from a sealed memfd held in `source` (here-documents and here-strings).
+//   Until the body has been read, `source` is -1 and `path` is the here-document's delimiter.
+// dirFD/name are filled in just before forking: a cached O_PATH descriptor of the path's directory and
+// the last path component to open relative to it (dirFD is -1 when the path is opened as written).
+enum redirectionType { REDIR_OPEN, REDIR_DUP, REDIR_CLOSE, REDIR_DATA };
+struct redirection {
+    enum redirectionType type;
+    int fd;
+    int source;
+    int flags;
+    char *path;
+    int dirFD;
+    char *name;
+};
+
+// A directory that redirection targets were opened in, kept open as an O_PATH descriptor.
+// - device/inode: The directory the descriptor refers to; a hit is only used while the path still names it.
+// - lastUse: Tick of the most recent lookup; the least recently used entry is replaced when full.
+struct dirCacheEntry {
+    char *dir;
+    int fd;
+    dev_t device;
+    ino_t inode;
+    unsigned long lastUse;
+};
+
+// A directory's entries, read for globbing and kept while the directory's mtime says they are current.
+// - device/inode: Identify the directory, whatever path it was reached by.
+// - names: The entry names, NUL-separated; offsets[i] is where the i-th starts and types[i] its d_type.
+// - loaded: When the listing was read; it is dropped after GLOB_CACHE_SECONDS, or when the mtime changes.
+struct globListing {
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    time_t loaded;
+    char *names;
+    size_t *offsets;
+    unsigned char *types;
+    size_t count;
+    unsigned long lastUse;
+};
+
+// A directory entry as returned by getdents64.
+struct linuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// One step of a compiled glob pattern (one path component): a literal run, '?', '*' or a "[...]" class.
+enum globOpType { GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+struct globOp {
+    int type;
+    const char *text;
+    size_t length;
+    unsigned char set[32];
+};
+
+// A glob pattern compiled for matching many names. A leading literal and a trailing literal are taken
+// out of the steps and checked first with memcmp(), so "*.log" is a suffix test.
+// - dotOK: The pattern starts with '.', so names starting with '.' may match.
+struct globMatcher {
+    struct globOp *ops;
+    int count;
+    const char *prefix;
+    size_t prefixLength;
+    const char *suffix;
+    size_t suffixLength;
+    int dotOK;
+};
+
+// Paths matched by a glob, collected in lineArena.
+struct globResults {
+    char **paths;
+    int count;
+    int capacity;
+};
+
+// A directory waiting to be read by the tree walker: its open descriptor and the path it was reached by ("a/b/").
+struct walkTask {
+    int fd;
+    char *path;
+};
+
+// A walker thread's pending directories. The owner pushes and pops at the bottom (depth first, which
+// keeps few directories open); idle threads steal from the top, where the largest unexplored subtrees are.
+struct walkDeque {
+    pthread_mutex_t lock;
+    struct walkTask *tasks;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+};
+
+// Matched paths, NUL-terminated one after another, handed from a walker thread to the shell in one piece.
+struct walkBatch {
+    struct walkBatch *next;
+    size_t used;
+    char data[WALK_BATCH_SIZE];
+};
+
+// A parallel walk of a directory tree (see walkTree()).
+// - matcher: Entries whose names it matches are reported; NULL reports every entry.
+// - directoriesOnly: Only directories are reported.
+// - hidden: Entries starting with '.' are reported and descended into as well.
+// - quiet: Unreadable directories are skipped silently (globbing) instead of reported (walk).
+// - threadCount: Number of threads; 0 picks one from the number of CPUs.
+// - pending: Directories queued or being read; the walk is over when it drops to 0.
+// - openDirs: Directory descriptors held open; past WALK_MAX_OPEN a thread reads subdirectories itself.
+// - results: Lock-free stack of finished batches, which the shell takes all at once.
+// - wakeFD: eventfd the threads post to when they publish a batch or finish.
+struct walker {
+    struct globMatcher *matcher;
+    int directoriesOnly;
+    int hidden;
+    int quiet;
+    int threadCount;
+    struct walkDeque deques[MAX_WALK_THREADS];
+    long pending;
+    long openDirs;
+    int stop;
+    int errors;
+    int finished;
+    struct walkBatch *results;
+    int wakeFD;
+};
+
+// One walker thread: its deque index and the batch it is filling.
+struct walkThread {
+    struct walker *walker;
+    int index;
+    unsigned int seed;
+    struct walkBatch *batch;
+};
+
+// The ordered redirection list of one command, filled in by expandCommand().
+struct redirections {
+    struct redirection list[MAX_REDIRS];
+    int count;
+};
+
+// A chunk of arena memory; an arena is a chain of these, newest first.
+struct arenaBlock {
+    struct arenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+// Bump allocator for the words expanded from one command line, all released together before the next line.
+struct arena {
+    struct arenaBlock *blocks;
+};
+
+// A string being built in an arena, such as the output of a command substitution.
+// Grows by doubling into a fresh arena allocation; the space it leaves behind is reclaimed with the arena.
+struct capture {
+    struct arena *arena;
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Where an in-process builtin reads and writes: its stdin, stdout and stderr descriptors.
+// Redirections on a builtin change these instead of the shell's own descriptors.
+// - opened: Descriptors opened for the redirections, closed once the builtin returns.
+// - capture: Where stdout goes when fd[1] is CAPTURE_FD, i.e. inside a command substitution.
+struct builtinIO {
+    int fd[3];
+    int opened[MAX_REDIRS];
+    int openedCount;
+    struct capture *capture;
+};
+
+// A command implemented inside the shell.
+// - run: Runs the builtin; args[0] is its name, and it sets lastStatus.
+// - ownIO: The redirections apply to the builtin itself (cat > f). Otherwise they belong to the
+//   command it launches (timeout 5 cmd > f) and are handed over untouched.
+struct builtin {
+    const char *name;
+    void (*run)(char **args, struct redirections *redirs, int background);
+    int ownIO;
+};
+
+// The descriptors in-process builtins currently use; the shell's own unless a builtin is running.
+struct builtinIO shellIO = {{0, 1, 2}, {0}, 0, NULL};
+struct builtinIO *currentIO = &shellIO;
+
+// The descriptors commands get as stdin, stdout and stderr: the shell's own, or a pipeline stage's.
+int commandFD[3] = {0, 1, 2};
+
+// A word of a compiled command; text and body are offsets into the program's string pool.
+// - body: Offset of a here-document's body (tabs already stripped for <<-), or -1.
+// - kind: WORD_ARGUMENT, or WORD_REDIRECTION for an operator with its target joined on ("2>", "err" -> "2>err").
+// Kind shares a 32-bit field with text, so a word is 8 bytes in memory and in the script cache alike.
+enum wordKind { WORD_ARGUMENT, WORD_REDIRECTION };
+struct word {
+    unsigned text : 31;
+    unsigned kind : 1;
+    int body;
+};
+
+// A node of a compiled program. Children, siblings and words are indices into the program's arrays
+// (-1 for none), so a program holds no pointers into itself.
+// - NODE_COMMAND: words [first, first + count).
+// - NODE_IF: a = condition list, b = then list, c = else list (an elif is a NODE_IF as the else list).
+// - NODE_WHILE, NODE_UNTIL: a = condition list, b = body list.
+// - NODE_FOR: first = loop variable word, followed by count item words; b = body list.
+// - NODE_FUNCTION: first = name word; b = body list, which defining the function keeps (see defineFunction()).
+// - NODE_AND, NODE_OR: a = left command, b = right command, run if the left one succeeded (&&) or failed (||).
+// - NODE_GROUP ("{ ... }"), NODE_SUBSHELL ("( ... )"): a = list; words [first, first + count) are redirections.
+// - NODE_PIPELINE ("a | b | c"): a = first stage; the stages are linked by next, like a list.
+// - flags: NODE_BACKGROUND when the command ends with '&'. Type and flags are 16 bits each, for a 28-byte node.
+// - next: The following node of the same list.
+enum nodeType {
+    NODE_COMMAND, NODE_IF, NODE_WHILE, NODE_UNTIL, NODE_FOR, NODE_FUNCTION, NODE_AND, NODE_OR, NODE_GROUP, NODE_SUBSHELL,
+    NODE_PIPELINE
+};
+struct node {
+    int16_t type;
+    int16_t flags;
+    int first;
+    int count;
+    int a;
+    int b;
+    int c;
+    int next;
+};
+
+// Commands parsed once into flat arrays of nodes, words and strings, and run from there as often as
+// needed (loop bodies are never tokenized again).
+// - root: First node of the top-level list, or -1 for an empty program.
+// - mapping: The cache file holding the arrays when the program was loaded from the script cache, or NULL.
+// - references: Holders of the program: whoever compiled it, plus the functions and aliases defined by it.
+struct program {
+    struct node *nodes;
+    int nodeCount;
+    int nodeCapacity;
+    struct word *words;
+    int wordCount;
+    int wordCapacity;
+    char *strings;
+    int stringLength;
+    int stringCapacity;
+    int root;
+    void *mapping;
+    size_t mappingSize;
+    int references;
+};
+
+// Header of a cached program, followed in the file by its nodes, its words and its string pool.
+// A cache file is only used by the build that wrote it, for the script contents it was compiled from.
+struct cacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t buildIDLength;
+    unsigned char buildID[BUILD_ID_MAX];
+    uint64_t scriptHash;
+    uint64_t scriptSize;
+    int32_t root;
+    int32_t nodeCount;
+    int32_t wordCount;
+    int32_t stringLength;
+};
+
+// A file in the program cache, as trimCache() sees it. used: its mtime, set again each time it is loaded.
+struct cacheFile {
+    char name[64];
+    off_t size;
+    struct timespec used;
+};
+
+// Result of compiling input: a program, a syntax error, or input that stops inside a block.
+enum compileStatus { COMPILE_OK, COMPILE_ERROR, COMPILE_INCOMPLETE };
+
+// A token of compiler input. Word texts and here-document bodies point into the compiler's copy of the input;
+// operator texts (";", "&", "&&", "||", "|", "(", ")") are constants.
+enum tokenType { TOKEN_WORD, TOKEN_OPERATOR, TOKEN_NEWLINE, TOKEN_END };
+struct token {
+    int type;
+    char *text;
+    char *body;
+};
+
+// Recursive-descent parser state: the token array, the read position, and the program being built.
+struct parser {
+    struct token *tokens;
+    int position;
+    struct program *program;
+    int status;
+};
+
+// What is known about input read so far, so a program is only compiled once it can be complete.
+// - depth: Blocks opened (if, while, until, for) minus blocks closed (fi, done).
+// - delimiters: Here-documents whose bodies are still being read, as offsets into the input text.
+struct lineScan {
+    int depth;
+    int pending;
+    size_t delimiters[MAX_REDIRS];
+    size_t delimiterLengths[MAX_REDIRS];
+    int stripTabs[MAX_REDIRS];
+};
+
+// The shell's own descriptors that a group or function call redirected in-process, to put back afterwards.
+// - copy: Where each descriptor was moved aside, or -1 if it was closed before.
+struct savedDescriptors {
+    int fd[MAX_REDIRS];
+    int copy[MAX_REDIRS];
+    int count;
+};
+
+// A position in an arena, to release everything allocated after it.
+struct arenaMark {
+    struct arenaBlock *block;
+    size_t used;
+};
+
+// A shell variable. Names are interned: each is stored once, in its slot, for the life of the shell,
+// so lookups compare against it in place and setting a variable again allocates only the value.
+// - hash: Hash of the name, checked before comparing names.
+// - entry: "NAME=value", the form the environment block points at; value points into it.
+//   Both are NULL once the variable is unset; the slot keeps its name for when it is set again.
+// - borrowed: entry belongs to someone else (a "NAME=value cmd" word) and must not be freed.
+// - exported: Passed on to the environment of commands.
+// - envIndex: Position of entry in the environment block, or -1 if it is not there.
+// Functions and aliases share the table, and the interned names, with variables:
+// - function: Program holding the body of the function of this name, or NULL; functionBody: the body's node.
+// - alias: Replacement text of the alias of this name, or NULL; aliasProgram: that text, compiled.
+struct variable {
+    char *name;
+    size_t length;
+    unsigned int hash;
+    char *entry;
+    char *value;
+    int borrowed;
+    int exported;
+    int envIndex;
+    struct program *function;
+    int functionBody;
+    char *alias;
+    struct program *aliasProgram;
+};
+
+// A variable's state before a "NAME=value builtin" prefix replaced it for the builtin's duration.
+// The variable is found again by its interned name afterwards: the table may have grown meanwhile
+// (the builtin or function defined variables, or other pipeline stages did).
+struct savedVariable {
+    const char *name;
+    size_t length;
+    char *entry;
+    int borrowed;
+    int exported;
+};
+
+// State of an arithmetic expression being evaluated ("$(( ))" and `let`).
+// - p: Next character to read.
+// - error: Set once something has gone wrong; evaluation then unwinds without further side effects.
+struct arithmetic {
+    const char *text;
+    const char *p;
+    int error;
+};
+
+// Open-addressing hash table of the shell's variables, probed linearly.
+// - capacity: Number of slots, a power of two; kept at most three quarters full.
+struct variableTable {
+    struct variable *slots;
+    size_t capacity;
+    size_t count;
+};
+
+// A command kept beyond the input line it was typed on, so it can be run again later (e.g. by `watch`).
+// - args: The words as given, for listings.
+// - program: The words compiled, so that functions, builtins and compound commands ('make && ./test') run too.
+struct storedCommand {
+    char **args;
+    struct program *program;
+    struct redirections redirs;
+};
+
+// A background process started by the shell, tracked until it has been reaped and reported.
+// - pidfd: Becomes readable when the process exits, so the event loop reaps it without polling (-1 if unsupported).
+// - onExit/owner: Lets whoever started the job (e.g. a watcher) learn that it finished.
+// - timer/grace/timedOut: Time limit set by `timeout`; timer.fd is -1 for jobs without one.
+struct job {
+    pid_t pid;
+    int pidfd;
+    int status;
+    int done;
+    int timedOut;
+    long long grace;
+    struct eventSource source;
+    struct eventSource timer;
+    void (*onExit)(struct job *job);
+    void *owner;
+};
+
+// A `watch` registration: reruns its command once the watched paths have been quiet for the debounce window.
+// - wds: inotify watch descriptor of each path (-1 while the path is missing, e.g. mid-rename by an editor).
+// - timer: timerfd restarted on every event, so a burst of events yields a single run.
+// - restart: Cancel a still-running previous run instead of queueing the next one behind it.
+struct watcher {
+    int id;
+    char **paths;
+    int *wds;
+    int pathCount;
+    int debounceMs;
+    int restart;
+    int pending;
+    struct job *running;
+    struct eventSource timer;
+    struct storedCommand command;
+    struct watcher *next;
+};
+
+// An `every` or `at` registration: a timerfd in the event loop that starts the command as a background job.
+// - interval: Period of an `every` schedule in nanoseconds; 0 for a one-shot `at`.
+// - running: The job from the previous run; while it is alive further runs are skipped, never overlapped.
+struct schedule {
+    int id;
+    long long interval;
+    int skipped;
+    struct job *running;
+    struct eventSource timer;
+    struct storedCommand command;
+    struct schedule *next;
+};
+
+// Shell state that belongs to whatever is running: the shell itself, or an in-process pipeline stage,
+// which has a copy of its own (see exchangeShellState()). Variables, functions and jobs are shared.
+struct shellState {
+    struct arena lineArena;
+    struct arena frameArena;
+    char **positional;
+    int positionalCount;
+    int lastStatus;
+    int lastTimedOut;
+    struct builtinIO *currentIO;
+    int commandFD[3];
+    int exitRequested;
+    int breakLevels;
+    int continueLevels;
+    int programInterrupted;
+    int nestingExceeded;
+    int loopDepth;
+    int functionDepth;
+    int returnRequested;
+};
+
+// An in-process pipeline stage: a coroutine on a stack of its own, switched to and from with swapcontext().
+// - context/caller: Where the stage stopped, and where the scheduler that resumed it waits meanwhile.
+// - state: The stage's shell state while it is switched out, and its scheduler's while it runs.
+// - io: The stage's stdin and stdout (its pipe ends) and stderr.
+// - args/redirs: The expanded simple command the stage runs, or args NULL to run node, a compound command.
+// - wake: Event source for the descriptor the stage waits on (see waitDescriptor()); fd is -1 otherwise.
+// - polling/timeoutMs: The stage called runEvents(), and goes on after the scheduler's next round of it.
+// - brokenPipe: The stage wrote to a pipe nobody reads any more, which ends it as SIGPIPE ends a process.
+struct coroutine {
+    ucontext_t context;
+    ucontext_t caller;
+    char *stack;
+    struct shellState state;
+    struct builtinIO io;
+    struct program *program;
+    int node;
+    char **args;
+    struct redirections redirs;
+    struct eventSource wake;
+    int polling;
+    int timeoutMs;
+    int runnable;
+    int finished;
+    int brokenPipe;
+};
+
+// The pipe ends of a pipeline being run (-1 once closed), which subshells forked meanwhile must not keep open.
+struct pipeline {
+    int *fds;
+    int count;
+    struct pipeline *next;
+};
+
+// The interactive line editor, used when both stdin and stdout are a terminal (see editLine()).
+// - saved: The terminal's settings outside of editing, restored whenever a line is entered.
+// - text/length/capacity: The line being edited; position is the cursor's byte offset in it.
+// - delivered: How much of an entered line readLine() has handed out.
+// - cursor: Screen cell the terminal's cursor is on, counted from the start of the prompt's row
+//   (row = cursor / columns). Edits are drawn relative to it, so typing at the end costs the same at any length.
+// - promptWidth: Cells taken by the prompt; columns: the terminal's width.
+// - input: Bytes read from the terminal but not handled yet, such as the rest of a paste.
+// - pasting: Inside a bracketed paste, where everything up to ESC [201~ is text.
+// - output: What one keystroke (or one batch of typed-ahead input) draws, sent in a single write().
+// - historyOffset: Where the history entry shown starts in the history file, or SIZE_MAX for the line
+//   being typed, which is kept in draft while browsing or searching.
+// - searching/query/match: Ctrl+R search state: the text searched for, and where the entry it last
+//   matched starts (SIZE_MAX for none). savedPrompt is the prompt to put back afterwards.
+// - editing: Set while editLine() runs, so a prompt that changes meanwhile is redrawn in place.
+struct lineEditor {
+    int enabled;
+    int editing;
+    struct termios saved;
+    char *text;
+    size_t length;
+    size_t capacity;
+    size_t position;
+    size_t delivered;
+    size_t cursor;
+    size_t promptWidth;
+    size_t columns;
+    char *input;
+    size_t inputStart;
+    size_t inputEnd;
+    size_t inputCapacity;
+    int pasting;
+    char *output;
+    size_t outputLength;
+    size_t outputCapacity;
+    size_t historyOffset;
+    char *draft;
+    int searching;
+    char query[MAX_QUERY_LEN];
+    size_t queryLength;
+    size_t match;
+    const char *savedPrompt;
+    char searchPrompt[MAX_QUERY_LEN + 40];
+};
+
+// Command history: an append-only file of lines shared by every session, read through an mmap.
+// - fd: The file ($HISTFILE, or ~/.smallsh_history), opened with O_APPEND so that each line, written
+//   with a single writev(), lands whole even while other sessions append to it too.
+// - map/mapSize: The file as last mapped; it is mapped again when it has grown.
+// - unsynced/lastSync: Lines are fdatasync()ed in batches, at most every HISTORY_SYNC_SECONDS and on exit.
+// - blockStarts/filters/blockCount/indexed: The search index. The file is cut at line boundaries into
+//   blocks of about HISTORY_BLOCK_SIZE bytes, each with a Bloom filter of the bigrams and trigrams in it,
+//   so a search only reads the blocks that can hold the text. indexed is how much of the file they cover.
+// - indexer/indexing: A large file is indexed by a thread started with the shell, through a mapping of
+//   its own; the first search waits for it, and only then touches the index.
+struct history {
+    int fd;
+    char *map;
+    size_t mapSize;
+    int unsynced;
+    time_t lastSync;
+    size_t *blockStarts;
+    unsigned char *filters;
+    size_t blockCount;
+    size_t blockCapacity;
+    size_t indexed;
+    pthread_t indexer;
+    int indexing;
+};
+
+// A node of the command trie. Its children are consecutive in the trie's node array, sorted by byte, and
+// the names under it are the range [first, last) of the trie's sorted names.
+struct trieNode {
+    uint32_t firstChild;
+    uint32_t first;
+    uint32_t last;
+    uint16_t childCount;
+    unsigned char byte;
+};
+
+// The commands tab completion offers: every executable in the directories of PATH, and the builtins,
+// sorted and without duplicates under a prefix trie (nodes[0] is the root), so a prefix finds all of
+// its completions in one walk down from the root.
+// - path: The PATH it was read from; the trie is built again once $PATH is something else.
+// - names/namesLength: The names, NUL-separated; offsets[i] is where the i-th starts, list[i] points at it.
+struct commandTrie {
+    char *path;
+    char *names;
+    size_t namesLength;
+    size_t namesCapacity;
+    size_t *offsets;
+    char **list;
+    size_t count;
+    size_t capacity;
+    struct trieNode *nodes;
+    size_t nodeCount;
+    size_t nodeCapacity;
+};
+
+// Tab completion's command trie, and what keeps it current. The trie is built by a thread, started with
+// the line editor, which sets finished and signals `done` (an eventfd in the event loop). `changes` is
+// an inotify instance watching the directories of PATH: a change there starts another build, or marks
+// the running one stale, so that it is started over as soon as it is in.
+struct completion {
+    struct commandTrie *trie;
+    struct commandTrie *built;
+    pthread_t builder;
+    int building;
+    int finished;
+    int stale;
+    struct eventSource changes;
+    struct eventSource done;
+};
+
+// A candidate found by tab completion, with its d_type when it is a file name.
+struct completionItem {
+    const char *name;
+    unsigned char type;
+};
+
+// A request to, or a result from, the prompt thread: the slow segments of the prompt for a directory.
+// - environment: A request's copy of the environment block (see copyEnvironment()), which git runs
+//   with; the thread frees it, so results carry NULL.
+struct promptJob {
+    char directory[PATH_MAX];
+    char git[PROMPT_SEGMENT_SIZE];
+    char **environment;
+};
+
+// A single-producer, single-consumer ring of prompt jobs. Only the producer moves head and only the
+// consumer moves tail, so neither side takes a lock; each side's store is released after the slot is
+// written (or read), and the other side acquires it before looking at the slot.
+struct promptQueue {
+    size_t head;
+    size_t tail;
+    struct promptJob slots[PROMPT_QUEUE_SIZE];
+};
+
+// The slow segments last computed for a directory, shown until the prompt thread has fresher ones.
+// - pending: A request for the directory is queued or being worked on, so another is not sent.
+struct promptCacheEntry {
+    char directory[PATH_MAX];
+    char git[PROMPT_SEGMENT_SIZE];
+    int valid;
+    int pending;
+    unsigned long lastUse;
+};
+
+// The thread that computes the prompt's slow segments (started by the first prompt that has one).
+// The shell sends requests through `requests` and posts `wake`; the thread answers through `results`
+// and posts `ready`, an eventfd in the event loop.
+struct promptWorker {
+    int started;
+    pthread_t thread;
+    int wake;
+    struct eventSource ready;
+    struct promptQueue requests;
+    struct promptQueue results;
+    struct promptCacheEntry cache[PROMPT_CACHE_SIZE];
+    unsigned long tick;
+};
+
+// A directory the shell can go back to with a single fchdir(): the previous one (`cd -`) and those on
+// the pushd stack. fd is an O_PATH descriptor taken as the shell left it; path is what it was called then.
+struct savedDirectory {
+    int fd;
+    char *path;
+};
+
+// The frecency database behind `z`: a file of fixed-size entries, one per visited directory, mapped
+// shared so that a visit updates its entry in place. Sessions take an flock() on it while they change it.
+// - rank: Visits, each worth 1 when it happened and decaying by half every FRECENCY_HALF_LIFE seconds;
+//   it is brought up to date (to `visited`) whenever the directory is visited again.
+struct frecencyHeader {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+};
+struct frecencyEntry {
+    double rank;
+    int64_t visited;
+    char path[FRECENCY_PATH_MAX];
+};
+
+// Keys the line editor decodes from escape sequences, numbered after the byte values.
+enum editorKey {
+    KEY_NONE = 256, KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_HOME, KEY_END, KEY_DELETE,
+    KEY_WORD_LEFT, KEY_WORD_RIGHT, KEY_DELETE_WORD, KEY_PASTE
+};
+
+struct lineEditor editor;
+struct history history = { .fd = -1 };
+struct completion completion = { .changes.fd = -1, .done.fd = -1 };
+struct promptWorker promptWorker = { .wake = -1, .ready.fd = -1 };
+
+// `cd -` goes back to previousDirectory; pushd and popd keep directoryStack (its top is the last entry).
+struct savedDirectory previousDirectory = { -1, NULL };
+struct savedDirectory *directoryStack = NULL;
+int directoryStackCount = 0;
+int directoryStackCapacity = 0;
+
+// The frecency database, mapped on first use (frecencyFD is -2 once opening it has failed).
+int frecencyFD = -1;
+struct frecencyHeader *frecency = NULL;
+
+// The pipeline stage running now (NULL in the shell's own context), the pipelines being run, and stacks of
+// finished stages kept for the next ones.
+struct coroutine *currentCoroutine = NULL;
+struct pipeline *activePipelines = NULL;
+char *stackCache[COROUTINE_STACK_CACHE];
+int stackCacheCount = 0;
+
+// The SIGPIPE disposition the shell started with, which children get back while a pipeline ignores SIGPIPE.
+struct sigaction inheritedPipeAction;
+
+// The main prompt as last rendered from $PROMPT, and how long the last command line took to run (-1 before one has).
+char promptBuffer[MAX_PROMPT_LEN];
+long long lastDuration = -1;
+
+// The prompt last shown, which the line editor redraws with the line.
+const char *promptText = "";
+
+// Set when Ctrl+C drops the line being edited, so readProgram() drops the rest of an open block too.
+int lineCancelled = 0;
+
+// The epoll instance behind the event loop, and the flag its stdin source sets when input is available.
+// stdinAlwaysReady is set when stdin cannot be polled (a regular file), in which case reads never wait.
+int epollFD = -1;
+struct eventSource stdinSource;
+int stdinReady = 0;
+int stdinAlwaysReady = 0;
+int inputEOF = 0;
+int foregroundExited = 0;
+
+// /dev/null, opened once (close-on-exec) and duplicated into background children.
+int devNullFD = -1;
+
+// Directories of recent redirection targets; relative entries are dropped whenever the directory changes.
+struct dirCacheEntry dirCache[DIR_CACHE_SIZE];
+unsigned long dirCacheTick = 0;
+
+// Background jobs that have not been reported yet.
+struct job **jobs = NULL;
+int jobCount = 0;
+int jobCapacity = 0;
+
+// Active `watch` registrations, sharing one inotify instance.
+struct watcher *watchers = NULL;
+int inotifyFD = -1;
+int nextWatcherId = 1;
+
+// Active `every` and `at` registrations.
+struct schedule *schedules = NULL;
+int nextScheduleId = 1;
+
+// Directory listings read for globbing, reused while their directories are unchanged.
+struct globListing globCache[GLOB_CACHE_SIZE];
+unsigned long globCacheTick = 0;
+
+// Holds the expanded words of the current command line, including command substitution output.
+struct arena lineArena = { NULL };
+
+// Shell variables, starting with the environment the shell was started with.
+struct variableTable variables = { NULL, 0, 0 };
+
+// Environment block handed to every exec: the entries of the exported variables, NULL-terminated.
+// It is patched in place as exported variables change, never rebuilt; children patch their own copy
+// for "NAME=value cmd", so those pages are only copied (on write) in the child.
+char **environment = NULL;
+int environmentCount = 0;
+int environmentCapacity = 0;
+
+// The shell's pid as text for "$$", formatted once at startup.
+char shellPID[16];
+
+// Pid of the last command started in the background, for "$!" (0 until there is one).
+pid_t lastBackgroundPid = 0;
+
+// Set to unwind the program being run: by `exit`, by `break n` and `continue n` (counting the loops
+// still to leave), and when Ctrl+C stops a foreground command.
+int exitRequested = 0;
+int breakLevels = 0;
+int continueLevels = 0;
+int programInterrupted = 0;
+
+// Set to unwind the top-level command whose function calls nested too deeply; the commands after it still run.
+int nestingExceeded = 0;
+
+// Number of loops the running commands are nested in, which limits `break` and `continue`.
+int loopDepth = 0;
+
+// Function calls being run, and whether `return` is unwinding the innermost one.
+int functionDepth = 0;
+int returnRequested = 0;
+
+// Positional parameters of the function calls being run, released as each call returns.
+struct arena frameArena = { NULL };
+
+// Aliases are expanded as commands are compiled, in interactive use only: a script's compiled (and
+// cached) form must not depend on the aliases of the shell that runs it.
+int aliasExpansion = 1;
+
+// Positional parameters: positional[0] is "$0" (the shell's name), and "$1"... are replaced by "set -- args".
+char **positional = NULL;
+int positionalCount = 0;
+
+
+// Prototype for the SIGTSTP signal handler.
+// This function controls via toggle the "foreground-only" mode of the shell when the user presses Ctrl+Z.
+void handle_SIGTSTP(int signo);
+
+// Prototype for the SIGINT signal handler.
+// This function allows foreground child processes to be terminated by Ctrl+C, while the parent shell ignores this signal.
+void handle_SIGINT(int signo);
+
+// SIGWINCH handler: notes the new terminal size for the line editor.
+void handle_SIGWINCH(int signo);
+
+
+// Sets up the event loop and registers stdin with it.
+// Exits the shell if the epoll instance cannot be created.
+void initEventLoop();
+
+// Starts watching an event source's descriptor for readability.
+// Returns 0 on success, or -1 if the descriptor cannot be polled (e.g. a regular file).
+int addEventSource(struct eventSource *source);
+
+// Stops watching an event source's descriptor. The caller remains responsible for closing it.
+void removeEventSource(struct eventSource *source);
+
+// Runs one round of the event loop: waits up to timeoutMs (-1 = forever) and dispatches ready sources.
+void runEvents(int timeoutMs);
+
+// Event source handler for stdin: records that input is available for readLine().
+void handleStdinReady(struct eventSource *source);
+
+// Reads one line of input, running the event loop while waiting for it.
+// - line: Buffer receiving the line, including its trailing newline, like fgets().
+// - size: Size of the buffer; longer lines are returned in pieces.
+// Returns line, or NULL at end of input (inputEOF is then set until the caller clears it).
+char *readLine(char *line, int size);
+
+// Prints a prompt and remembers it for the line editor's redraws.
+void showPrompt(const char *prompt);
+
+// Returns the main prompt: ": ", or $PROMPT with its segments filled in when it is set. Segments are
+// {cwd}, {jobs}, {status} and {duration}, which are quick to work out, and {git} (branch, and '*' when
+// there are uncommitted changes), which the prompt thread computes: until it has, the last value seen
+// for the directory is shown, and the prompt is redrawn when the new one comes in.
+const char *renderPrompt();
+
+// Returns the cached {git} segment for a directory, and asks the prompt thread to bring it up to date.
+const char *slowSegments(const char *directory);
+
+// Starts the prompt thread and its eventfds. Returns 0, or -1 if it cannot be started.
+int startPromptWorker();
+
+// Thread that answers prompt requests: computes the slow segments for each directory it is sent.
+void *promptThread(void *arg);
+
+// Writes the {git} segment of a directory into out: its repository's branch (or abbreviated commit),
+// followed by '*' if `git status` reports changes to tracked files. Empty outside a repository.
+// - environment: The environment git runs with (so that exported GIT_DIR, PATH... apply).
+void gitSegment(const char *directory, char **environment, char *out, size_t size);
+
+// Event source handler: takes the prompt thread's results, and redraws the prompt if it changed.
+void handlePromptReady(struct eventSource *source);
+
+// Adds a job to a prompt queue (producer side). Returns 0 if the queue is full.
+int pushPromptJob(struct promptQueue *queue, const struct promptJob *job);
+
+// Takes the oldest job from a prompt queue (consumer side). Returns 0 if it is empty.
+int popPromptJob(struct promptQueue *queue, struct promptJob *job);
+
+// Turns on the line editor if stdin and stdout are a terminal (and TERM is not "dumb").
+void initLineEditor();
+
+// Edits one line at the terminal in raw mode, starting after the prompt already shown.
+// The entered line, with its newline, is left in editor.text for readLine() to hand out.
+// Returns 0 when a line is entered (an empty one after Ctrl+C), or -1 at end of input (Ctrl+D).
+int editLine();
+
+// Reads more terminal input into editor.input, running the event loop while it waits.
+// - timeoutMs: How long to wait (for the rest of an escape sequence), or -1 to wait for a key.
+// Returns the number of bytes read, 0 if none came (timeout, resize), or -1 at end of input.
+int editorRead(int timeoutMs);
+
+// Decodes the escape sequence at p into a key.
+// Returns the sequence's length, or 0 if the sequence is not complete yet.
+size_t parseEscape(const char *p, size_t available, int *key);
+
+// Replaces text[from, to) with data, drawing only what changed: nothing but the new text when the line
+// ends after it, an insert- or delete-character sequence when the rest of the line stays on the same
+// row, and otherwise the rest of the line. The cursor ends up after the new text.
+void editorReplace(size_t from, size_t to, const char *data, size_t length);
+
+// Moves the cursor to a byte offset in the line.
+void editorMove(size_t position);
+
+// Redraws the prompt and the whole line.
+// - clearScreen: Start from the top of a cleared screen (Ctrl+L) rather than from the prompt's row.
+void editorRedraw(int clearScreen);
+
+// Shows an older (-1) or newer (+1) history entry in place of the line.
+void editorHistory(int direction);
+
+// Searches the history for the query (Ctrl+R) and shows the newest entry holding it that starts before
+// `before`, with the search prompt. Without a match the line shown stays, under a "failed" prompt.
+void editorSearch(size_t before);
+
+// Replaces the line without drawing it, leaving the cursor at its end.
+void editorSetLine(const char *text, size_t length);
+
+// Opens (creating it if needed) and maps the history file. Without one, history lasts for the session.
+void openHistory();
+
+// Appends an entered line to the history, unless it repeats the newest entry.
+void addHistory(const char *line, size_t length);
+
+// fdatasync()s the lines appended to the history, if the last sync was long enough ago or force is set.
+void syncHistory(int force);
+
+// Maps the history file again if its size has changed (another session, or this one, appended to it).
+void mapHistory();
+
+// Extends the search index over the complete lines of a view of the history file it does not cover yet.
+void indexHistory(const char *map, size_t size);
+
+// Thread that indexes the history file as it was when the shell started.
+void *indexHistoryThread(void *arg);
+
+// Waits for the indexing thread, if one was started, so the index can be used.
+void finishIndexing();
+
+// Returns the start of the newest history entry that holds query and starts before `before`, or SIZE_MAX.
+size_t searchHistory(const char *query, size_t length, size_t before);
+
+// Returns the Bloom filter bit for a bigram or trigram packed into an int ("ab" as 'a' << 16 | 'b' << 8).
+unsigned int gramHash(unsigned int gram);
+
+// Completes the word before the cursor (Tab): a command name in command position, otherwise a file name.
+// The longest common prefix of the candidates is inserted, followed by a space or a '/' when there is only
+// one. When nothing can be inserted the terminal beeps, or with list set (a second Tab) the candidates
+// are shown below the line.
+void editorComplete(int list);
+
+// Shows completion candidates in columns below the line, then draws the prompt and line again.
+void showCompletions(struct completionItem *items, size_t count, int files);
+
+// qsort() comparison of two completion candidates by name.
+int compareCompletions(const void *a, const void *b);
+
+// Starts building the command trie for the current $PATH on a thread, and watches PATH's directories.
+// If a build is already running, it is marked stale instead and started over once it finishes.
+void startCompletionBuild();
+
+// Installs the trie of a finished build, waiting for it if `wait` is set (and otherwise only taking it
+// if the thread has finished). A build that went stale meanwhile is started again.
+void finishCompletionBuild(int wait);
+
+// Thread that builds the command trie for the PATH it is given.
+void *completionThread(void *arg);
+
+// Event source handler: a directory of PATH changed, so the command trie is out of date.
+void handleCompletionChanges(struct eventSource *source);
+
+// Event source handler: the completion thread has finished building a trie.
+void handleCompletionBuilt(struct eventSource *source);
+
+// Reads the executables in PATH's directories (path, which the trie takes over) and the builtins into
+// a new command trie. Uses nothing of the shell's state but the builtin table, so it can run on a thread.
+struct commandTrie *buildCommandTrie(char *path);
+
+// Appends a name to a command trie being built.
+void addTrieName(struct commandTrie *trie, const char *name);
+
+// Adds the children of a trie node for its sorted names [first, last), which share their first depth bytes.
+void addTrieChildren(struct commandTrie *trie, size_t node, size_t first, size_t last, size_t depth);
+
+// Finds the range [first, last) of the trie's names that start with prefix. Returns 0 if there are none.
+int findCommands(struct commandTrie *trie, const char *prefix, size_t length, size_t *first, size_t *last);
+
+// Releases a command trie.
+void freeCommandTrie(struct commandTrie *trie);
+
+// Returns the screen cell of a byte offset in the line, measured from the cursor.
+size_t editorCell(size_t offset);
+
+// Queues the escape sequences that move the terminal's cursor to a screen cell.
+void moveCursor(size_t cell);
+
+// Queues text for the terminal, showing control characters (such as a pasted tab) as spaces.
+void editorAppendText(const char *text, size_t length);
+
+// Queues bytes for the terminal.
+void editorAppend(const char *data, size_t length);
+
+// Sends what has been queued for the terminal in one write().
+void editorFlush();
+
+// Returns the number of screen cells text takes: one per UTF-8 character.
+size_t displayWidth(const char *text, size_t length);
+
+// Returns the terminal's width in columns (80 if it cannot be told).
+size_t terminalColumns();
+
+// Reads input up to a complete program: one line, or several when a block or here-document is open.
+// - program: Receives the compiled program, or NULL after a syntax error (which has been reported).
+// Returns 1 if input was read, or 0 at end of input.
+int readProgram(struct program **program);
+
+// Updates what is known about the input with one more line, for readProgram().
+// - text: The whole input so far (NUL-terminated); line: offset of the new line in it.
+void scanLine(const char *text, size_t line, struct lineScan *scan);
+
+// Compiles shell input into a program.
+// - text/length: The input; newlines separate commands.
+// - program: Receives the program when the result is COMPILE_OK, and NULL otherwise.
+// Syntax errors are reported; input that merely ends inside a block is COMPILE_INCOMPLETE.
+int compileProgram(const char *text, size_t length, struct program **program);
+
+// Splits compiler input into words and newlines, collecting here-document bodies on the way.
+// - text: The input, which is split up (and here-document bodies compacted) in place.
+// - tokens/count: Receive a malloc'd token array ending with TOKEN_END.
+// Returns COMPILE_OK, or COMPILE_INCOMPLETE if a here-document has not ended.
+int lexText(char *text, struct token **tokens, int *count);
+
+// Returns the operator (";", "&", "&&", "||", "|", "(" or ")") starting at p, or NULL if a word starts there.
+const char *shellOperator(const char *p);
+
+// Returns the length of the word starting at p, which ends at a blank, a newline or an operator.
+// "$(...)" spans, parentheses opened inside the word ("name()") and a quoted span the word starts with
+// ('{cwd}  > ') are kept whole.
+size_t wordLength(const char *p);
+
+// Returns the length of the here-document operator ("<<", "2<<-") at the start of a word, or 0 if there is none.
+// - stripTabs: Set for "<<-", whose body and delimiter lines lose their leading tabs.
+size_t hereDocumentOperator(const char *word, int *stripTabs);
+
+// Returns the length of the redirection operator at the start of a word ("2>>", "&>", "<<<"), or 0.
+size_t redirectionOperator(const char *word);
+
+// Parses commands separated by newlines, ';' and '&', up to (not including) one of the terminator keywords
+// (or ")") in command position, or the end.
+// - terminators: NULL-terminated keyword list, or NULL at the top level.
+// Returns the first node of the list (-1 if empty or on error; see parser->status).
+int parseList(struct parser *parser, const char *const *terminators);
+
+// Parses commands joined by && and ||, which group left to right.
+// Returns the node of the whole chain, or -1 on error.
+int parseAndOr(struct parser *parser);
+
+// Parses commands joined by '|', which binds tighter than && and ||.
+// Returns the command's own node when there is no '|', otherwise a NODE_PIPELINE, or -1 on error.
+int parsePipeline(struct parser *parser);
+
+// Parses one command: a simple command, an if, while, until or for block, a { } group or a ( ) subshell.
+// Returns its node, or -1 on error.
+int parseCommand(struct parser *parser);
+
+// Parses a { } group or ( ) subshell after its opening token, up to and including the closing one and
+// any redirections after it.
+int parseGroup(struct parser *parser, int type);
+
+// Adds the word at the parser's position to the program as an argument or a redirection, joining a
+// redirection operator to its target when written apart ("2> err.log").
+void addCommandWord(struct parser *parser);
+
+// Parses the rest of an if (or elif) block, after the keyword, up to and including its "fi".
+int parseIf(struct parser *parser);
+
+// Parses a simple command: its words up to the end of the line, joining redirection operators to their targets.
+// An alias in command position is replaced by the words it was defined with.
+int parseSimpleCommand(struct parser *parser);
+
+// Parses a function definition, "name() {" ... "}", after its "name()" word.
+int parseFunction(struct parser *parser);
+
+// Consumes the keyword (or ")") expected next, skipping blank lines and ';' before it.
+// Returns 0, or -1 after setting parser->status (incomplete at the end of input, an error otherwise).
+int expectKeyword(struct parser *parser, const char *keyword);
+
+// Checks that a block's closing keyword ends its line.
+// Returns 0, or -1 after reporting a syntax error.
+int endBlock(struct parser *parser);
+
+// Reports a syntax error at the current token.
+void syntaxError(struct parser *parser);
+
+// Add a node, word or string to a program, growing its arrays as needed.
+// Return the new index or offset. Earlier node and word pointers may move.
+int addNode(struct program *program, int type);
+int addWord(struct program *program, const char *text, size_t length, const char *body, int kind);
+int addString(struct program *program, const char *text, size_t length);
+
+// Drops a reference to a program, releasing it with the last one.
+void releaseProgram(struct program *program);
+
+// Runs a script file ("smallsh file [arg...]"), compiled once and then cached on disk.
+// Returns the exit status for the shell.
+int runScript(const char *path);
+
+// Returns a 64-bit hash of a block of memory, fast enough for scripts of many megabytes.
+uint64_t hashBytes(const void *data, size_t length);
+
+// Copies the running smallsh build's ID (its GNU build-id note) into id, and returns its length.
+// Without a note, the executable's size and modification time stand in for it.
+size_t buildID(unsigned char *id);
+
+// dl_iterate_phdr() callback for buildID(): searches the main program's notes for the build ID.
+int findBuildID(struct dl_phdr_info *info, size_t size, void *data);
+
+// Builds the cache file path for a script hash, under $XDG_CACHE_HOME/smallsh (or ~/.cache/smallsh),
+// creating the directories as needed. Returns 1 on success, or 0 if there is nowhere to cache.
+int cacheFilePath(uint64_t scriptHash, char *path, size_t size);
+
+// Maps a cached program, if the file exists and was written by this build for these script contents.
+// Returns the program, or NULL if the script has to be compiled.
+struct program *loadCachedProgram(const char *path, uint64_t scriptHash, size_t scriptSize);
+
+// Returns 1 if every index and offset in a program is in range and its lists form a tree (no node is
+// linked from two places, so no walk can go round in a cycle), so that it can be run safely.
+int validProgram(struct program *program);
+
+// Writes a compiled program to the cache, replacing the old file atomically. Failures are ignored:
+// the script is simply compiled again next time.
+void saveCachedProgram(const char *path, struct program *program, uint64_t scriptHash, size_t scriptSize);
+
+// Removes the least recently used files from the cache directory holding `path` until the cache is
+// no larger than CACHE_MAX_BYTES. A file's mtime is its last use: loading it sets it again.
+void trimCache(const char *path);
+
+// Runs a list of commands, stopping early when the program is unwinding (exit, break, continue, Ctrl+C).
+void runList(struct program *program, int node);
+
+// Runs one node of a program; a compound command ending with '&' goes to a background subshell.
+void runNode(struct program *program, int node);
+
+// Runs one node of a program in the foreground.
+void executeNode(struct program *program, int node);
+
+// Runs a node in a subshell: a ( ) that changes shell state, or a compound command in the background.
+void runSubshell(struct program *program, int node, int background);
+
+// Runs the list of a { } group, or of a ( ) that needs no process of its own, in the shell process.
+// Redirections are applied to the shell's own stdin, stdout and stderr for the duration.
+void runGroup(struct program *program, int node);
+
+// Returns 1 if a redirection list only touches stdin, stdout and stderr, so that the shell can apply it
+// to itself; other descriptors may be the shell's own (its event loop, caches) and need a child.
+int shellRedirectable(struct redirections *redirs);
+
+// Applies redirections to the shell's own descriptors, moving aside what they replace.
+// Returns 0, or -1 (after reporting the error and restoring everything) on failure.
+int redirectShell(struct redirections *redirs, struct savedDescriptors *saved);
+
+// Puts back the descriptors redirectShell() replaced.
+void restoreShell(struct savedDescriptors *saved);
+
+// Returns 1 if running a list could change the shell's own state (variables, directory, functions, jobs,
+// exit), so that "( list )" needs a child process; commands that only produce output and status do not.
+int listNeedsFork(struct program *program, int node);
+
+// Runs a simple command: expands its words, then runs a builtin or an external command.
+void runSimpleCommand(struct program *program, int node);
+
+// Runs an expanded simple command: assignments, exit, cd, a function, a builtin or an external command.
+void runCommand(char **args, struct redirections *redirs, int background);
+
+// Runs a pipeline. External commands run in children; cd and builtins that launch commands run in
+// subshells; every other stage (builtins, functions, compound commands) runs in the shell as a coroutine,
+// so a pipeline of builtins forks nothing. The coroutines take turns whenever one would block on a pipe.
+// The status is the last stage's.
+void runPipeline(struct program *program, int node);
+
+// Entry point of a stage's coroutine: runs the stage, then returns to its scheduler for good.
+void coroutineMain();
+
+// Switches to a coroutine until it waits or finishes, with its shell state swapped in meanwhile.
+void resumeCoroutine(struct coroutine *coroutine);
+
+// Switches from the running coroutine back to the scheduler that resumed it.
+void yieldCoroutine();
+
+// Swaps the shell state held in the global variables with the one saved in state.
+void exchangeShellState(struct shellState *state);
+
+// Inside a pipeline stage, waits until a descriptor is ready for events (EPOLLIN or EPOLLOUT) while the
+// other stages run. Elsewhere it returns at once, and the caller's I/O blocks as it always has.
+// Returns 0, or -1 with errno EINTR after Ctrl+C.
+int waitDescriptor(int fd, int events);
+
+// Event source handler for the descriptor a coroutine waits on: lets its scheduler resume it.
+void handleCoroutineReady(struct eventSource *source);
+
+// Returns a coroutine stack (with a guard page below it), reusing a finished stage's when one is kept.
+char *allocateStack();
+
+// Keeps a finished stage's stack for the next pipeline, or unmaps it.
+void releaseStack(char *stack);
+
+// Called when a write failed. Inside a pipeline stage, EPIPE (no reader left) ends the stage the way
+// SIGPIPE ends a process. Returns -1, for the caller to return.
+int writeFailed();
+
+// Closes a pipeline stage's stdin and stdout where they are the pipeline's own pipe ends.
+void closeStageEnds(int *fds, int stage);
+
+// In a child forked inside a pipeline stage: moves the stage's descriptors onto stdin, stdout and stderr,
+// and closes the pipelines' other pipe ends, so the stages reading them still see end of file.
+void inheritCommandFDs();
+
+// Runs a while, until or for loop.
+void runLoop(struct program *program, int node);
+
+// Defines (or redefines) a function from a NODE_FUNCTION node, keeping a reference to its program.
+void defineFunction(struct program *program, int node);
+
+// Returns the function called `name`, or NULL if there is none.
+struct variable *findFunction(const char *name);
+
+// Calls a function in the shell process, or in a subshell when it runs in the background or redirects
+// descriptors other than stdin, stdout and stderr.
+// - args: The function's name followed by its arguments, which become "$1"... for the call.
+void callFunction(struct variable *function, char **args, struct redirections *redirs, int background);
+
+// Runs a function body in the shell process, with args as the positional parameters of a new frame.
+void runFunction(struct program *program, int body, char **args);
+
+// Returns 1 if the commands being run must stop: exit, return, a pending break or continue, or Ctrl+C.
+int unwinding();
+
+// Called after each pass through a loop body. Returns 1 if the loop must end (consuming one level of
+// a pending break or continue as appropriate).
+int loopShouldStop();
+
+// Expands a compiled simple command into its arguments and redirections.
+// - args: Receives the expanded arguments, ending with NULL; values may point into the program or lineArena.
+// - redirs: Receives the command's redirections (<, >, >>, 2>, 2>&1, &>, <>, n>&-, ...) in the order given.
+// - background: Set if the command ends with '&' (and foreground-only mode is off).
+// Returns 1 for a command to run, and 0 if nothing is left to run or a redirection or expansion failed.
+int expandCommand(struct program *program, int node, char **args, struct redirections *redirs, int *background);
+
+// Adds a field to a command's arguments, replaced by the sorted paths it matches when it is a glob pattern.
+// Returns the new argument count, or -1 (reported) if the matches do not fit in MAX_ARGS.
+int addField(char **args, int argCount, char *field);
+
+// Adds one argument, leaving room for the terminating NULL.
+// Returns the new argument count, or -1 (reported) if it does not fit in MAX_ARGS.
+int addArgument(char **args, int argCount, char *word);
+
+// Expands a glob pattern ('*', '?', "[...]" in any path component) against the file system.
+// Returns the sorted matching paths (in lineArena) and sets count, or returns NULL when the word is not
+// a pattern or matches nothing, in which case it stands for itself.
+char **expandGlob(const char *pattern, int *count);
+
+// Returns 1 if a word holds a glob character outside quotes: '*', '?', or a '[' closed by a later ']'.
+int hasGlob(const char *word);
+
+// Matches the directories reached so far against the rest of a pattern, one component at a time.
+// - path: The directory matched so far, ending with '/' (empty for the current directory).
+// - rest: The remaining pattern components.
+void globSearch(struct capture *path, const char *rest, struct globResults *results);
+
+// Matches a "**" component: any number of directories below path, found with walkTree(), followed by
+// the rest of the pattern. Like bash's globstar, it does not enter hidden directories or follow symlinks.
+void globStar(struct capture *path, const char *next, struct globResults *results);
+
+// walkTree() consumer that adds a batch of paths to a glob's results.
+int collectWalkBatch(struct walkBatch *batch, void *context);
+
+// Walks the directory tree under root with a pool of threads, passing matches to emit as they are found.
+// - prefix: Put in front of every reported path, e.g. "root/".
+// - emit: Called in the calling thread with each batch of paths, in no particular order; returning -1
+//   (e.g. the reader went away) stops the walk.
+// Returns 0 once every directory has been read, or -1 (errno set) if root cannot be opened.
+int walkTree(const char *root, const char *prefix, struct walker *walker,
+             int (*emit)(struct walkBatch *batch, void *context), void *context);
+
+// Walker thread: reads directories from its own deque, steals from the others when it runs dry, and
+// leaves once no directory is pending anywhere.
+void *walkThreadMain(void *arg);
+
+// Reads one directory (closing fd and freeing path), reporting matches and queueing subdirectories.
+void walkDirectory(struct walkThread *thread, int fd, char *path);
+
+// Takes a directory to read: the newest of the thread's own, or else the oldest of another thread's.
+// Returns 1 if it found one.
+int takeWalkTask(struct walkThread *thread, struct walkTask *task);
+
+// Appends a matched path to the thread's batch, publishing the batch first when it is full.
+void addWalkResult(struct walkThread *thread, const char *path, size_t pathLength, const char *name, size_t nameLength);
+
+// Pushes the thread's batch onto the walker's result stack and wakes the shell.
+void publishWalkBatch(struct walkThread *thread);
+
+// Takes every published batch (oldest first) and passes it to emit, or just frees it once the walk is stopping.
+void drainWalk(struct walker *walker, int (*emit)(struct walkBatch *batch, void *context), void *context);
+
+// Adds a path to a glob's results.
+void addGlobResult(struct globResults *results, const char *path, size_t length);
+
+// Compiles one path component of a glob pattern. The steps are allocated in lineArena.
+void compileGlob(const char *pattern, struct globMatcher *matcher);
+
+// Returns 1 if a name matches a compiled glob component.
+int globMatch(struct globMatcher *matcher, const char *name, size_t length);
+
+// Returns the listing of a directory, from the cache when the directory's mtime is unchanged, and
+// otherwise read with large getdents64 batches. Returns NULL if it cannot be read.
+struct globListing *listDirectory(const char *path);
+
+// Reads the entries of an open directory (but "." and "..") into an empty listing, with large getdents64
+// batches. Touches nothing but the listing, so threads can use it too.
+void readListing(int fd, struct globListing *listing);
+
+// Releases a cached directory listing's memory.
+void freeListing(struct globListing *listing);
+
+// qsort() comparison of two strings, for sorting glob results.
+int compareStrings(const void *a, const void *b);
+
+// Expands one redirection word of a compiled command into redirs, attaching a here-document's body.
+// Returns 1 on success, or 0 if it is malformed or cannot be set up (reported, with $? set to 1).
+int expandRedirection(struct program *program, struct word *word, struct redirections *redirs);
+
+// Forks a child copy of the shell to run commands in, with an event loop of its own and none of the
+// parent's jobs, watchers or schedules. Ctrl+C stops it.
+// Returns the child's pid in the parent and 0 in the child.
+pid_t forkSubshell();
+
+// Forks a subshell for commands that cannot run in the shell itself. In the child, sets up a background
+// child (own process group, SIGINT ignored, /dev/null for stdin and stdout) and applies the redirections.
+// Returns the child's pid in the parent, which passes it to finishSubshell(), and 0 in the child.
+pid_t startSubshell(struct redirections *redirs, int background);
+
+// Waits for a foreground subshell (setting lastStatus), or reports a background one as a job.
+void finishSubshell(pid_t spawnpid, int background);
+
+// Ends a subshell, with the status of its last command.
+void exitSubshell();
+
+// Runs a list of a program in a subshell with its stdout on a pipe, appending the output to a capture.
+void captureSubshell(struct program *program, int node, struct capture *output);
+
+// Returns the ')' closing the '(' at `open`, skipping nested parentheses and quoted text, or NULL if none.
+char *findClosingParen(char *open);
+
+// Expands a word in one pass: "$NAME" and "${NAME}" become variable values, "$$", "$?", "$!", "$#",
+// "$0"... and "$@" the special parameters, and "$(cmd)" the output of cmd less its trailing newlines.
+// - token: The word to expand; the text of its substitutions is split up in place.
+// Returns the expanded word in lineArena (or the token itself if it has no '$'), or NULL (after printing
+// an error) if a "$(" or "${" is not closed.
+char *expandWord(char *token);
+
+// Evaluates an integer arithmetic expression with 64-bit signed values, as in "$(( ))".
+// Supports C's operators (plus ** and the comma operator), assignment to variables and ++/--;
+// names stand for the values of variables, unset ones for 0.
+// - text: The expression.
+// - result: Receives the value.
+// Returns 0 on success, or -1 (after printing an error) on a syntax error, overflow or division by zero.
+int evalArithmetic(const char *text, long long *result);
+
+// Returns the first of the two ')' ending a "$(( ))" that starts at p, or NULL if p does not start one.
+char *findArithmeticEnd(char *p);
+
+// Skips blanks, then returns 1 (and steps past it) if the expression continues with the given operator.
+int arithAccept(struct arithmetic *a, const char *op);
+
+// Precedence-climbing steps of evalArithmetic(), from lowest to highest precedence.
+// - evaluate: 0 in a branch skipped by &&, || or ?:, which is parsed but has no effect.
+long long arithComma(struct arithmetic *a, int evaluate);
+long long arithAssignment(struct arithmetic *a, int evaluate);
+long long arithTernary(struct arithmetic *a, int evaluate);
+long long arithBinary(struct arithmetic *a, int minPrecedence, int evaluate);
+long long arithUnary(struct arithmetic *a, int evaluate);
+long long arithPrimary(struct arithmetic *a, int evaluate);
+
+// Applies a binary operator, checking for overflow and division by zero.
+long long arithApply(struct arithmetic *a, const char *op, long long left, long long right);
+
+// Reports an arithmetic error (only the first one of an expression).
+void arithError(struct arithmetic *a, const char *message);
+
+// Returns the value of a variable as a number (0 if unset or empty).
+long long arithVariable(struct arithmetic *a, const char *name, size_t length);
+
+// Appends the value of a variable or special parameter to a word being expanded.
+// - name/length: The parameter's name, e.g. "HOME", "?" or "10"; not NUL-terminated.
+void appendParameter(struct capture *word, const char *name, size_t length);
+
+// Returns the length of the variable name at the start of `text`, or 0 if it does not start with one.
+size_t nameLength(const char *text);
+
+// Returns the number of leading "NAME=value" words in args.
+int countAssignments(char **args);
+
+// Finds a variable by name, optionally adding an unset one for it.
+// - name/length: The name; not NUL-terminated.
+// - create: Add the name if it is not in the table yet.
+// Returns the variable, or NULL if it is not in the table and create is 0.
+struct variable *findVariable(const char *name, size_t length, int create);
+
+// Sets a variable, keeping it exported (and the environment in step) if it already was.
+// - value: The new value, copied; NULL unsets the variable.
+void setVariable(const char *name, size_t length, const char *value);
+
+// Applies a "NAME=value" word to the variable store.
+void assignVariable(const char *word);
+
+// Brings a variable's slot in the environment block up to date: adds, replaces or removes its entry.
+void publishVariable(struct variable *variable);
+
+// Returns a copy of the environment block in a single allocation (free() releases it), for another
+// thread to use while the shell goes on changing its own.
+char **copyEnvironment();
+
+// Sets "NAME=value" prefix words as exported variables until popAssignments(), for builtins.
+// - saved: Receives the previous state of each variable, one per word.
+void pushAssignments(char **args, int count, struct savedVariable *saved);
+
+// Restores the variables changed by pushAssignments(), in reverse order.
+void popAssignments(struct savedVariable *saved, int count);
+
+// Returns the value of a variable, or NULL if it is not set.
+const char *getVariable(const char *name);
+
+// Executes a command in a child process with the shell's environment block. Leading "NAME=value"
+// words are patched into the child's copy of the block rather than building a new one.
+// Does not return; exits with status 1 if the command cannot be executed.
+void execCommand(char **args);
+
+// Imports the environment into the variable store and sets up "$$" and the positional parameters.
+// - argv: "$0" (the shell's name, or a script's path) followed by "$1"...; NULL-terminated.
+void initVariables(char **argv);
+
+// Runs the command of a "$(...)" substitution and appends its output to a capture.
+// - text: The command between the parentheses.
+// - output: Capture receiving the command's stdout.
+// Builtins such as echo, pwd and cat run in-process and write straight into the capture; anything else
+// is forked with its stdout on a pipe that is read into the capture. Sets lastStatus.
+void substituteCommand(char *text, struct capture *output);
+
+// Returns `size` bytes from an arena, starting a new block when the current one is full.
+void *arenaAlloc(struct arena *arena, size_t size);
+
+// Releases everything allocated from an arena, keeping its newest block for reuse.
+void arenaReset(struct arena *arena);
+
+// Records the current end of an arena, and later releases everything allocated after it.
+struct arenaMark arenaMark(struct arena *arena);
+void arenaRelease(struct arena *arena, struct arenaMark mark);
+
+// Copies a string into an arena.
+char *arenaCopy(struct arena *arena, const char *text);
+
+// Makes room for at least `size` more bytes in a capture.
+// Returns a pointer to the free space, which the caller fills before adding to capture->length.
+char *captureReserve(struct capture *capture, size_t size);
+
+// Appends bytes to a capture.
+void captureAppend(struct capture *capture, const char *data, size_t length);
+
+// Reads once from a descriptor straight into a capture's free space; a pipeline stage waits for input first.
+// Returns what read() returned, or -1 (EINTR) if Ctrl+C ended the wait.
+ssize_t captureRead(struct capture *capture, int fd);
+
+// Changes the shell's current working directory ("cd [dir | -]"), reporting failures (status 1).
+// - args: Array of arguments; args[1] is the target directory path.
+// If no argument is provided, it changes to the HOME directory; "-" goes back to the previous
+// directory, through its saved descriptor, and prints where that is.
+void changeDirectory(char **args);
+
+// Makes path (or, if `saved` is given, the directory saved there) the current directory. On success the
+// directory left becomes previousDirectory, PWD and OLDPWD are updated, and the visit is recorded for `z`.
+// Otherwise the error is reported, prefixed with command. Returns 0 or -1.
+int moveToDirectory(const char *path, struct savedDirectory *saved, const char *command);
+
+// Takes an O_PATH descriptor and the path of the current directory. Returns 0, or -1 if it has none.
+int saveDirectory(struct savedDirectory *saved);
+
+// Goes back to a saved directory: one fchdir(), unless the directory has been removed since, in which
+// case its path is tried. Returns 0, or -1 with errno set.
+int returnToDirectory(struct savedDirectory *saved);
+
+// Releases a saved directory's descriptor and path.
+void releaseDirectory(struct savedDirectory *saved);
+
+// "pushd [dir]" builtin: saves the current directory on the stack and changes to dir, or without one
+// swaps the current directory with the top of the stack. Prints the stack, as `dirs` does.
+void pushdCommand(char **args, struct redirections *redirs, int background);
+
+// "popd" builtin: returns to the directory on top of the stack, and removes it.
+void popdCommand(char **args, struct redirections *redirs, int background);
+
+// "dirs" builtin: prints the current directory followed by the stack, newest first.
+void dirsCommand(char **args, struct redirections *redirs, int background);
+
+// "z [-l] [pattern...]" builtin: changes to the most frecent visited directory whose path holds the
+// patterns in order (ignoring case unless a pattern has capitals). -l, or no patterns, lists the
+// matching directories with their scores instead.
+void zCommand(char **args, struct redirections *redirs, int background);
+
+// Maps the frecency database ($SMALLSH_Z, or ~/.smallsh_z), creating it if needed. Returns 0 or -1.
+int openFrecency();
+
+// Records a visit to a directory in the frecency database (interactive shells only).
+void recordVisit(const char *path);
+
+// Returns an entry's score now: its rank, decayed for the time since its last visit.
+double frecencyScore(struct frecencyEntry *entry, time_t now);
+
+// Returns 2^(-seconds / FRECENCY_HALF_LIFE), closely enough for ranking and without libm.
+double decayFactor(int64_t seconds);
+
+// Returns 1 if path holds each pattern, in order.
+int matchesPatterns(const char *path, char **patterns);
+
+// qsort() comparison of frecency entries, lowest rank first.
+int compareRanks(const void *a, const void *b);
+
+// Looks up a builtin by name.
+// Returns the builtin, or NULL if the name belongs to an external command.
+struct builtin *findBuiltin(const char *name);
+
+// Runs a builtin, setting up its descriptors from the redirections first when it owns them.
+// - background: Builtins that own their I/O run in a forked child when started with '&'.
+void runBuiltin(struct builtin *builtin, char **args, struct redirections *redirs, int background);
+
+// Runs a builtin that owns its I/O in the shell process, interruptible by Ctrl+C.
+// - io: The builtin's default descriptors, which its redirections are applied to.
+void runBuiltinWith(struct builtin *builtin, char **args, struct redirections *redirs, struct builtinIO *io);
+
+// Applies a redirection list to a builtin's descriptor set, opening files as needed.
+// - io: Holds the default descriptors on entry (e.g. /dev/null for background builtins).
+// Returns 0 on success, or -1 (after printing an error and closing what was opened) on failure.
+int openBuiltinIO(struct redirections *redirs, struct builtinIO *io);
+
+// Closes the descriptors openBuiltinIO() opened.
+void closeBuiltinIO(struct builtinIO *io);
+
+// Writes all of a buffer to a descriptor, retrying short writes.
+// Returns 0 on success, or -1 on error.
+int writeAll(int fd, const char *data, size_t length);
+
+// Writes to one of the current builtin's descriptors, or to its capture when the descriptor is CAPTURE_FD.
+// Returns 0 on success, or -1 on error.
+int builtinWrite(int fd, const char *data, size_t length);
+
+// printf() to the current builtin's stdout.
+void builtinPrintf(const char *format, ...);
+
+// Copies everything readable from one descriptor to another, inside the kernel where it can:
+// copy_file_range between regular files (a reflink or server-side copy where supported), splice when
+// either side is a pipe, sendfile from a regular file, and a read/write loop as the last resort.
+// Returns 0 on success, or -1 (with errno set) on error.
+int copyFD(int in, int out);
+
+// Returns 1 if both descriptors are the same regular file, which cat must not copy onto itself
+// (with >> it would keep reading what it has just appended), and 0 otherwise.
+int isOutputFile(int in, int out);
+
+// "status" builtin: reports the exit value or terminating signal of the last foreground process.
+void statusCommand(char **args, struct redirections *redirs, int background);
+
+// "cat [file...]" builtin: copies the files (or stdin) to stdout through copyFD().
+void catCommand(char **args, struct redirections *redirs, int background);
+
+// "export [NAME[=value]...]" builtin: marks variables for the environment, or lists the exported ones.
+void exportCommand(char **args, struct redirections *redirs, int background);
+
+// "unset [-f] NAME..." builtin: removes variables, from the environment as well, or functions with -f.
+void unsetCommand(char **args, struct redirections *redirs, int background);
+
+// "set [-- arg...]" builtin: replaces the positional parameters, or lists the variables without arguments.
+void setCommand(char **args, struct redirections *redirs, int background);
+
+// "let expr..." builtin: evaluates each arithmetic expression; the status is 0 if the last one is non-zero.
+void letCommand(char **args, struct redirections *redirs, int background);
+
+// "break [n]" and "continue [n]" builtins: leave, or go on with the next pass of, the n innermost loops.
+void loopControlCommand(char **args, struct redirections *redirs, int background);
+
+// "return [n]" builtin: ends the function being run, with status n (default: the last command's).
+void returnCommand(char **args, struct redirections *redirs, int background);
+
+// "alias [name[=value...]]" builtin: defines an alias, whose value is the rest of the line (outer quotes
+// removed), or prints the named aliases, or all of them.
+void aliasCommand(char **args, struct redirections *redirs, int background);
+
+// "unalias name..." builtin: removes aliases.
+void unaliasCommand(char **args, struct redirections *redirs, int background);
+
+// "prompt [template]" builtin: sets $PROMPT to the rest of the line (outer quotes removed, as for
+// alias, so that it can end in a space), or prints it.
+void promptCommand(char **args, struct redirections *redirs, int background);
+
+// "true" (and ":") and "false" builtins: do nothing, successfully or not.
+void trueCommand(char **args, struct redirections *redirs, int background);
+void falseCommand(char **args, struct redirections *redirs, int background);
+
+// "echo [-n] [word...]" builtin: prints the words separated by spaces, in a single write.
+void echoCommand(char **args, struct redirections *redirs, int background);
+
+// "pwd" builtin: prints the current working directory.
+void pwdCommand(char **args, struct redirections *redirs, int background);
+
+// "tee [-a] [file...]" builtin: copies stdin to stdout and to every file. A pipe on stdin is duplicated
+// with tee(2) and the copies are spliced out, so the data never passes through user space.
+void teeCommand(char **args, struct redirections *redirs, int background);
+
+// Displays the status of the last foreground process.
+// Reports the exit value if the process terminated normally, or the signal number if it was killed by a signal.
+void displayStatus();
+
+// Sets lastStatus to the wait status of the command just run, and clears lastTimedOut: only timeoutCommand()
+// sets that again, after calling this.
+void setStatus(int status);
+
+// Executes a command by creating a new process.
+// - args: Array of command arguments.
+// - redirs: The command's redirections, applied in order in the child.
+// - background: Flag indicating if the process should run in the background.
+// Applies the redirections and executes the command using `execvpe`.
+// Returns the tracked job for a background command, or NULL once a foreground command has finished.
+struct job *executeCommand(char **args, struct redirections *redirs, int background);
+
+// Forks a child that applies the redirections and executes the command; the caller waits for or tracks it.
+// - args/redirs/background: As for executeCommand().
+// - ownGroup: Put the child in a process group of its own, so the shell can signal it with its children.
+//   A foreground child in its own group also becomes the terminal's foreground group; the caller takes
+//   the terminal back with setTerminalGroup(getpgrp()) once it is done.
+// Returns the child's pid.
+pid_t spawnCommand(char **args, struct redirections *redirs, int background, int ownGroup);
+
+// Makes a process group the foreground group of the terminal on stdin, so that it may read from it and
+// gets the terminal's Ctrl+C. Does nothing when stdin is not a terminal.
+void setTerminalGroup(pid_t group);
+
+// Returns 1 if stdin is a terminal and this process's group is its foreground group, 0 otherwise.
+int ownsTerminal();
+
+// Runs a command with a time limit ("timeout [-k grace] duration cmd").
+// - args: "timeout", the optional "-k grace", the duration, then the command and its arguments.
+// - redirs/background: As for executeCommand().
+// When the time runs out the job's process group gets SIGTERM (and SIGCONT, in case it is stopped), and
+// SIGKILL once the grace period (default DEFAULT_KILL_GRACE) has passed as well. The timeout is recorded
+// in the job's status. A foreground job has the terminal while it runs.
+void timeoutCommand(char **args, struct redirections *redirs, int background);
+
+// Runs a line-oriented, stateless filter over a large input file in parallel ("split -j N cmd < in > out").
+// - args: "split", optionally "-j" and the number of chunks, then the filter command and its arguments.
+// - redirs: Must open the input file on stdin, since the chunks are cut from an mmap of it. If stdout is
+//   redirected to a file, it receives the outputs in chunk order; other redirections apply to every copy.
+// The input is cut at newline boundaries, each chunk is piped into its own copy of the command,
+// and the outputs are concatenated in the original order. Always runs in the foreground.
+void splitCommand(char **args, struct redirections *redirs, int background);
+
+// "walk [-a] [-j N] [dir [pattern]] [-- cmd [args...]]" builtin: lists the paths below dir (default ".")
+// whose names match pattern, read by walkTree() threads, in no particular order. With "-- cmd" the paths
+// are streamed to cmd's stdin instead, as they are found. -a includes hidden entries.
+void walkCommand(char **args, struct redirections *redirs, int background);
+
+// walkTree() consumer for the walk builtin: writes a batch as lines to the descriptor context points to.
+int writeWalkBatch(struct walkBatch *batch, void *context);
+
+// Parses one redirection word ("2>>log", ">&1", "&>file", "<<<text", ...) into redirs.
+// - token: The operator with its target; it is split up in place.
+// - redirs: List to append to. A here-document gets its memfd from the caller, which has its body.
+// File targets and here-strings are expanded like arguments.
+// Returns 1 if the token was a redirection, 0 if it is an ordinary word, and -1 if it is malformed.
+int parseRedirection(char *token, struct redirections *redirs);
+
+// Reads the descriptor number at the start of text (digits only, as parseRedirection() found them).
+// Returns the number, or -1 if it does not fit in an int.
+int parseDescriptor(const char *text);
+
+// Creates a sealed, close-on-exec memfd holding the given bytes, positioned at the start.
+// - name: Label shown in /proc/<pid>/fd.
+// - data/length: The contents.
+// Returns the descriptor (10 or above, so that an "N>" redirection before it cannot replace it), or -1
+// (after printing an error) if it cannot be created.
+int sealedMemfd(const char *name, const char *data, size_t length);
+
+// Closes the memfds owned by a redirection list once the command no longer needs them.
+void releaseRedirections(struct redirections *redirs);
+
+// Applies a redirection list to the current process; used in children between fork and exec.
+// - redirs: The list to apply, in order.
+// - skipStdio: Leave actions on stdin and stdout out, for callers that wire those themselves (split).
+// Exits the child with status 1 if a file cannot be opened or a descriptor cannot be duplicated.
+void applyRedirections(struct redirections *redirs, int skipStdio);
+
+// Resolves each file redirection's directory through the dirfd cache, ahead of forking.
+// After this, the child opens targets with openat() relative to an already-open directory.
+void resolveRedirections(struct redirections *redirs);
+
+// Returns an O_PATH descriptor for the directory, opening and caching it on first use. A cached
+// descriptor is reopened when the path has come to name another directory (rm -r d; mkdir d).
+// - dir: The directory path (absolute, or relative to the current directory).
+// Returns the descriptor (10 or above, clear of user redirections), or -1 if it cannot be opened.
+int cachedDirFD(const char *dir);
+
+// Drops the cached directories given by relative paths; called after the working directory changes.
+void flushRelativeDirCache();
+
+// Returns 1 if any redirection in the list sets up the given descriptor, 0 otherwise.
+int redirectsFD(struct redirections *redirs, int fd);
+
+// Returns the last redirection that sets up the given descriptor, or NULL if none does.
+struct redirection *findRedirection(struct redirections *redirs, int fd);
+
+// Copies a parsed command so it outlives the input buffer it points into, and compiles it.
+// - args: Arguments of the command, ending with NULL; quotes around the whole command are removed.
+// - redirs: Redirections of the command.
+// Returns 0, or -1 after reporting a syntax error (nothing is kept then).
+int storeCommand(struct storedCommand *command, char **args, struct redirections *redirs);
+
+// Releases the copies made by storeCommand().
+void freeStoredCommand(struct storedCommand *command);
+
+// Starts a run of a stored command as a background job, the way "cmd &" runs a compound command:
+// in a subshell of its own, with the stored redirections.
+// Returns the job.
+struct job *startStoredCommand(struct storedCommand *command);
+
+// Returns a malloc'd absolute path naming the same file as `path` from any directory later on.
+// Symbolic links are resolved where the file (or else its directory) exists.
+char *absolutePath(const char *path);
+
+// Starts tracking a background process, watching its pidfd in the event loop.
+// Returns the new job.
+struct job *addJob(pid_t pid);
+
+// Fills in a job for the given process and registers its pidfd with the event loop.
+void trackJob(struct job *job, pid_t pid);
+
+// Arms a job's time limit: SIGTERM after `limit` nanoseconds, SIGKILL `grace` nanoseconds later.
+void setJobTimeout(struct job *job, long long limit, long long grace);
+
+// Event source handler for a job's timerfd: escalates from SIGTERM to SIGKILL.
+void handleJobTimeout(struct eventSource *source);
+
+// Records a job's exit status and notifies its owner. Called once the process has been reaped.
+void jobReaped(struct job *job, int status);
+
+// Event source handler for a job's pidfd: reaps the job once its process has exited.
+void handleJobExit(struct eventSource *source);
+
+// Registers a watcher ("watch [-d ms] [-r] path... -- cmd"), or lists the watchers when given no arguments.
+// - args: "watch", options, the paths to watch, "--", then the command and its arguments.
+// - redirs: Redirections applied to every run of the command.
+// -d sets the debounce window in milliseconds; -r cancels a still-running run instead of queueing behind it.
+void watchCommand(char **args, struct redirections *redirs, int background);
+
+// Removes the watcher with the id given in args[1] ("unwatch id").
+void unwatchCommand(char **args, struct redirections *redirs, int background);
+
+// Unlinks and frees a watcher. A run in progress continues as an ordinary background job.
+void removeWatcher(struct watcher *watcher);
+
+// Event source handler for the inotify instance: restarts the debounce timer of every watcher hit.
+void handleInotifyEvents(struct eventSource *source);
+
+// Event source handler for a watcher's debounce timer: the paths went quiet, so run (or queue) the command.
+void handleWatcherTimer(struct eventSource *source);
+
+// Starts a background run of a watcher's command.
+void startWatcherRun(struct watcher *watcher);
+
+// Job exit notification for watcher runs: starts the queued run, if any.
+void watcherRunExited(struct job *job);
+
+// Waits for a foreground process while the event loop keeps serving watchers, timers and background jobs.
+// - pid: The foreground child.
+// Returns the child's wait status.
+int waitForeground(pid_t pid);
+
+// Event source handler for the foreground child's pidfd: flags that waitForeground() can reap it.
+void handleForegroundExit(struct eventSource *source);
+
+// Parses a duration such as "30s", "1.5m", "250ms" or "2h" (a bare number means seconds).
+// - text: The duration; a leading '+' is accepted, as in "at +5m".
+// - nanoseconds: Receives the duration.
+// Returns 0 on success, or -1 if the text is not a valid positive duration (or too long to represent).
+int parseDuration(const char *text, long long *nanoseconds);
+
+// Registers a periodic ("every 30s cmd") or one-shot ("at +5m cmd") command, or lists them with no arguments.
+// - args: "every" or "at", the duration, then the command and its arguments.
+// - redirs: Redirections applied to every run of the command.
+void scheduleCommand(char **args, struct redirections *redirs, int background);
+
+// Removes the schedule with the id given in args[1] ("unschedule id").
+void unscheduleCommand(char **args, struct redirections *redirs, int background);
+
+// Event source handler for a schedule's timerfd: starts a run unless the previous one is still going.
+void handleScheduleTimer(struct eventSource *source);
+
+// Job exit notification for scheduled runs: allows the next run to start.
+void scheduledRunExited(struct job *job);
+
+// Unlinks and frees a schedule. A run in progress continues as an ordinary background job.
+void removeSchedule(struct schedule *schedule);
+
+// Checks for completed background processes and cleans up their resources.
+// Prints the exit status or termination signal of each completed background process.
+void checkBackgroundProcesses();
+
+// Reaps the tracked jobs that have exited. Other children (the prompt thread's git) are left to
+// whoever started them, so that no one else's exit status, or pid, is taken.
+void reapJobs();
+
+// Stops all remaining background jobs when the shell exits.
+// Sends SIGTERM to every job's process group, waits for all of them at once (through their pidfds)
+// for at most SHUTDOWN_GRACE_MS, then sends SIGKILL to the stragglers and reports them.
+void killBackgroundProcesses();
+
+
+// The builtins, other than exit and cd which change the shell loop itself.
+struct builtin builtins[] = {
+    { "status", statusCommand, 1 },
+    { "echo", echoCommand, 1 },
+    { "pwd", pwdCommand, 1 },
+    { "export", exportCommand, 1 },
+    { "unset", unsetCommand, 1 },
+    { "set", setCommand, 1 },
+    { "let", letCommand, 1 },
+    { "true", trueCommand, 1 },
+    { ":", trueCommand, 1 },
+    { "false", falseCommand, 1 },
+    { "break", loopControlCommand, 0 },
+    { "continue", loopControlCommand, 0 },
+    { "return", returnCommand, 0 },
+    { "alias", aliasCommand, 1 },
+    { "unalias", unaliasCommand, 1 },
+    { "cat", catCommand, 1 },
+    { "tee", teeCommand, 1 },
+    { "split", splitCommand, 0 },
+    { "watch", watchCommand, 0 },
+    { "unwatch", unwatchCommand, 0 },
+    { "every", scheduleCommand, 0 },
+    { "at", scheduleCommand, 0 },
+    { "unschedule", unscheduleCommand, 0 },
+    { "timeout", timeoutCommand, 0 },
+    { "walk", walkCommand, 1 },
+    { "prompt", promptCommand, 1 },
+    { "pushd", pushdCommand, 1 },
+    { "popd", popdCommand, 1 },
+    { "dirs", dirsCommand, 1 },
+    { "z", zCommand, 1 },
+    { NULL, NULL, 0 }
+};
+
+int main(int argc, char **argv) {
+    // The commands read from the input, compiled
+    struct program *program;
+    
+    // Setting up signal handlers for SIGINT and SIGTSTP
+    struct sigaction SIGINT_action = {{0}}, SIGTSTP_action = {{0}}; 
+
+    // Ignore SIGINT (Ctrl+C) in the parent shell to prevent it from terminating
+    SIGINT_action.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &SIGINT_action, NULL);
+
+    // Handle SIGTSTP (Ctrl+Z) to toggle foreground-only mode
+    // SA_RESTART ensures interrupted system calls restart instead of failing
+    SIGTSTP_action.sa_handler = handle_SIGTSTP;
+    SIGTSTP_action.sa_flags = SA_RESTART;
+    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+    sigaction(SIGPIPE, NULL, &inheritedPipeAction);  // For children started while a pipeline ignores SIGPIPE
+
+    // Start the event loop that waits on input, background jobs and watched files together
+    initEventLoop();
+
+    // Keep /dev/null open for background children instead of opening it in every child
+    devNullFD = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+    // Load the environment into the variable store; a script's path becomes "$0"
+    initVariables(argc > 1 ? argv + 1 : argv);
+
+    // Script mode: "smallsh file [arg...]" runs the file instead of reading commands
+    if (argc > 1) {
+        aliasExpansion = 0;
+        int status = runScript(argv[1]);
+        killBackgroundProcesses();
+        return status;
+    }
+
+    // Interactive input is edited in raw mode
+    initLineEditor();
+
+    // Main shell loop
+    while (1) {
+        // Check if any background processes have completed
+        checkBackgroundProcesses();
+
+        // The previous command's expanded words are no longer needed
+        arenaReset(&lineArena);
+
+        // Display the shell prompt
+        showPrompt(renderPrompt());
+
+        // Read the next command (or block of commands) and compile it
+        if (readProgram(&program) == 0) {
+            // End of input behaves like "exit"
+            break;
+        }
+
+        // Run it; blank lines, comments and syntax errors leave nothing to run
+        if (program != NULL) {
+            struct timespec started, finished;
+            clock_gettime(CLOCK_MONOTONIC, &started);
+            runList(program, program->root);
+            releaseProgram(program);
+            clock_gettime(CLOCK_MONOTONIC, &finished);
+            lastDuration = (finished.tv_sec - started.tv_sec) * NSEC_PER_SEC + (finished.tv_nsec - started.tv_nsec);
+        }
+
+        // A break or continue outside any loop, or Ctrl+C, only stops this program
+        breakLevels = continueLevels = programInterrupted = nestingExceeded = 0;
+        if (exitRequested) break;
+    }
+
+    // Stop the background jobs rather than leaving them running after the shell is gone
+    killBackgroundProcesses();
+    syncHistory(1);
+
+    // Return 0 to indicate successful shell termination
+    return 0;
+}
+
+int readProgram(struct program **program) {
+    static char *text = NULL;
+    static size_t capacity = 0;
+    char line[MAX_CMD_LEN];
+    struct lineScan scan = { 0 };
+    size_t length = 0, lineStart = 0;
+
+    *program = NULL;
+    while (1) {
+        if (readLine(line, MAX_CMD_LEN) == NULL) {
+            if (length == 0) return 0;
+            // Input ended inside a block or here-document: compile what there is, which reports it
+            inputEOF = 0;
+            if (compileProgram(text, length, program) == COMPILE_INCOMPLETE) {
+                fprintf(stderr, "smallsh: syntax error: unexpected end of input\n");
+                setStatus(2 << 8);
+            }
+            return 1;
+        }
+
+        // Ctrl+C in the line editor drops the lines of an open block along with the current one
+        if (lineCancelled) {
+            lineCancelled = 0;
+            return 1;
+        }
+
+        // Collect the line (which comes in pieces when longer than the buffer)
+        size_t lineLength = strlen(line);
+        if (length + lineLength + 1 > capacity) {
+            capacity = (capacity ? capacity : MAX_CMD_LEN);
+            while (length + lineLength + 1 > capacity) capacity *= 2;
+            text = realloc(text, capacity);
+            if (text == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        memcpy(text + length, line, lineLength + 1);
+        length += lineLength;
+        if (line[lineLength - 1] != '\n') continue;
+
+        // WHY: Compiling after every line of a long block would parse it over and over.
+        // WHAT: Only compile once the lines so far close every block and here-document they open.
+        scanLine(text, lineStart, &scan);
+        lineStart = length;
+        if (scan.depth <= 0 && scan.pending == 0) {
+            int status = compileProgram(text, length, program);
+            if (status != COMPILE_INCOMPLETE) {
+                if (status == COMPILE_ERROR) setStatus(2 << 8);
+                return 1;
+            }
+        }
+
+        // Prompt for the rest of the block
+        if (isatty(STDIN_FILENO)) showPrompt("> ");
+    }
+}
+
+void scanLine(const char *text, size_t line, struct lineScan *scan) {
+    const char *p = text + line;
+
+    // Inside a here-document, a line is either body or the delimiter that ends it
+    if (scan->pending > 0) {
+        if (scan->stripTabs[0]) p += strspn(p, "\t");
+        size_t length = scan->delimiterLengths[0];
+        if (strncmp(p, text + scan->delimiters[0], length) == 0 && (p[length] == '\n' || p[length] == '\0')) {
+            scan->pending--;
+            memmove(&scan->delimiters[0], &scan->delimiters[1], scan->pending * sizeof(size_t));
+            memmove(&scan->delimiterLengths[0], &scan->delimiterLengths[1], scan->pending * sizeof(size_t));
+            memmove(&scan->stripTabs[0], &scan->stripTabs[1], scan->pending * sizeof(int));
+        }
+        return;
+    }
+
+    int commandPosition = 1;  // Keywords only count where a command starts
+    int wantDelimiter = 0;
+    int stripTabs = 0;
+    while (1) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '\n' || *p == '#') break;
+
+        // A command starts after every operator but ')'; parentheses open and close blocks too
+        const char *operator = shellOperator(p);
+        if (operator != NULL) {
+            p += strlen(operator);
+            if (operator[0] == '(') scan->depth++;
+            if (operator[0] == ')') scan->depth--;
+            commandPosition = (operator[0] != ')');
+            continue;
+        }
+
+        const char *word = p;
+        p += wordLength(p);
+        size_t length = p - word;
+
+        int keyword = 0;
+        if (commandPosition) {
+            if ((length == 2 && strncmp(word, "if", 2) == 0) || (length == 5 && strncmp(word, "while", 5) == 0) ||
+                (length == 5 && strncmp(word, "until", 5) == 0) || (length == 3 && strncmp(word, "for", 3) == 0)) {
+                scan->depth++;
+                keyword = (word[0] != 'f');  // A command follows "if", "while" and "until", not "for"
+            } else if (length == 1 && word[0] == '{') {
+                scan->depth++;
+                keyword = 1;
+            } else if ((length == 2 && strncmp(word, "fi", 2) == 0) || (length == 4 && strncmp(word, "done", 4) == 0) ||
+                       (length == 1 && word[0] == '}')) {
+                scan->depth--;
+            } else if (length > 2 && strncmp(word + length - 2, "()", 2) == 0) {
+                keyword = 1;  // "name()": the '{' after it opens the body
+            } else if ((length == 4 && (strncmp(word, "then", 4) == 0 || strncmp(word, "else", 4) == 0 ||
+                                        strncmp(word, "elif", 4) == 0)) || (length == 2 && strncmp(word, "do", 2) == 0)) {
+                keyword = 1;
+            }
+        }
+        commandPosition = keyword;
+
+        // Note here-document delimiters, attached ("<<EOF") or in the next word ("<< EOF")
+        const char *delimiter = NULL;
+        if (wantDelimiter) {
+            delimiter = word;
+            wantDelimiter = 0;
+        } else {
+            size_t operator = hereDocumentOperator(word, &stripTabs);
+            if (operator > 0 && operator < length) delimiter = word + operator;
+            if (operator > 0 && operator == length) wantDelimiter = 1;
+        }
+        if (delimiter != NULL && scan->pending < MAX_REDIRS) {
+            size_t delimiterLength = p - delimiter;
+            if (delimiterLength >= 2 && (*delimiter == '\'' || *delimiter == '"') && delimiter[delimiterLength - 1] == *delimiter) {
+                delimiter++;
+                delimiterLength -= 2;
+            }
+            scan->delimiters[scan->pending] = delimiter - text;
+            scan->delimiterLengths[scan->pending] = delimiterLength;
+            scan->stripTabs[scan->pending] = stripTabs;
+            scan->pending++;
+        }
+    }
+}
+
+int compileProgram(const char *text, size_t length, struct program **program) {
+    struct token *tokens;
+    int count;
+
+    *program = NULL;
+    char *copy = malloc(length + 1);
+    if (copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+
+    int status = lexText(copy, &tokens, &count);
+    if (status == COMPILE_OK) {
+        struct parser parser = { tokens, 0, calloc(1, sizeof(struct program)), COMPILE_OK };
+        if (parser.program == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        parser.program->references = 1;
+        parser.program->root = parseList(&parser, NULL);
+        status = parser.status;
+        if (status == COMPILE_OK) {
+            *program = parser.program;
+        } else {
+            releaseProgram(parser.program);
+        }
+    }
+    free(tokens);
+    free(copy);
+    return status;
+}
+
+int lexText(char *text, struct token **tokens, int *count) {
+    int capacity = 64;
+    int hereDocuments[MAX_REDIRS];  // Tokens whose here-document bodies follow the current line
+    int pendingCount = 0;
+    int wantDelimiter = -1;  // Token of a "<<" whose delimiter is the next word
+    char *p = text;
+
+    *count = 0;
+    *tokens = malloc(capacity * sizeof(struct token));
+    while (1) {
+        if (*count + 3 > capacity) {
+            capacity *= 2;
+            *tokens = realloc(*tokens, capacity * sizeof(struct token));
+        }
+        if (*tokens == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+
+        int atNewline = 0;
+        if (*p == '\n') {
+            p++;
+            atNewline = 1;
+        } else if (*p == '#') {
+            // A comment runs to the end of the line
+            p += strcspn(p, "\n");
+            continue;
+        } else if (shellOperator(p) != NULL) {
+            const char *operator = shellOperator(p);
+            (*tokens)[(*count)++] = (struct token){ TOKEN_OPERATOR, (char *)operator, NULL };
+            p += strlen(operator);
+            continue;
+        } else {
+            char *word = p;
+            p += wordLength(p);
+
+            // The word is terminated in place; an operator right after it becomes its own token first
+            const char *following = shellOperator(p);
+            if (*p == '\n') atNewline = 1;
+            if (*p != '\0') *p++ = '\0';
+            if (following != NULL) p += strlen(following) - 1;
+
+            int stripTabs;
+            size_t operator = hereDocumentOperator(word, &stripTabs);
+            (*tokens)[*count] = (struct token){ TOKEN_WORD, word, NULL };
+            if (wantDelimiter != -1) {
+                hereDocuments[pendingCount - 1] = wantDelimiter;  // The body belongs to the operator token
+                wantDelimiter = -1;
+            } else if (operator > 0 && pendingCount < MAX_REDIRS) {
+                if (word[operator] == '\0') wantDelimiter = *count;
+                hereDocuments[pendingCount++] = *count;
+            }
+            (*count)++;
+            if (following != NULL) (*tokens)[(*count)++] = (struct token){ TOKEN_OPERATOR, (char *)following, NULL };
+            if (!atNewline) continue;
+        }
+
+        (*tokens)[(*count)++] = (struct token){ TOKEN_NEWLINE, NULL, NULL };
+
+        // Here-document bodies follow the line, in order; each is compacted in place over its own lines
+        for (int i = 0; i < pendingCount; i++) {
+            struct token *operatorToken = &(*tokens)[hereDocuments[i]];
+            int stripTabs;
+            size_t operator = hereDocumentOperator(operatorToken->text, &stripTabs);
+            char *delimiter = (operatorToken->text[operator] != '\0') ? operatorToken->text + operator
+                                                                     : (operatorToken + 1)->text;
+            size_t delimiterLength = strlen(delimiter);
+            if (delimiterLength >= 2 && (*delimiter == '\'' || *delimiter == '"') && delimiter[delimiterLength - 1] == *delimiter) {
+                delimiter++;
+                delimiterLength -= 2;
+            }
+
+            char *body = p, *write = p;
+            while (1) {
+                if (*p == '\0') return COMPILE_INCOMPLETE;
+                char *line = p;
+                if (stripTabs) line += strspn(line, "\t");
+                size_t lineLength = strcspn(line, "\n");
+                p = line + lineLength + (line[lineLength] == '\n');
+                if (lineLength == delimiterLength && strncmp(line, delimiter, delimiterLength) == 0) break;
+                if (line[lineLength] != '\n') return COMPILE_INCOMPLETE;
+
+                memmove(write, line, lineLength + 1);
+                write += lineLength + 1;
+            }
+            *write = '\0';
+            operatorToken->body = body;
+        }
+        pendingCount = 0;
+    }
+
+    if (pendingCount > 0) return COMPILE_INCOMPLETE;  // "<<EOF" on the last line, with no body yet
+    (*tokens)[(*count)++] = (struct token){ TOKEN_END, NULL, NULL };
+    return COMPILE_OK;
+}
+
+const char *shellOperator(const char *p) {
+    if (p[0] == '&' && p[1] == '&') return "&&";
+    if (p[0] == '|' && p[1] == '|') return "||";
+    if (p[0] == '|') return "|";
+    if (p[0] == ';') return ";";
+    if (p[0] == '(') return "(";
+    if (p[0] == ')') return ")";
+    if (p[0] == '&' && strchr(" \t\n;)", p[1]) != NULL) return "&";  // Not "&>file"; strchr() matches the NUL too
+    return NULL;
+}
+
+size_t wordLength(const char *p) {
+    const char *start = p;
+    int depth = 0;
+
+    // A word that opens with a quote runs to the closing one on the same line, blanks and all
+    if (*p == '\'' || *p == '"') {
+        const char stops[] = { *p, '\n', '\0' };
+        size_t span = strcspn(p + 1, stops);
+        if (p[1 + span] == *p) p += span + 2;
+    }
+
+    while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n') {
+        if (p[0] == '$' && p[1] == '(') {
+            const char *close = findClosingParen((char *)p + 1);
+            if (close == NULL) return strcspn(start, "\n");  // Unterminated: the rest of the line, which expandWord() rejects
+            p = close + 1;
+            continue;
+        }
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (depth == 0) break;
+            depth--;
+        } else if (*p == ';' || (p[0] == '&' && p[1] == '&') || (*p == '|' && (p == start || p[-1] != '>'))) {
+            break;  // "a|b", but not ">|file"
+        } else if (*p == '&' && p[-1] != '>' && p[-1] != '<' && p != start && strchr(" \t\n;)", p[1]) != NULL) {
+            break;  // "cmd&", but not "2>&1"
+        }
+        p++;
+    }
+    return p - start;
+}
+
+size_t hereDocumentOperator(const char *word, int *stripTabs) {
+    size_t digits = strspn(word, "0123456789");
+    if (word[digits] != '<' || word[digits + 1] != '<' || word[digits + 2] == '<') return 0;
+    *stripTabs = (word[digits + 2] == '-');
+    return digits + 2 + *stripTabs;
+}
+
+size_t redirectionOperator(const char *word) {
+    static const char *operators[] = { "<<<", "<<-", "<<", "<>", "<&", "<", ">>", ">|", ">&", ">", NULL };
+
+    const char *p = word + strspn(word, "0123456789");
+    if (p == word && p[0] == '&' && p[1] == '>') p++;  // "&>" and "&>>"
+    for (int i = 0; operators[i] != NULL; i++) {
+        size_t length = strlen(operators[i]);
+        if (strncmp(p, operators[i], length) == 0) return (p - word) + length;
+    }
+    return 0;
+}
+
+int parseList(struct parser *parser, const char *const *terminators) {
+    int head = -1, tail = -1;
+
+    while (parser->status == COMPILE_OK) {
+        struct token *token = &parser->tokens[parser->position];
+        if (token->type == TOKEN_NEWLINE) {
+            parser->position++;
+            continue;
+        }
+        if (token->type == TOKEN_END) break;
+
+        int stop = 0;
+        for (int i = 0; terminators != NULL && terminators[i] != NULL; i++) {
+            if (strcmp(token->text, terminators[i]) == 0) stop = 1;
+        }
+        if (stop) break;
+
+        int node = parseAndOr(parser);
+        if (node == -1) return -1;
+        if (tail == -1) {
+            head = node;
+        } else {
+            parser->program->nodes[tail].next = node;
+        }
+        tail = node;
+
+        // Each command ends with a newline, ';' or '&' (or the keyword or ')' closing its block)
+        token = &parser->tokens[parser->position];
+        if (token->type == TOKEN_OPERATOR && strcmp(token->text, ";") == 0) {
+            parser->position++;
+        } else if (token->type == TOKEN_OPERATOR && strcmp(token->text, "&") == 0) {
+            parser->program->nodes[node].flags |= NODE_BACKGROUND;
+            parser->position++;
+        }
+    }
+    return head;
+}
+
+int parseAndOr(struct parser *parser) {
+    int left = parsePipeline(parser);
+
+    while (left != -1) {
+        struct token *token = &parser->tokens[parser->position];
+        if (token->type != TOKEN_OPERATOR || (strcmp(token->text, "&&") != 0 && strcmp(token->text, "||") != 0)) break;
+        int type = (token->text[0] == '&') ? NODE_AND : NODE_OR;
+
+        // The right-hand command may start on the next line
+        parser->position++;
+        while (parser->tokens[parser->position].type == TOKEN_NEWLINE) parser->position++;
+        if (parser->tokens[parser->position].type == TOKEN_END) {
+            parser->status = COMPILE_INCOMPLETE;
+            return -1;
+        }
+
+        int right = parsePipeline(parser);
+        if (right == -1) return -1;
+        int node = addNode(parser->program, type);
+        parser->program->nodes[node].a = left;
+        parser->program->nodes[node].b = right;
+        left = node;
+    }
+    return left;
+}
+
+int parsePipeline(struct parser *parser) {
+    int first = parseCommand(parser);
+    struct token *token = &parser->tokens[parser->position];
+    if (first == -1 || token->type != TOKEN_OPERATOR || strcmp(token->text, "|") != 0) return first;
+
+    int node = addNode(parser->program, NODE_PIPELINE);
+    int last = first;
+    while (token->type == TOKEN_OPERATOR && strcmp(token->text, "|") == 0) {
+        // The next stage may start on the next line
+        parser->position++;
+        while (parser->tokens[parser->position].type == TOKEN_NEWLINE) parser->position++;
+        if (parser->tokens[parser->position].type == TOKEN_END) {
+            parser->status = COMPILE_INCOMPLETE;
+            return -1;
+        }
+
+        int stage = parseCommand(parser);
+        if (stage == -1) return -1;
+        parser->program->nodes[last].next = stage;
+        last = stage;
+        token = &parser->tokens[parser->position];
+    }
+    parser->program->nodes[node].a = first;
+    return node;
+}
+
+int parseCommand(struct parser *parser) {
+    static const char *doWords[] = { "do", NULL };
+    static const char *doneWords[] = { "done", NULL };
+    static const char *reserved[] = { "then", "elif", "else", "fi", "do", "done", "}", NULL };
+    struct program *program = parser->program;
+    struct token *token = &parser->tokens[parser->position];
+    const char *word = token->text;
+    size_t length = strlen(word);
+
+    if (token->type == TOKEN_OPERATOR) {
+        if (strcmp(word, "(") != 0) {
+            syntaxError(parser);
+            return -1;
+        }
+        parser->position++;
+        return parseGroup(parser, NODE_SUBSHELL);
+    }
+    if (strcmp(word, "{") == 0) {
+        parser->position++;
+        return parseGroup(parser, NODE_GROUP);
+    }
+
+    if (length > 2 && nameLength(word) == length - 2 && strcmp(word + length - 2, "()") == 0) {
+        return parseFunction(parser);
+    }
+
+    if (strcmp(word, "if") == 0) {
+        parser->position++;
+        return parseIf(parser);
+    }
+
+    if (strcmp(word, "while") == 0 || strcmp(word, "until") == 0) {
+        parser->position++;
+        int node = addNode(program, word[0] == 'w' ? NODE_WHILE : NODE_UNTIL);
+        int condition = parseList(parser, doWords);
+        if (parser->status != COMPILE_OK || expectKeyword(parser, "do") == -1) return -1;
+        int body = parseList(parser, doneWords);
+        if (parser->status != COMPILE_OK || expectKeyword(parser, "done") == -1 || endBlock(parser) == -1) return -1;
+        program->nodes[node].a = condition;
+        program->nodes[node].b = body;
+        return node;
+    }
+
+    if (strcmp(word, "for") == 0) {
+        // "for name [in word...]"; without "in" the loop runs over the positional parameters
+        parser->position++;
+        struct token *name = &parser->tokens[parser->position];
+        if (name->type != TOKEN_WORD || nameLength(name->text) != strlen(name->text)) {
+            syntaxError(parser);
+            return -1;
+        }
+        parser->position++;
+
+        int node = addNode(program, NODE_FOR);
+        int first = addWord(program, name->text, strlen(name->text), NULL, WORD_ARGUMENT);
+        int count = 0;
+        if (parser->tokens[parser->position].type == TOKEN_WORD && strcmp(parser->tokens[parser->position].text, "in") == 0) {
+            for (parser->position++; parser->tokens[parser->position].type == TOKEN_WORD; parser->position++) {
+                const char *item = parser->tokens[parser->position].text;
+                addWord(program, item, strlen(item), NULL, WORD_ARGUMENT);
+                count++;
+            }
+        } else {
+            addWord(program, "$@", 2, NULL, WORD_ARGUMENT);
+            count = 1;
+        }
+        if (expectKeyword(parser, "do") == -1) return -1;
+        int body = parseList(parser, doneWords);
+        if (parser->status != COMPILE_OK || expectKeyword(parser, "done") == -1 || endBlock(parser) == -1) return -1;
+        program->nodes[node].first = first;
+        program->nodes[node].count = count;
+        program->nodes[node].b = body;
+        return node;
+    }
+
+    for (int i = 0; reserved[i] != NULL; i++) {
+        if (strcmp(word, reserved[i]) == 0) {
+            syntaxError(parser);
+            return -1;
+        }
+    }
+    return parseSimpleCommand(parser);
+}
+
+int parseIf(struct parser *parser) {
+    static const char *thenWords[] = { "then", NULL };
+    static const char *branchWords[] = { "elif", "else", "fi", NULL };
+    static const char *fiWords[] = { "fi", NULL };
+    struct program *program = parser->program;
+
+    int node = addNode(program, NODE_IF);
+    int condition = parseList(parser, thenWords);
+    if (parser->status != COMPILE_OK || expectKeyword(parser, "then") == -1) return -1;
+    int body = parseList(parser, branchWords);
+    if (parser->status != COMPILE_OK) return -1;
+
+    int otherwise = -1;
+    struct token *token = &parser->tokens[parser->position];
+    if (token->type == TOKEN_WORD && strcmp(token->text, "elif") == 0) {
+        // "elif" is an if nested in the else branch, and its "fi" closes both
+        parser->position++;
+        otherwise = parseIf(parser);
+        if (otherwise == -1) return -1;
+    } else {
+        if (token->type == TOKEN_WORD && strcmp(token->text, "else") == 0) {
+            parser->position++;
+            otherwise = parseList(parser, fiWords);
+            if (parser->status != COMPILE_OK) return -1;
+        }
+        if (expectKeyword(parser, "fi") == -1 || endBlock(parser) == -1) return -1;
+    }
+
+    program->nodes[node].a = condition;
+    program->nodes[node].b = body;
+    program->nodes[node].c = otherwise;
+    return node;
+}
+
+int parseGroup(struct parser *parser, int type) {
+    static const char *braceWords[] = { "}", NULL };
+    static const char *parenthesisWords[] = { ")", NULL };
+    struct program *program = parser->program;
+
+    int node = addNode(program, type);
+    int list = parseList(parser, type == NODE_GROUP ? braceWords : parenthesisWords);
+    if (parser->status != COMPILE_OK || expectKeyword(parser, type == NODE_GROUP ? "}" : ")") == -1) return -1;
+
+    // Only redirections may follow: "{ ...; } > log"
+    int first = program->wordCount;
+    while (parser->tokens[parser->position].type == TOKEN_WORD) {
+        if (redirectionOperator(parser->tokens[parser->position].text) == 0) {
+            syntaxError(parser);
+            return -1;
+        }
+        addCommandWord(parser);
+    }
+    program->nodes[node].a = list;
+    program->nodes[node].first = first;
+    program->nodes[node].count = program->wordCount - first;
+    return node;
+}
+
+int parseFunction(struct parser *parser) {
+    static const char *braceWords[] = { "}", NULL };
+    struct program *program = parser->program;
+    const char *name = parser->tokens[parser->position++].text;
+
+    int node = addNode(program, NODE_FUNCTION);
+    int first = addWord(program, name, strlen(name) - 2, NULL, WORD_ARGUMENT);
+    if (expectKeyword(parser, "{") == -1) return -1;
+    int body = parseList(parser, braceWords);
+    if (parser->status != COMPILE_OK || expectKeyword(parser, "}") == -1 || endBlock(parser) == -1) return -1;
+    program->nodes[node].first = first;
+    program->nodes[node].b = body;
+    return node;
+}
+
+int parseSimpleCommand(struct parser *parser) {
+    struct program *program = parser->program;
+    int node = addNode(program, NODE_COMMAND);
+    int first = program->wordCount;
+
+    // WHY: An alias is stored compiled, so using one costs no more than typing its words.
+    // WHAT: Its words are copied in place of the alias name (once: an alias may name itself, "ls=ls -F").
+    const char *name = parser->tokens[parser->position].text;
+    struct variable *alias = aliasExpansion ? findVariable(name, strlen(name), 0) : NULL;
+    if (alias != NULL && alias->aliasProgram != NULL) {
+        struct program *source = alias->aliasProgram;
+        struct node *command = &source->nodes[source->root];
+        for (int i = 0; i < command->count; i++) {
+            struct word *word = &source->words[command->first + i];
+            const char *text = source->strings + word->text;
+            addWord(program, text, strlen(text), word->body != -1 ? source->strings + word->body : NULL, word->kind);
+        }
+        program->nodes[node].flags |= command->flags;
+        parser->position++;
+    }
+
+    while (parser->tokens[parser->position].type == TOKEN_WORD) addCommandWord(parser);
+
+    program->nodes[node].first = first;
+    program->nodes[node].count = program->wordCount - first;
+    return node;
+}
+
+void addCommandWord(struct parser *parser) {
+    struct program *program = parser->program;
+    struct token *token = &parser->tokens[parser->position++];
+    struct token *next = &parser->tokens[parser->position];
+
+    size_t operator = redirectionOperator(token->text);
+    if (operator > 0 && token->text[operator] == '\0' && next->type == TOKEN_WORD) {
+        // "2> err.log" is stored as "2>err.log", the same as when written that way
+        size_t length = strlen(token->text), targetLength = strlen(next->text);
+        char joined[length + targetLength + 1];
+        memcpy(joined, token->text, length);
+        memcpy(joined + length, next->text, targetLength + 1);
+        addWord(program, joined, length + targetLength, token->body, WORD_REDIRECTION);
+        parser->position++;
+    } else {
+        addWord(program, token->text, strlen(token->text), token->body, operator > 0 ? WORD_REDIRECTION : WORD_ARGUMENT);
+    }
+}
+
+int expectKeyword(struct parser *parser, const char *keyword) {
+    struct token *skipped;
+    while ((skipped = &parser->tokens[parser->position])->type == TOKEN_NEWLINE ||
+           (skipped->type == TOKEN_OPERATOR && strcmp(skipped->text, ";") == 0)) {
+        parser->position++;
+    }
+
+    struct token *token = &parser->tokens[parser->position];
+    if (token->type == TOKEN_END) {
+        parser->status = COMPILE_INCOMPLETE;
+        return -1;
+    }
+    if (strcmp(token->text, keyword) != 0) {
+        syntaxError(parser);
+        return -1;
+    }
+    parser->position++;
+    return 0;
+}
+
+int endBlock(struct parser *parser) {
+    if (parser->tokens[parser->position].type == TOKEN_WORD) {
+        syntaxError(parser);
+        return -1;
+    }
+    return 0;
+}
+
+void syntaxError(struct parser *parser) {
+    struct token *token = &parser->tokens[parser->position];
+    if (token->type == TOKEN_END) {
+        parser->status = COMPILE_INCOMPLETE;
+        return;
+    }
+    fprintf(stderr, "smallsh: syntax error near '%s'\n", token->type == TOKEN_NEWLINE ? "newline" : token->text);
+    parser->status = COMPILE_ERROR;
+}
+
+int addNode(struct program *program, int type) {
+    if (program->nodeCount == program->nodeCapacity) {
+        program->nodeCapacity = program->nodeCapacity ? program->nodeCapacity * 2 : 16;
+        program->nodes = realloc(program->nodes, program->nodeCapacity * sizeof(struct node));
+        if (program->nodes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    program->nodes[program->nodeCount] = (struct node){ type, 0, 0, 0, -1, -1, -1, -1 };
+    return program->nodeCount++;
+}
+
+int addWord(struct program *program, const char *text, size_t length, const char *body, int kind) {
+    if (program->wordCount == program->wordCapacity) {
+        program->wordCapacity = program->wordCapacity ? program->wordCapacity * 2 : 64;
+        program->words = realloc(program->words, program->wordCapacity * sizeof(struct word));
+        if (program->words == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct word word = { addString(program, text, length), kind, -1 };
+    if (body != NULL) word.body = addString(program, body, strlen(body));
+    program->words[program->wordCount] = word;
+    return program->wordCount++;
+}
+
+int addString(struct program *program, const char *text, size_t length) {
+    if (program->stringLength + (int)length + 1 > program->stringCapacity) {
+        program->stringCapacity = program->stringCapacity ? program->stringCapacity : 1024;
+        while (program->stringLength + (int)length + 1 > program->stringCapacity) program->stringCapacity *= 2;
+        program->strings = realloc(program->strings, program->stringCapacity);
+        if (program->strings == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    int offset = program->stringLength;
+    memcpy(program->strings + offset, text, length);
+    program->strings[offset + length] = '\0';
+    program->stringLength += length + 1;
+    return offset;
+}
+
+void releaseProgram(struct program *program) {
+    if (--program->references > 0) return;
+    if (program->mapping != NULL) {
+        munmap(program->mapping, program->mappingSize);
+    } else {
+        free(program->nodes);
+        free(program->words);
+        free(program->strings);
+    }
+    free(program);
+}
+
+int runScript(const char *path) {
+    struct program *program = NULL;
+    char cachePath[PATH_MAX];
+    struct stat info;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        perror(path);
+        if (fd != -1) close(fd);
+        return 127;
+    }
+    size_t size = info.st_size;
+    const char *text = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    // WHY: For a large script, lexing and parsing cost far more than the commands it starts up with.
+    // WHAT: Run the cached program when this build already compiled these exact contents.
+    // Small scripts compile in a few milliseconds at most, so they are not worth a file in the cache
+    uint64_t scriptHash = hashBytes(text, size);
+    int cacheable = size >= CACHE_MIN_SCRIPT_SIZE && cacheFilePath(scriptHash, cachePath, sizeof(cachePath));
+    if (cacheable) program = loadCachedProgram(cachePath, scriptHash, size);
+    if (program == NULL) {
+        int status = compileProgram(text, size, &program);
+        if (status == COMPILE_INCOMPLETE) fprintf(stderr, "smallsh: %s: syntax error: unexpected end of file\n", path);
+        if (program != NULL && cacheable) saveCachedProgram(cachePath, program, scriptHash, size);
+    }
+    if (size > 0) munmap((void *)text, size);
+    if (program == NULL) return 2;
+
+    // Top-level commands run one at a time, with finished background jobs reported in between
+    for (int node = program->root; node != -1; node = program->nodes[node].next) {
+        checkBackgroundProcesses();
+        arenaReset(&lineArena);
+        runNode(program, node);
+        if (exitRequested || programInterrupted) break;  // Ctrl+C stops the whole script
+        breakLevels = continueLevels = nestingExceeded = 0;
+    }
+    releaseProgram(program);
+
+    return WIFEXITED(lastStatus) ? WEXITSTATUS(lastStatus) : 128 + WTERMSIG(lastStatus);
+}
+
+uint64_t hashBytes(const void *data, size_t length) {
+    const unsigned char *p = data;
+    uint64_t hash = 14695981039346656037ULL ^ length;
+    uint64_t word;
+
+    // Eight bytes per multiply, rather than FNV-1a's one
+    for (; length >= 8; p += 8, length -= 8) {
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    for (; length > 0; p++, length--) hash = (hash ^ *p) * 1099511628211ULL;
+    return hash ^ (hash >> 32);
+}
+
+size_t buildID(unsigned char *id) {
+    static unsigned char cached[BUILD_ID_MAX];
+    static size_t cachedLength = 0;
+
+    if (cachedLength == 0) {
+        dl_iterate_phdr(findBuildID, cached);
+        cachedLength = cached[0] ? BUILD_ID_MAX : 0;  // findBuildID() zero-pads the ID to a fixed length
+        struct stat info;
+        if (cachedLength == 0 && stat("/proc/self/exe", &info) == 0) {
+            memcpy(cached, &info.st_size, sizeof(info.st_size));
+            memcpy(cached + sizeof(info.st_size), &info.st_mtim, sizeof(info.st_mtim));
+            cachedLength = BUILD_ID_MAX;
+        }
+    }
+    memcpy(id, cached, BUILD_ID_MAX);
+    return cachedLength;
+}
+
+int findBuildID(struct dl_phdr_info *info, size_t size, void *data) {
+    unsigned char *id = data;
+
+    // The first object listed is the program itself
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type != PT_NOTE) continue;
+        const char *note = (const char *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr);
+        const char *end = note + info->dlpi_phdr[i].p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *header = (const ElfW(Nhdr) *)note;
+            const char *name = note + sizeof(ElfW(Nhdr));
+            const char *desc = name + ((header->n_namesz + 3) & ~3);
+            if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                // A leading 0xff keeps an ID that starts with a zero byte from reading as "none"
+                id[0] = 0xff;
+                memcpy(id + 1, desc, header->n_descsz < BUILD_ID_MAX - 1 ? header->n_descsz : BUILD_ID_MAX - 1);
+                return 1;
+            }
+            note = desc + ((header->n_descsz + 3) & ~3);
+        }
+    }
+    return 1;
+}
+
+int cacheFilePath(uint64_t scriptHash, char *path, size_t size) {
+    char directory[PATH_MAX];
+    const char *base = getVariable("XDG_CACHE_HOME");
+
+    // XDG_CACHE_HOME only counts when absolute; ~/.cache is the default
+    if (base == NULL || base[0] != '/') {
+        const char *home = getVariable("HOME");
+        if (home == NULL) return 0;
+        if (snprintf(directory, sizeof(directory), "%s/.cache", home) >= (int)sizeof(directory)) return 0;
+        base = directory;
+    }
+    mkdir(base, 0700);
+    if (snprintf(path, size, "%s/smallsh", base) >= (int)size) return 0;
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) return 0;
+
+    return snprintf(path, size, "%s/smallsh/%016llx.ast", base, (unsigned long long)scriptHash) < (int)size;
+}
+
+struct program *loadCachedProgram(const char *path, uint64_t scriptHash, size_t scriptSize) {
+    unsigned char id[BUILD_ID_MAX];
+    struct stat info;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    if (fstat(fd, &info) == -1 || (size_t)info.st_size < sizeof(struct cacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    // WHY: The program is run in place, and expansion never writes to it (it copies words first).
+    // WHAT: A private writable mapping all the same, so that a stray write can never reach the file.
+    size_t size = info.st_size;
+    char *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    struct cacheHeader *header = (struct cacheHeader *)mapping;
+    size_t idLength = buildID(id);
+    size_t nodesSize = (size_t)header->nodeCount * sizeof(struct node);
+    size_t wordsSize = (size_t)header->wordCount * sizeof(struct word);
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != CACHE_VERSION ||
+        idLength == 0 || header->buildIDLength != idLength || memcmp(header->buildID, id, idLength) != 0 ||
+        header->scriptHash != scriptHash || header->scriptSize != scriptSize ||
+        header->nodeCount < 0 || header->wordCount < 0 || header->stringLength < 0 ||
+        sizeof(struct cacheHeader) + nodesSize + wordsSize + header->stringLength != size) {
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    struct program *program = calloc(1, sizeof(struct program));
+    if (program == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    program->nodes = (struct node *)(mapping + sizeof(struct cacheHeader));
+    program->nodeCount = program->nodeCapacity = header->nodeCount;
+    program->words = (struct word *)(mapping + sizeof(struct cacheHeader) + nodesSize);
+    program->wordCount = program->wordCapacity = header->wordCount;
+    program->strings = mapping + sizeof(struct cacheHeader) + nodesSize + wordsSize;
+    program->stringLength = program->stringCapacity = header->stringLength;
+    program->root = header->root;
+    program->mapping = mapping;
+    program->mappingSize = size;
+    program->references = 1;
+
+    if (!validProgram(program)) {
+        releaseProgram(program);
+        return NULL;
+    }
+    utimensat(AT_FDCWD, path, NULL, 0);  // Used now: the last file trimCache() would remove
+    return program;
+}
+
+int validProgram(struct program *program) {
+    int nodes = program->nodeCount, words = program->wordCount, strings = program->stringLength;
+
+    if (program->root < -1 || program->root >= nodes) return 0;
+    if (strings > 0 && program->strings[strings - 1] != '\0') return 0;  // Every string ends inside the pool
+    for (int i = 0; i < words; i++) {
+        struct word *w = &program->words[i];
+        if ((int)w->text >= strings || w->body < -1 || w->body >= strings) return 0;
+    }
+
+    // WHY: runList() follows next links until -1 and executeNode() descends into a, b and c, so a cycle
+    // in a corrupt file would run forever. A compiled program is a tree of lists.
+    // WHAT: Each node may be linked to once (the root not at all); then no walk from the root can repeat.
+    unsigned char *linked = calloc(nodes > 0 ? nodes : 1, 1);
+    if (linked == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (program->root != -1) linked[program->root] = 1;
+
+    int valid = 1;
+    for (int i = 0; i < nodes && valid; i++) {
+        struct node *n = &program->nodes[i];
+        int links[] = { n->a, n->b, n->c, n->next };
+        valid = n->type >= NODE_COMMAND && n->type <= NODE_PIPELINE &&
+                n->first >= 0 && n->count >= 0 && n->count <= words - n->first - (n->type == NODE_FOR);
+        for (int k = 0; k < 4 && valid; k++) {
+            if (links[k] == -1) continue;
+            valid = links[k] >= 0 && links[k] < nodes && !linked[links[k]];
+            if (valid) linked[links[k]] = 1;
+        }
+    }
+    free(linked);
+    return valid;
+}
+
+void saveCachedProgram(const char *path, struct program *program, uint64_t scriptHash, size_t scriptSize) {
+    char temporary[PATH_MAX];
+    struct cacheHeader header = { CACHE_MAGIC, CACHE_VERSION };
+
+    header.buildIDLength = buildID(header.buildID);
+    if (header.buildIDLength == 0) return;
+    header.scriptHash = scriptHash;
+    header.scriptSize = scriptSize;
+    header.root = program->root;
+    header.nodeCount = program->nodeCount;
+    header.wordCount = program->wordCount;
+    header.stringLength = program->stringLength;
+
+    // Written under a temporary name and renamed into place, so a reader never sees half a file
+    if (snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path) >= (int)sizeof(temporary)) return;
+    int fd = mkstemp(temporary);
+    if (fd == -1) return;
+    int failed = writeAll(fd, (const char *)&header, sizeof(header)) == -1 ||
+                 writeAll(fd, (const char *)program->nodes, program->nodeCount * sizeof(struct node)) == -1 ||
+                 writeAll(fd, (const char *)program->words, program->wordCount * sizeof(struct word)) == -1 ||
+                 writeAll(fd, program->strings, program->stringLength) == -1;
+    if (close(fd) == -1 || failed || rename(temporary, path) == -1) {
+        unlink(temporary);
+        return;
+    }
+    trimCache(path);
+}
+
+void trimCache(const char *path) {
+    char directory[PATH_MAX], file[PATH_MAX + 256];
+    struct cacheFile *files = NULL;
+    size_t count = 0, capacity = 0;
+    long long total = 0;
+    struct stat info;
+
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash - path >= (long)sizeof(directory)) return;
+    memcpy(directory, path, slash - path);
+    directory[slash - path] = '\0';
+    DIR *dir = opendir(directory);
+    if (dir == NULL) return;
+
+    // Every program file ("<hash>.ast") with its size and the time it was last used
+    for (struct dirent *entry; (entry = readdir(dir)) != NULL; ) {
+        size_t length = strlen(entry->d_name);
+        if (length < 5 || length >= sizeof(files->name) || strcmp(entry->d_name + length - 4, ".ast") != 0) continue;
+        if (fstatat(dirfd(dir), entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(info.st_mode)) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            files = realloc(files, capacity * sizeof(*files));
+            if (files == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        memcpy(files[count].name, entry->d_name, length + 1);
+        files[count].size = info.st_size;
+        files[count].used = info.st_mtim;
+        total += info.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    // Over the limit: drop the least recently used until it fits (a selection, since this is rare)
+    while (total > CACHE_MAX_BYTES && count > 0) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < count; i++) {
+            if (files[i].used.tv_sec < files[oldest].used.tv_sec ||
+                (files[i].used.tv_sec == files[oldest].used.tv_sec && files[i].used.tv_nsec < files[oldest].used.tv_nsec)) {
+                oldest = i;
+            }
+        }
+        snprintf(file, sizeof(file), "%s/%s", directory, files[oldest].name);
+        unlink(file);
+        total -= files[oldest].size;
+        files[oldest] = files[--count];
+    }
+    free(files);
+}
+
+void runList(struct program *program, int node) {
+    for (; node != -1 && !unwinding(); node = program->nodes[node].next) runNode(program, node);
+}
+
+void runNode(struct program *program, int node) {
+    struct node *n = &program->nodes[node];
+
+    // Simple commands handle their own '&'; foreground-only mode ignores it, as it always has
+    if ((n->flags & NODE_BACKGROUND) && n->type != NODE_COMMAND && !fgOnlyMode) {
+        runSubshell(program, node, 1);
+        return;
+    }
+    executeNode(program, node);
+}
+
+void executeNode(struct program *program, int node) {
+    struct node *n = &program->nodes[node];
+
+    switch (n->type) {
+    case NODE_COMMAND:
+        runSimpleCommand(program, node);
+        break;
+    case NODE_IF:
+        // The status of an if is that of the branch taken, or 0 when there is none
+        runList(program, n->a);
+        if (unwinding()) break;
+        if (lastStatus == 0) {
+            runList(program, n->b);
+        } else if (n->c != -1) {
+            runList(program, n->c);
+        } else {
+            setStatus(0);
+        }
+        break;
+    case NODE_FUNCTION:
+        defineFunction(program, node);
+        break;
+    case NODE_PIPELINE:
+        runPipeline(program, node);
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        runNode(program, n->a);
+        if (!unwinding() && (lastStatus == 0) == (n->type == NODE_AND)) runNode(program, n->b);
+        break;
+    case NODE_GROUP:
+    case NODE_SUBSHELL:
+        // WHY: A subshell only needs a process of its own when something in it could change the shell.
+        // WHAT: "{ }" and side-effect-free "( )" run in-process, redirections included.
+        if (n->type == NODE_SUBSHELL && listNeedsFork(program, n->a)) {
+            runSubshell(program, node, 0);
+        } else {
+            runGroup(program, node);
+        }
+        break;
+    default:
+        runLoop(program, node);
+        break;
+    }
+}
+
+void runSubshell(struct program *program, int node, int background) {
+    struct node *n = &program->nodes[node];
+    struct redirections redirs;
+    struct arenaMark mark = arenaMark(&lineArena);
+
+    redirs.count = 0;
+    int grouping = (n->type == NODE_GROUP || n->type == NODE_SUBSHELL);  // Only these carry redirections
+    for (int i = 0; grouping && i < n->count; i++) {
+        if (!expandRedirection(program, &program->words[n->first + i], &redirs)) {
+            releaseRedirections(&redirs);
+            arenaRelease(&lineArena, mark);
+            setStatus(1 << 8);
+            return;
+        }
+    }
+
+    pid_t spawnpid = startSubshell(&redirs, background);
+    if (spawnpid == 0) {
+        if (grouping) {
+            runList(program, n->a);
+        } else {
+            executeNode(program, node);  // A compound command from the background, now in its own process
+        }
+        exitSubshell();
+    }
+    finishSubshell(spawnpid, background);
+    releaseRedirections(&redirs);
+    arenaRelease(&lineArena, mark);
+}
+
+void runGroup(struct program *program, int node) {
+    struct node *n = &program->nodes[node];
+    struct redirections redirs;
+    struct savedDescriptors saved;
+
+    if (n->count == 0) {
+        runList(program, n->a);
+        return;
+    }
+    struct arenaMark mark = arenaMark(&lineArena);
+    redirs.count = 0;
+    for (int i = 0; i < n->count; i++) {
+        if (!expandRedirection(program, &program->words[n->first + i], &redirs)) {
+            releaseRedirections(&redirs);
+            arenaRelease(&lineArena, mark);
+            setStatus(1 << 8);
+            return;
+        }
+    }
+
+    if (!shellRedirectable(&redirs)) {
+        pid_t spawnpid = startSubshell(&redirs, 0);
+        if (spawnpid == 0) {
+            runList(program, n->a);
+            exitSubshell();
+        }
+        finishSubshell(spawnpid, 0);
+    } else if (redirectShell(&redirs, &saved) == 0) {
+        runList(program, n->a);
+        restoreShell(&saved);
+    } else {
+        setStatus(1 << 8);
+    }
+    releaseRedirections(&redirs);
+    arenaRelease(&lineArena, mark);
+}
+
+int shellRedirectable(struct redirections *redirs) {
+    // A pipeline stage's stdin and stdout are not the shell's, and the other stages use the shell's meanwhile
+    if (currentCoroutine != NULL && redirs->count > 0) return 0;
+    for (int i = 0; i < redirs->count; i++) {
+        if (redirs->list[i].fd > 2) return 0;
+    }
+    return 1;
+}
+
+int redirectShell(struct redirections *redirs, struct savedDescriptors *saved) {
+    saved->count = 0;
+    resolveRedirections(redirs);
+    fflush(stdout);  // Output printed so far belongs to the old stdout
+
+    for (int i = 0; i < redirs->count; i++) {
+        struct redirection *r = &redirs->list[i];
+
+        // Move each descriptor aside the first time it is redirected
+        int seen = 0;
+        for (int j = 0; j < saved->count; j++) seen = seen || saved->fd[j] == r->fd;
+        if (!seen) {
+            saved->fd[saved->count] = r->fd;
+            saved->copy[saved->count] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);  // -1 if it is closed
+            saved->count++;
+        }
+
+        int result = 0;
+        if (r->type == REDIR_OPEN) {
+            int fd = (r->dirFD != -1) ? openat(r->dirFD, r->name, r->flags, 0644) : open(r->path, r->flags, 0644);
+            if (fd == -1) {
+                perror(r->flags == O_RDONLY ? "cannot open input file" : "cannot open output file");
+                restoreShell(saved);
+                return -1;
+            }
+            if (fd != r->fd) {
+                result = dup2(fd, r->fd);
+                close(fd);
+            }
+        } else if (r->type == REDIR_DUP || r->type == REDIR_DATA) {
+            if (r->source != r->fd) result = dup2(r->source, r->fd);
+        } else {
+            close(r->fd);
+        }
+        if (result == -1) {
+            perror("dup2");
+            restoreShell(saved);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void restoreShell(struct savedDescriptors *saved) {
+    fflush(stdout);
+    for (int i = saved->count - 1; i >= 0; i--) {
+        if (saved->copy[i] == -1) {
+            close(saved->fd[i]);
+            continue;
+        }
+        dup2(saved->copy[i], saved->fd[i]);
+        close(saved->copy[i]);
+    }
+    saved->count = 0;
+}
+
+int listNeedsFork(struct program *program, int node) {
+    static const char *outputOnly[] = { "echo", "pwd", "cat", "tee", "status", "true", "false", ":", NULL };
+
+    for (; node != -1; node = program->nodes[node].next) {
+        struct node *n = &program->nodes[node];
+        if (n->flags & NODE_BACKGROUND) return 1;  // A new job, and "$!"
+
+        switch (n->type) {
+        case NODE_COMMAND: {
+            const char *name = NULL;
+            for (int i = 0; i < n->count; i++) {
+                struct word *word = &program->words[n->first + i];
+                const char *text = program->strings + word->text;
+                if (strstr(text, "$(") != NULL) return 1;  // Substitutions run builtins in-process; $(( )) assigns
+                if (word->kind == WORD_ARGUMENT && name == NULL) name = text;
+            }
+            if (name == NULL) break;
+            size_t nameEnd = nameLength(name);
+            if (strchr(name, '$') != NULL || (nameEnd > 0 && name[nameEnd] == '=')) return 1;
+            if (strcmp(name, "cd") == 0 || strcmp(name, "exit") == 0 || findFunction(name) != NULL) return 1;
+            if (findBuiltin(name) != NULL) {
+                int pure = 0;
+                for (int i = 0; outputOnly[i] != NULL; i++) pure = pure || strcmp(name, outputOnly[i]) == 0;
+                if (!pure) return 1;
+            }
+            break;  // An external command runs in a child anyway
+        }
+        case NODE_IF:
+            if (listNeedsFork(program, n->c)) return 1;
+            // Fall through: the condition and the then branch
+        case NODE_WHILE:
+        case NODE_UNTIL:
+        case NODE_AND:
+        case NODE_OR:
+            if (listNeedsFork(program, n->a) || listNeedsFork(program, n->b)) return 1;
+            break;
+        case NODE_GROUP:
+        case NODE_PIPELINE:
+            if (listNeedsFork(program, n->a)) return 1;  // A pipeline's stages are linked like a list
+            break;
+        case NODE_SUBSHELL:
+            break;  // Decides for itself
+        default:
+            return 1;  // for sets its variable; a definition changes the functions
+        }
+    }
+    return 0;
+}
+
+void runSimpleCommand(struct program *program, int node) {
+    char *args[MAX_ARGS];
+    struct redirections redirs;
+    int background;
+
+    // WHY: A loop may run this command many times; its expanded words are only needed while it runs.
+    // WHAT: Everything expanded into lineArena for it is released afterwards.
+    struct arenaMark mark = arenaMark(&lineArena);
+
+    if (!expandCommand(program, node, args, &redirs, &background)) {
+        arenaRelease(&lineArena, mark);
+        return;
+    }
+    runCommand(args, &redirs, background);
+
+    // Release here-document buffers
+    releaseRedirections(&redirs);
+    arenaRelease(&lineArena, mark);
+}
+
+void runCommand(char **args, struct redirections *redirs, int background) {
+    struct builtin *builtin;
+    struct variable *function;
+
+    // Check if the command is a built-in command
+    int assignments = countAssignments(args);
+    if (args[assignments] == NULL) {
+        // "NAME=value ..." on its own sets shell variables
+        for (int i = 0; args[i] != NULL; i++) assignVariable(args[i]);
+        setStatus(0);
+    } else if (strcmp(args[0], "exit") == 0) {
+        // "exit" command: terminate the shell once the running commands have unwound
+        exitRequested = 1;
+    } else if (strcmp(args[0], "cd") == 0) {
+        // "cd" command: change directory
+        // Use HOME directory if no argument is provided
+        changeDirectory(args);
+    } else if ((function = findFunction(args[assignments])) != NULL) {
+        // Functions take precedence over builtins and commands, so they can wrap them
+        struct savedVariable saved[assignments + 1];
+        pushAssignments(args, assignments, saved);
+        callFunction(function, args + assignments, redirs, background);
+        popAssignments(saved, assignments);
+    } else if ((builtin = findBuiltin(args[assignments])) != NULL) {
+        // Every other built-in command runs inside the shell, without forking
+        // "NAME=value builtin" exports NAME to whatever the builtin runs, then puts it back
+        struct savedVariable saved[assignments + 1];
+        pushAssignments(args, assignments, saved);
+        runBuiltin(builtin, args + assignments, redirs, background);
+        popAssignments(saved, assignments);
+    } else {
+        // Execute an external command
+        struct job *job = executeCommand(args, redirs, background);
+        if (job != NULL) lastBackgroundPid = job->pid;
+    }
+}
+
+void runPipeline(struct program *program, int node) {
+    struct arenaMark mark = arenaMark(&lineArena);
+    int count = 0;
+    for (int stage = program->nodes[node].a; stage != -1; stage = program->nodes[stage].next) count++;
+
+    // fds[2 * i] and fds[2 * i + 1] are stage i's stdin and stdout where they are pipe ends of its own;
+    // the first stage reads, and the last one writes, the descriptors the pipeline was given
+    int fds[2 * count];
+    fds[0] = fds[2 * count - 1] = -1;
+    for (int i = 0; i + 1 < count; i++) {
+        int pipeFD[2];
+        if (pipe2(pipeFD, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            for (int k = 1; k <= 2 * i; k++) close(fds[k]);
+            setStatus(1 << 8);
+            return;
+        }
+        fds[2 * i + 1] = pipeFD[1];
+        fds[2 * i + 2] = pipeFD[0];
+    }
+    struct pipeline pipeline = { fds, 2 * count, activePipelines };
+    activePipelines = &pipeline;
+
+    struct coroutine *coroutines = calloc(count, sizeof(struct coroutine));
+    pid_t *pids = calloc(count, sizeof(pid_t));
+    if (coroutines == NULL || pids == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // WHY: Stages in the shell share its signal dispositions, and a write to a closed pipe must not kill it.
+    // WHAT: The outermost pipeline turns Ctrl+C into builtinInterrupted and SIGPIPE into EPIPE for all of them.
+    int outermost = (currentCoroutine == NULL);
+    struct sigaction SIGINT_action = {{0}}, ignorePipe = {{0}}, oldInterrupt, oldPipe;
+    if (outermost) {
+        SIGINT_action.sa_handler = handle_SIGINT;
+        ignorePipe.sa_handler = SIG_IGN;
+        builtinInterrupted = 0;
+        sigaction(SIGINT, &SIGINT_action, &oldInterrupt);
+        sigaction(SIGPIPE, &ignorePipe, &oldPipe);
+    }
+
+    // Expand the simple commands and start the stages that are processes, left to right
+    int stage = program->nodes[node].a, unfinished = 0;
+    for (int i = 0; i < count; i++, stage = program->nodes[stage].next) {
+        struct coroutine *coroutine = &coroutines[i];
+        int in = (i == 0) ? commandFD[0] : fds[2 * i];
+        int out = (i == count - 1) ? commandFD[1] : fds[2 * i + 1];
+        coroutine->io = (struct builtinIO){ { in, out, commandFD[2] }, {0}, 0, NULL };
+        coroutine->wake = (struct eventSource){ -1, handleCoroutineReady, coroutine };
+
+        if (program->nodes[stage].type == NODE_COMMAND) {
+            int background;
+            char **args = coroutine->args = arenaAlloc(&lineArena, MAX_ARGS * sizeof(char *));
+            if (!expandCommand(program, stage, args, &coroutine->redirs, &background)) {
+                // Nothing to run, or an expansion failed (and was reported): the stage just closes its pipe ends
+                coroutine->state.lastStatus = lastStatus;
+                coroutine->finished = 1;
+                closeStageEnds(fds, i);
+                continue;
+            }
+
+            int assignments = countAssignments(args);
+            struct builtin *builtin = (args[assignments] != NULL) ? findBuiltin(args[assignments]) : NULL;
+            if (args[assignments] != NULL && strcmp(args[0], "exit") != 0 &&
+                (strcmp(args[0], "cd") == 0 || (findFunction(args[assignments]) == NULL && (builtin == NULL || !builtin->ownIO)))) {
+                int savedFD[3];
+                memcpy(savedFD, commandFD, sizeof(savedFD));
+                commandFD[0] = in;
+                commandFD[1] = out;
+                if (builtin != NULL || strcmp(args[0], "cd") == 0) {
+                    // cd would move the whole shell, and builtins that launch commands wait on them: both get a subshell
+                    pids[i] = forkSubshell();
+                    if (pids[i] == 0) {
+                        runCommand(args, &coroutine->redirs, 0);
+                        exitSubshell();
+                    }
+                } else {
+                    pids[i] = spawnCommand(args, &coroutine->redirs, 0, 0);
+                }
+                memcpy(commandFD, savedFD, sizeof(savedFD));
+                releaseRedirections(&coroutine->redirs);
+                coroutine->state.lastStatus = lastStatus;
+                coroutine->finished = 1;
+                closeStageEnds(fds, i);
+                continue;
+            }
+        } else {
+            coroutine->args = NULL;
+        }
+
+        coroutine->program = program;
+        coroutine->node = stage;
+        coroutine->stack = allocateStack();
+        getcontext(&coroutine->context);
+        coroutine->context.uc_stack.ss_sp = coroutine->stack;
+        coroutine->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+        coroutine->context.uc_link = &coroutine->caller;
+        makecontext(&coroutine->context, coroutineMain, 0);
+
+        // The stage starts from the shell's state, with arenas of its own and its pipe ends as stdin and stdout
+        coroutine->state = (struct shellState){
+            .positional = positional, .positionalCount = positionalCount, .lastStatus = lastStatus,
+            .currentIO = &coroutine->io, .commandFD = { in, out, commandFD[2] }, .functionDepth = functionDepth
+        };
+        coroutine->runnable = 1;
+        unfinished++;
+    }
+
+    // WHY: A stage that blocked on a full or empty pipe would stop every other stage, and with them the reader it waits for.
+    // WHAT: Each stage runs until it would block, then the next one runs; when all of them wait, the event loop
+    // runs until a descriptor one of them waits on is ready (or, for a stage in runEvents() itself, for a round).
+    int interrupted = 0;
+    while (unfinished > 0) {
+        int ran = 0;
+        for (int i = 0; i < count; i++) {
+            struct coroutine *coroutine = &coroutines[i];
+            if (coroutine->finished || !coroutine->runnable) continue;
+            coroutine->runnable = 0;
+            resumeCoroutine(coroutine);
+            ran = 1;
+            if (!coroutine->finished) continue;
+
+            // Closing its pipe ends gives the next stage end of file, and the one before it EPIPE
+            closeStageEnds(fds, i);
+            releaseRedirections(&coroutine->redirs);
+            arenaRelease(&coroutine->state.lineArena, (struct arenaMark){ NULL, 0 });
+            arenaRelease(&coroutine->state.frameArena, (struct arenaMark){ NULL, 0 });
+            releaseStack(coroutine->stack);
+            if (coroutine->state.programInterrupted && !coroutine->brokenPipe) programInterrupted = 1;
+            unfinished--;
+        }
+        if (ran) continue;
+
+        int timeoutMs = -1;
+        for (int i = 0; i < count; i++) {
+            struct coroutine *coroutine = &coroutines[i];
+            if (coroutine->finished || !coroutine->polling || coroutine->timeoutMs < 0) continue;
+            if (timeoutMs == -1 || coroutine->timeoutMs < timeoutMs) timeoutMs = coroutine->timeoutMs;
+        }
+        runEvents(timeoutMs);
+
+        // Ctrl+C wakes every waiting stage once, to see builtinInterrupted and unwind
+        for (int i = 0; i < count; i++) {
+            struct coroutine *coroutine = &coroutines[i];
+            if (coroutine->finished) continue;
+            if (coroutine->polling || (builtinInterrupted && !interrupted && coroutine->wake.fd != -1)) {
+                coroutine->polling = 0;
+                coroutine->runnable = 1;
+            }
+        }
+        interrupted = builtinInterrupted;
+    }
+
+    // The processes: the last stage's status is the pipeline's, and Ctrl+C ends loops too
+    int status = coroutines[count - 1].state.lastStatus;
+    for (int i = 0; i < count; i++) {
+        if (pids[i] == 0) continue;
+        int childStatus = waitForeground(pids[i]);
+        if (WIFSIGNALED(childStatus) && WTERMSIG(childStatus) == SIGINT) programInterrupted = 1;
+        if (i == count - 1) status = childStatus;
+    }
+    if (outermost) {
+        sigaction(SIGPIPE, &oldPipe, NULL);
+        sigaction(SIGINT, &oldInterrupt, NULL);
+        if (builtinInterrupted) programInterrupted = 1;
+    }
+    setStatus(status);
+    if (pids[count - 1] != 0 && WIFSIGNALED(status)) {
+        printf("terminated by signal %d\n", WTERMSIG(status));
+        fflush(stdout);
+    }
+
+    for (struct pipeline **link = &activePipelines; *link != NULL; link = &(*link)->next) {
+        if (*link == &pipeline) {
+            *link = pipeline.next;
+            break;
+        }
+    }
+    free(coroutines);
+    free(pids);
+    arenaRelease(&lineArena, mark);
+}
+
+void closeStageEnds(int *fds, int stage) {
+    for (int k = 2 * stage; k <= 2 * stage + 1; k++) {
+        if (fds[k] != -1) close(fds[k]);
+        fds[k] = -1;
+    }
+}
+
+void coroutineMain() {
+    struct coroutine *self = currentCoroutine;
+
+    if (self->args != NULL) {
+        runCommand(self->args, &self->redirs, 0);
+    } else {
+        executeNode(self->program, self->node);
+    }
+    if (self->brokenPipe) setStatus(SIGPIPE);  // The wait status of a process killed by SIGPIPE
+    self->finished = 1;
+    // Returning switches to uc_link, the scheduler that resumed it last
+}
+
+void resumeCoroutine(struct coroutine *coroutine) {
+    struct coroutine *resumer = currentCoroutine;
+
+    exchangeShellState(&coroutine->state);
+    currentCoroutine = coroutine;
+    swapcontext(&coroutine->caller, &coroutine->context);
+    currentCoroutine = resumer;
+    exchangeShellState(&coroutine->state);
+}
+
+void yieldCoroutine() {
+    struct coroutine *self = currentCoroutine;
+    swapcontext(&self->context, &self->caller);
+}
+
+void exchangeShellState(struct shellState *state) {
+    struct shellState running = {
+        lineArena, frameArena, positional, positionalCount, lastStatus, lastTimedOut, currentIO,
+        { commandFD[0], commandFD[1], commandFD[2] }, exitRequested, breakLevels, continueLevels,
+        programInterrupted, nestingExceeded, loopDepth, functionDepth, returnRequested
+    };
+
+    lineArena = state->lineArena;
+    frameArena = state->frameArena;
+    positional = state->positional;
+    positionalCount = state->positionalCount;
+    lastStatus = state->lastStatus;
+    lastTimedOut = state->lastTimedOut;
+    currentIO = state->currentIO;
+    memcpy(commandFD, state->commandFD, sizeof(commandFD));
+    exitRequested = state->exitRequested;
+    breakLevels = state->breakLevels;
+    continueLevels = state->continueLevels;
+    programInterrupted = state->programInterrupted;
+    nestingExceeded = state->nestingExceeded;
+    loopDepth = state->loopDepth;
+    functionDepth = state->functionDepth;
+    returnRequested = state->returnRequested;
+    *state = running;
+}
+
+int waitDescriptor(int fd, int events) {
+    struct coroutine *self = currentCoroutine;
+    if (self == NULL) return 0;
+
+    // EPOLLIN and EPOLLOUT have the values of POLLIN and POLLOUT
+    struct pollfd check = { fd, events, 0 };
+    while (poll(&check, 1, 0) == 0) {
+        if (builtinInterrupted) {
+            errno = EINTR;
+            return -1;
+        }
+
+        // A descriptor the event loop already watches (the shell's stdin) goes in as a duplicate,
+        // which epoll tells apart from the original
+        struct epoll_event event = { .events = events, .data.ptr = &self->wake };
+        int duplicate = -1;
+        self->wake.fd = fd;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) == -1) {
+            if (errno != EEXIST || (duplicate = fcntl(fd, F_DUPFD_CLOEXEC, 10)) == -1 ||
+                epoll_ctl(epollFD, EPOLL_CTL_ADD, duplicate, &event) == -1) {
+                if (duplicate != -1) close(duplicate);
+                self->wake.fd = -1;
+                return 0;  // It cannot be waited for; the I/O itself will block instead
+            }
+            self->wake.fd = duplicate;
+        }
+        yieldCoroutine();
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, self->wake.fd, NULL);
+        if (duplicate != -1) close(duplicate);
+        self->wake.fd = -1;
+    }
+    return 0;
+}
+
+void handleCoroutineReady(struct eventSource *source) {
+    struct coroutine *coroutine = source->data;
+    coroutine->runnable = 1;
+}
+
+char *allocateStack() {
+    if (stackCacheCount > 0) return stackCache[--stackCacheCount];
+
+    // Pages are only committed as the stage touches them; the guard page turns an overflow into a crash
+    long page = sysconf(_SC_PAGESIZE);
+    char *base = mmap(NULL, COROUTINE_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    mprotect(base, page, PROT_NONE);
+    return base + page;
+}
+
+void releaseStack(char *stack) {
+    if (stackCacheCount < COROUTINE_STACK_CACHE) {
+        stackCache[stackCacheCount++] = stack;
+        return;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    munmap(stack - page, COROUTINE_STACK_SIZE + page);
+}
+
+int writeFailed() {
+    if (errno == EPIPE && currentCoroutine != NULL) {
+        currentCoroutine->brokenPipe = 1;
+        programInterrupted = 1;  // Loops in the stage stop too, as they would in a process killed by SIGPIPE
+    }
+    return -1;
+}
+
+void inheritCommandFDs() {
+    for (int fd = 0; fd < 3; fd++) {
+        if (commandFD[fd] != fd && dup2(commandFD[fd], fd) == -1) {
+            perror("dup2");
+            exit(1);
+        }
+        commandFD[fd] = fd;
+    }
+    if (activePipelines == NULL) return;
+
+    for (struct pipeline *pipeline = activePipelines; pipeline != NULL; pipeline = pipeline->next) {
+        for (int i = 0; i < pipeline->count; i++) {
+            if (pipeline->fds[i] > 2) close(pipeline->fds[i]);
+        }
+    }
+    activePipelines = NULL;
+    currentCoroutine = NULL;
+    sigaction(SIGPIPE, &inheritedPipeAction, NULL);
+}
+
+void runLoop(struct program *program, int node) {
+    struct node *n = &program->nodes[node];
+    struct arenaMark mark = arenaMark(&lineArena);
+    int status = 0;  // A loop whose body never runs has status 0
+
+    loopDepth++;
+    if (n->type == NODE_FOR) {
+        // The items are expanded (and split into fields) once, before the first pass
+        const char *name = program->strings + program->words[n->first].text;
+        int capacity = 64, count = 0;
+        char **items = arenaAlloc(&lineArena, capacity * sizeof(char *));
+        for (int i = 1; i <= n->count; i++) {
+            char *text = program->strings + program->words[n->first + i].text;
+            char *expanded = expandWord(strchr(text, '$') ? arenaCopy(&lineArena, text) : text);
+            if (expanded == NULL) {
+                count = -1;
+                break;
+            }
+
+            char *save;
+            for (char *field = (expanded == text) ? expanded : strtok_r(expanded, " \t\n", &save); field != NULL;
+                 field = (expanded == text) ? NULL : strtok_r(NULL, " \t\n", &save)) {
+                // A pattern stands for the paths it matches
+                int matchCount = 1;
+                char **matches = expandGlob(field, &matchCount);
+                if (count + matchCount > capacity) {
+                    while (count + matchCount > capacity) capacity *= 2;
+                    char **grown = arenaAlloc(&lineArena, capacity * sizeof(char *));
+                    memcpy(grown, items, count * sizeof(char *));
+                    items = grown;
+                }
+                if (matches == NULL) {
+                    items[count++] = field;
+                } else {
+                    memcpy(items + count, matches, matchCount * sizeof(char *));
+                    count += matchCount;
+                }
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            setVariable(name, strlen(name), items[i]);
+            runList(program, n->b);
+            status = lastStatus;
+            if (loopShouldStop()) break;
+        }
+        if (count == -1) status = 1 << 8;
+    } else {
+        while (1) {
+            runList(program, n->a);
+            if (unwinding()) {
+                loopShouldStop();
+                break;
+            }
+            if ((lastStatus == 0) != (n->type == NODE_WHILE)) break;
+            runList(program, n->b);
+            status = lastStatus;
+            if (loopShouldStop()) break;
+        }
+    }
+    loopDepth--;
+
+    setStatus(status);
+    arenaRelease(&lineArena, mark);
+}
+
+void defineFunction(struct program *program, int node) {
+    const char *name = program->strings + program->words[program->nodes[node].first].text;
+    struct variable *function = findVariable(name, strlen(name), 1);
+
+    // The body stays in the program it was compiled in, which lives on for as long as the function
+    program->references++;
+    if (function->function != NULL) releaseProgram(function->function);
+    function->function = program;
+    function->functionBody = program->nodes[node].b;
+    setStatus(0);
+}
+
+struct variable *findFunction(const char *name) {
+    struct variable *function = findVariable(name, strlen(name), 0);
+    return (function != NULL && function->function != NULL) ? function : NULL;
+}
+
+void callFunction(struct variable *function, char **args, struct redirections *redirs, int background) {
+    // Variables may be created while the body runs, moving table entries, so take what is needed now
+    struct program *program = function->function;
+    int body = function->functionBody;
+
+    if (functionDepth == MAX_FUNCTION_DEPTH) {
+        fprintf(stderr, "smallsh: %s: maximum function nesting level exceeded\n", args[0]);
+        setStatus(1 << 8);
+        nestingExceeded = 1;  // Unwind every call, not just the innermost
+        return;
+    }
+
+    // Redirections of stdin, stdout and stderr are applied to the shell itself for the length of the call
+    if (!background && shellRedirectable(redirs)) {
+        struct savedDescriptors saved;
+        if (redirectShell(redirs, &saved) == -1) {
+            setStatus(1 << 8);
+            return;
+        }
+        runFunction(program, body, args);
+        restoreShell(&saved);
+        return;
+    }
+
+    pid_t spawnpid = startSubshell(redirs, background);
+    if (spawnpid == 0) {
+        runFunction(program, body, args);
+        exitSubshell();
+    }
+    finishSubshell(spawnpid, background);
+}
+
+void runFunction(struct program *program, int body, char **args) {
+    char **savedPositional = positional;
+    int savedCount = positionalCount, savedLoopDepth = loopDepth;
+    struct arenaMark mark = arenaMark(&frameArena);
+
+    // The call's frame: "$1"... are its arguments (which outlive the call), while "$0" stays the shell's
+    int count = 0;
+    while (args[count + 1] != NULL) count++;
+    positional = arenaAlloc(&frameArena, (count + 1) * sizeof(char *));
+    positional[0] = savedPositional[0];
+    memcpy(positional + 1, args + 1, count * sizeof(char *));
+    positionalCount = count;
+
+    // Loops around the call are out of reach of break and continue in the body
+    loopDepth = 0;
+    functionDepth++;
+    program->references++;  // The body must survive the function redefining itself
+    runList(program, body);
+    releaseProgram(program);
+    functionDepth--;
+    loopDepth = savedLoopDepth;
+    returnRequested = 0;
+
+    positional = savedPositional;
+    positionalCount = savedCount;
+    arenaRelease(&frameArena, mark);
+}
+
+int unwinding() {
+    return exitRequested || returnRequested || breakLevels > 0 || continueLevels > 0 || programInterrupted ||
+           nestingExceeded;
+}
+
+int loopShouldStop() {
+    if (breakLevels > 0) {
+        breakLevels--;
+        return 1;
+    }
+    if (continueLevels > 0) {
+        // "continue n" leaves n - 1 loops and carries on with the next pass of the last one
+        continueLevels--;
+        return continueLevels > 0;
+    }
+    return exitRequested || returnRequested || programInterrupted || nestingExceeded;
+}
+
+int expandCommand(struct program *program, int node, char **args, struct redirections *redirs, int *background) {
+    struct node *n = &program->nodes[node];
+    int argCount = 0;    // Counter for the number of arguments parsed
+    int assigning = 1;   // Every argument so far is a "NAME=value" assignment
+
+    redirs->count = 0; // Start each command with an empty redirection list
+    *background = (n->flags & NODE_BACKGROUND) && !fgOnlyMode;
+    // WHY: Foreground-only mode ignores '&', as it always has.
+
+    for (int i = 0; i < n->count; i++) {
+        struct word *word = &program->words[n->first + i];
+        char *token = program->strings + word->text;
+
+        // Handle redirections: '<', '>', '>>', '2>', '2>&1', '&>', '<>', 'n>&-' and friends
+        if (word->kind == WORD_REDIRECTION) {
+            if (!expandRedirection(program, word, redirs)) {
+                releaseRedirections(redirs);
+                return 0;
+            }
+            continue;
+        }
+
+        // prompt takes its template as written, so "[{git}]" is not taken for a glob pattern
+        if (argCount > 0 && strcmp(args[0], "prompt") == 0) {
+            argCount = addArgument(args, argCount, token);
+            if (argCount == -1) {
+                releaseRedirections(redirs);
+                setStatus(1 << 8);
+                return 0;
+            }
+            continue;
+        }
+
+        // Expansions are split into fields, except in the values of leading assignments
+        size_t nameEnd = nameLength(token);
+        assigning = assigning && nameEnd > 0 && token[nameEnd] == '=';
+        int substituted = !assigning && strchr(token, '$') != NULL;
+        char *expanded = expandWord(substituted || assigning ? arenaCopy(&lineArena, token) : token);
+        if (expanded == NULL) { // Unterminated "$(" or "${": expandWord() has reported it
+            releaseRedirections(redirs);
+            setStatus(1 << 8);
+            return 0;
+        }
+        if (assigning) {
+            argCount = addArgument(args, argCount, expanded);  // Stored as it is, without globbing
+        } else if (!substituted) {
+            argCount = addField(args, argCount, expanded);  // A pattern becomes the paths it matches
+        } else {
+            // Expanded values are split into separate arguments at whitespace
+            char *save;
+            for (char *field = strtok_r(expanded, " \t\n", &save); field != NULL && argCount >= 0;
+                 field = strtok_r(NULL, " \t\n", &save)) {
+                argCount = addField(args, argCount, field);
+            }
+        }
+        if (argCount == -1) {
+            releaseRedirections(redirs);
+            setStatus(1 << 8);
+            return 0;
+        }
+    }
+
+    args[argCount] = NULL; // Null-terminate the arguments array
+    // WHY: Null-termination is required for `execvp` to execute the command properly.
+
+    // A command that expanded to nothing has nothing to run
+    if (args[0] == NULL) {
+        releaseRedirections(redirs);
+        return 0;
+    }
+    return 1;
+}
+
+int addField(char **args, int argCount, char *field) {
+    int count;
+    char **matches = expandGlob(field, &count);
+
+    if (matches == NULL) return addArgument(args, argCount, field);
+    if (argCount + count >= MAX_ARGS) {
+        fprintf(stderr, "smallsh: %s: argument list too long\n", field);
+        return -1;
+    }
+    memcpy(args + argCount, matches, count * sizeof(char *));
+    return argCount + count;
+}
+
+int addArgument(char **args, int argCount, char *word) {
+    if (argCount >= MAX_ARGS - 1) {
+        fprintf(stderr, "smallsh: %s: argument list too long\n", args[0]);
+        return -1;
+    }
+    args[argCount] = word;
+    return argCount + 1;
+}
+
+char **expandGlob(const char *pattern, int *count) {
+    struct globResults results = { NULL, 0, 0 };
+    struct capture path = { &lineArena, NULL, 0, 0 };
+
+    if (!hasGlob(pattern)) return NULL;
+
+    // An absolute pattern starts from "/", anything else from the current directory
+    if (pattern[0] == '/') {
+        captureAppend(&path, "/", 1);
+        pattern += strspn(pattern, "/");
+    }
+    globSearch(&path, pattern, &results);
+    if (results.count == 0) return NULL;
+
+    qsort(results.paths, results.count, sizeof(char *), compareStrings);
+    *count = results.count;
+    return results.paths;
+}
+
+int hasGlob(const char *word) {
+    for (const char *p = word; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if ((*p == '\'' || *p == '"') && strchr(p + 1, *p) != NULL) {
+            p = strchr(p + 1, *p);  // '*.c' is a word, not a pattern
+        } else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']') != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void globSearch(struct capture *path, const char *rest, struct globResults *results) {
+    size_t base = path->length;
+    size_t length = strcspn(rest, "/");
+    const char *next = (rest[length] == '/') ? rest + length + strspn(rest + length, "/") : NULL;
+    char component[length + 1];
+    memcpy(component, rest, length);
+    component[length] = '\0';
+
+    // "**" spans directories
+    if (strcmp(component, "**") == 0) {
+        globStar(path, next, results);
+        return;
+    }
+
+    // A component without glob characters is taken as written; only the full path has to exist
+    if (!hasGlob(component)) {
+        captureAppend(path, component, length);
+        if (next != NULL) captureAppend(path, "/", 1);
+        captureAppend(path, "", 1);
+        path->length--;
+        struct stat info;
+        if (next != NULL && *next != '\0') {
+            globSearch(path, next, results);
+        } else if (lstat(path->data, &info) == 0 && (next == NULL || S_ISDIR(info.st_mode))) {
+            addGlobResult(results, path->data, path->length);
+        }
+        path->length = base;
+        return;
+    }
+
+    struct globMatcher matcher;
+    compileGlob(component, &matcher);
+    captureAppend(path, "", 1);
+    struct globListing *listing = listDirectory(base > 0 ? path->data : ".");
+    if (listing == NULL) {
+        path->length = base;
+        return;
+    }
+
+    // Take the matching names out of the listing first: searching deeper may evict it from the cache
+    int capacity = 16, matched = 0;
+    char **names = arenaAlloc(&lineArena, capacity * sizeof(char *));
+    unsigned char *types = arenaAlloc(&lineArena, capacity);
+    for (size_t i = 0; i < listing->count; i++) {
+        const char *name = listing->names + listing->offsets[i];
+        size_t nameLength = listing->offsets[i + 1] - listing->offsets[i] - 1;
+        if (!globMatch(&matcher, name, nameLength)) continue;
+        if (matched == capacity) {
+            char **grownNames = arenaAlloc(&lineArena, capacity * 2 * sizeof(char *));
+            unsigned char *grownTypes = arenaAlloc(&lineArena, capacity * 2);
+            memcpy(grownNames, names, capacity * sizeof(char *));
+            memcpy(grownTypes, types, capacity);
+            names = grownNames;
+            types = grownTypes;
+            capacity *= 2;
+        }
+        names[matched] = (next != NULL) ? arenaCopy(&lineArena, name) : (char *)name;
+        types[matched++] = listing->types[i];
+    }
+
+    for (int i = 0; i < matched; i++) {
+        path->length = base;
+        captureAppend(path, names[i], strlen(names[i]));
+        if (next == NULL) {
+            addGlobResult(results, path->data, path->length);
+            continue;
+        }
+
+        // Only directories lead anywhere; symlinks and unknown types need a stat() to tell
+        if (types[i] != DT_DIR) {
+            struct stat info;
+            captureAppend(path, "", 1);
+            if (types[i] != DT_LNK && types[i] != DT_UNKNOWN) continue;
+            if (stat(path->data, &info) == -1 || !S_ISDIR(info.st_mode)) continue;
+            path->length--;
+        }
+        captureAppend(path, "/", 1);
+        if (*next == '\0') {
+            addGlobResult(results, path->data, path->length);  // "*/" lists directories
+        } else {
+            globSearch(path, next, results);
+        }
+    }
+    path->length = base;
+}
+
+void globStar(struct capture *path, const char *next, struct globResults *results) {
+    struct walker walker = {0};
+    struct globMatcher matcher;
+    struct globResults directories = { NULL, 0, 0 };
+    size_t base = path->length;
+
+    captureAppend(path, "", 1);
+    path->length--;
+    char *prefix = arenaCopy(&lineArena, path->data);  // path grows (and may move) below
+    walker.quiet = 1;
+
+    // "**/name" (the common case) is a single walk matching name in every directory, the top one included
+    if (next != NULL && *next != '\0' && strchr(next, '/') == NULL) {
+        compileGlob(next, &matcher);
+        walker.matcher = &matcher;
+        walkTree(base > 0 ? prefix : ".", prefix, &walker, collectWalkBatch, results);
+        return;
+    }
+
+    // "dir/**" is everything below dir; "**/" is every directory
+    walker.directoriesOnly = (next != NULL);
+    walkTree(base > 0 ? prefix : ".", prefix, &walker, collectWalkBatch, next == NULL ? results : &directories);
+    if (next == NULL) return;
+    if (*next == '\0') {
+        for (int i = 0; i < directories.count; i++) {
+            path->length = 0;
+            captureAppend(path, directories.paths[i], strlen(directories.paths[i]));
+            captureAppend(path, "/", 1);
+            addGlobResult(results, path->data, path->length);
+        }
+        path->length = 0;
+        captureAppend(path, prefix, base);
+        return;
+    }
+
+    // "**/dir/name": the rest of the pattern is matched from the top directory and from each one below it
+    globSearch(path, next, results);
+    for (int i = 0; i < directories.count; i++) {
+        path->length = 0;
+        captureAppend(path, directories.paths[i], strlen(directories.paths[i]));
+        captureAppend(path, "/", 1);
+        globSearch(path, next, results);
+    }
+    path->length = 0;
+    captureAppend(path, prefix, base);
+}
+
+int collectWalkBatch(struct walkBatch *batch, void *context) {
+    for (char *p = batch->data; p < batch->data + batch->used; p += strlen(p) + 1) {
+        addGlobResult(context, p, strlen(p));
+    }
+    return 0;
+}
+
+int walkTree(const char *root, const char *prefix, struct walker *walker,
+             int (*emit)(struct walkBatch *batch, void *context), void *context) {
+    pthread_t threads[MAX_WALK_THREADS];
+    struct walkThread states[MAX_WALK_THREADS];
+
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    char *path = strdup(prefix);
+    walker->wakeFD = eventfd(0, EFD_CLOEXEC);
+    if (path == NULL || walker->wakeFD == -1) {
+        perror("walk");
+        exit(1);
+    }
+
+    // WHY: Each directory read is a round trip to the file system, which on network storage is mostly waiting.
+    // WHAT: Default to two threads per CPU, so that many reads are in flight at once.
+    if (walker->threadCount <= 0) walker->threadCount = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (walker->threadCount > MAX_WALK_THREADS) walker->threadCount = MAX_WALK_THREADS;
+    if (walker->threadCount < 1) walker->threadCount = 1;
+    for (int i = 0; i < walker->threadCount; i++) {
+        pthread_mutex_init(&walker->deques[i].lock, NULL);
+        walker->deques[i].tasks = NULL;
+        walker->deques[i].top = walker->deques[i].bottom = walker->deques[i].capacity = 0;
+    }
+    walker->deques[0].tasks = malloc(16 * sizeof(struct walkTask));
+    walker->deques[0].capacity = 16;
+    walker->deques[0].tasks[walker->deques[0].bottom++] = (struct walkTask){ fd, path };
+    walker->pending = walker->openDirs = 1;
+    walker->stop = walker->errors = walker->finished = 0;
+    walker->results = NULL;
+
+    // Signals stay with the shell's thread, whose handlers expect to run there
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int started = 0;
+    for (int i = 0; i < walker->threadCount; i++) {
+        states[i] = (struct walkThread){ walker, i, (unsigned int)i * 2654435761u, NULL };
+        if (pthread_create(&threads[i], NULL, walkThreadMain, &states[i]) != 0) break;
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (started == 0) {
+        fprintf(stderr, "walk: cannot start threads\n");
+        exit(1);
+    }
+
+    // Hand batches on as they come in, until every thread has left
+    while (1) {
+        int finished = __atomic_load_n(&walker->finished, __ATOMIC_ACQUIRE) == started;
+        drainWalk(walker, emit, context);
+        if (finished) break;
+
+        uint64_t posts;
+        if ((waitDescriptor(walker->wakeFD, EPOLLIN) == -1 || read(walker->wakeFD, &posts, sizeof(posts)) == -1) &&
+            builtinInterrupted) {
+            __atomic_store_n(&walker->stop, 1, __ATOMIC_RELAXED);  // Ctrl+C
+        }
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    for (int i = 0; i < walker->threadCount; i++) {
+        pthread_mutex_destroy(&walker->deques[i].lock);
+        free(walker->deques[i].tasks);
+    }
+    close(walker->wakeFD);
+    return 0;
+}
+
+void *walkThreadMain(void *arg) {
+    struct walkThread *thread = arg;
+    struct walker *walker = thread->walker;
+    struct walkTask task;
+    long idle = 0;
+
+    while (1) {
+        if (takeWalkTask(thread, &task)) {
+            if (__atomic_load_n(&walker->stop, __ATOMIC_RELAXED)) {
+                close(task.fd);
+                free(task.path);
+                __atomic_sub_fetch(&walker->openDirs, 1, __ATOMIC_RELAXED);
+            } else {
+                walkDirectory(thread, task.fd, task.path);
+            }
+            __atomic_sub_fetch(&walker->pending, 1, __ATOMIC_ACQ_REL);
+            idle = 0;
+            continue;
+        }
+        if (__atomic_load_n(&walker->pending, __ATOMIC_ACQUIRE) == 0) break;
+
+        // Nothing to steal right now: let the shell have what this thread found, then back off
+        if (thread->batch != NULL) publishWalkBatch(thread);
+        struct timespec pause = { 0, idle < 10 ? 20000 : 1000000 };
+        nanosleep(&pause, NULL);
+        idle++;
+    }
+
+    if (thread->batch != NULL) publishWalkBatch(thread);
+    __atomic_add_fetch(&walker->finished, 1, __ATOMIC_RELEASE);
+    uint64_t post = 1;
+    if (write(walker->wakeFD, &post, sizeof(post)) == -1) perror("walk");
+    return NULL;
+}
+
+void walkDirectory(struct walkThread *thread, int fd, char *path) {
+    struct walker *walker = thread->walker;
+    struct dirent *entry;
+    size_t pathLength = strlen(path);
+
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        free(path);
+        __atomic_sub_fetch(&walker->openDirs, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    while (!__atomic_load_n(&walker->stop, __ATOMIC_RELAXED) && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        size_t nameLength = strlen(name);
+        int hidden = (name[0] == '.' && !walker->hidden);
+
+        // Some file systems leave the type out of the directory entry
+        int type = entry->d_type;
+        struct stat info;
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(info.st_mode) ? DT_DIR : DT_REG;
+        }
+
+        if ((!walker->directoriesOnly || type == DT_DIR) &&
+            (walker->matcher != NULL ? globMatch(walker->matcher, name, nameLength) : !hidden)) {
+            addWalkResult(thread, path, pathLength, name, nameLength);
+        }
+        if (type != DT_DIR || hidden) continue;
+
+        // Subdirectories are opened relative to this one, so the kernel never walks the full path again
+        int child = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child == -1) {
+            if (!walker->quiet) fprintf(stderr, "walk: %s%s: %s\n", path, name, strerror(errno));
+            __atomic_store_n(&walker->errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        char *childPath = malloc(pathLength + nameLength + 2);
+        if (childPath == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(childPath, path, pathLength);
+        memcpy(childPath + pathLength, name, nameLength);
+        memcpy(childPath + pathLength + nameLength, "/", 2);
+
+        // Queue it for whichever thread gets there first, unless too many directories are open already
+        if (__atomic_add_fetch(&walker->openDirs, 1, __ATOMIC_RELAXED) > WALK_MAX_OPEN) {
+            walkDirectory(thread, child, childPath);
+            continue;
+        }
+        struct walkDeque *deque = &walker->deques[thread->index];
+        __atomic_add_fetch(&walker->pending, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_lock(&deque->lock);
+        if (deque->bottom == deque->capacity && deque->top > 0) {
+            // Reuse the room stolen from the top before growing
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(struct walkTask));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        if (deque->bottom == deque->capacity) {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 16;
+            deque->tasks = realloc(deque->tasks, deque->capacity * sizeof(struct walkTask));
+            if (deque->tasks == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        deque->tasks[deque->bottom++] = (struct walkTask){ child, childPath };
+        pthread_mutex_unlock(&deque->lock);
+    }
+    closedir(dir);
+    free(path);
+    __atomic_sub_fetch(&walker->openDirs, 1, __ATOMIC_RELAXED);
+}
+
+int takeWalkTask(struct walkThread *thread, struct walkTask *task) {
+    struct walker *walker = thread->walker;
+    struct walkDeque *own = &walker->deques[thread->index];
+    int found = 0;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->bottom > own->top) {
+        *task = own->tasks[--own->bottom];
+        found = 1;
+    }
+    pthread_mutex_unlock(&own->lock);
+    if (found) return 1;
+
+    // Steal, starting from a random thread so that thieves spread out
+    int start = rand_r(&thread->seed) % walker->threadCount;
+    for (int i = 0; i < walker->threadCount && !found; i++) {
+        struct walkDeque *victim = &walker->deques[(start + i) % walker->threadCount];
+        if (victim == own) continue;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->bottom > victim->top) {
+            *task = victim->tasks[victim->top++];
+            found = 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return found;
+}
+
+void addWalkResult(struct walkThread *thread, const char *path, size_t pathLength, const char *name, size_t nameLength) {
+    size_t length = pathLength + nameLength + 1;
+
+    if (thread->batch != NULL && thread->batch->used + length > WALK_BATCH_SIZE) publishWalkBatch(thread);
+    if (thread->batch == NULL) {
+        thread->batch = malloc(sizeof(struct walkBatch));
+        if (thread->batch == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        thread->batch->used = 0;
+    }
+    char *p = thread->batch->data + thread->batch->used;
+    memcpy(p, path, pathLength);
+    memcpy(p + pathLength, name, nameLength);
+    p[pathLength + nameLength] = '\0';
+    thread->batch->used += length;
+}
+
+void publishWalkBatch(struct walkThread *thread) {
+    struct walker *walker = thread->walker;
+    struct walkBatch *batch = thread->batch;
+
+    // WHY: Threads finish batches at any moment, and none should wait on another (or on the shell) to hand one in.
+    // WHAT: Push it with a compare-and-swap; the shell takes the whole stack at once with an exchange.
+    batch->next = __atomic_load_n(&walker->results, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&walker->results, &batch->next, batch, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    thread->batch = NULL;
+
+    uint64_t post = 1;
+    if (write(walker->wakeFD, &post, sizeof(post)) == -1) perror("walk");
+}
+
+void drainWalk(struct walker *walker, int (*emit)(struct walkBatch *batch, void *context), void *context) {
+    struct walkBatch *batch = __atomic_exchange_n(&walker->results, NULL, __ATOMIC_ACQUIRE);
+    struct walkBatch *ordered = NULL;
+
+    // The stack holds the newest batch first
+    while (batch != NULL) {
+        struct walkBatch *next = batch->next;
+        batch->next = ordered;
+        ordered = batch;
+        batch = next;
+    }
+    while (ordered != NULL) {
+        struct walkBatch *next = ordered->next;
+        if (!__atomic_load_n(&walker->stop, __ATOMIC_RELAXED) && emit(ordered, context) == -1) {
+            __atomic_store_n(&walker->stop, 1, __ATOMIC_RELAXED);
+        }
+        free(ordered);
+        ordered = next;
+    }
+}
+
+void addGlobResult(struct globResults *results, const char *path, size_t length) {
+    if (results->count == results->capacity) {
+        results->capacity = results->capacity ? results->capacity * 2 : 64;
+        char **grown = arenaAlloc(&lineArena, results->capacity * sizeof(char *));
+        if (results->count > 0) memcpy(grown, results->paths, results->count * sizeof(char *));
+        results->paths = grown;
+    }
+    char *copy = arenaAlloc(&lineArena, length + 1);
+    memcpy(copy, path, length);
+    copy[length] = '\0';
+    results->paths[results->count++] = copy;
+}
+
+void compileGlob(const char *pattern, struct globMatcher *matcher) {
+    size_t length = strlen(pattern);
+    char *literals = arenaAlloc(&lineArena, length + 1);  // Literal runs, with escapes removed
+    char *write = literals;
+
+    matcher->ops = arenaAlloc(&lineArena, (length + 1) * sizeof(struct globOp));
+    matcher->count = 0;
+    matcher->dotOK = (pattern[0] == '.');
+    for (const char *p = pattern; *p != '\0'; p++) {
+        struct globOp *op = &matcher->ops[matcher->count];
+        const char *close = (*p == '[') ? strchr(p + 2, ']') : NULL;  // "[]...]" starts with a literal ']'
+        if (*p == '*') {
+            if (matcher->count > 0 && op[-1].type == GLOB_STAR) continue;  // "**" within a name is '*'
+            op->type = GLOB_STAR;
+        } else if (*p == '?') {
+            op->type = GLOB_ANY;
+        } else if (close != NULL) {
+            // "[abc]", "[a-z]", and "[!...]" or "[^...]" for the complement
+            int negate = (p[1] == '!' || p[1] == '^');
+            const char *c = p + 1 + negate;
+            close = strchr(c + 1, ']');
+            if (close == NULL) goto literal;
+            op->type = GLOB_CLASS;
+            memset(op->set, 0, sizeof(op->set));
+            for (; c < close; c++) {
+                unsigned char low = *c, high = *c;
+                if (c[1] == '-' && c + 2 < close) {
+                    high = c[2];
+                    c += 2;
+                }
+                for (unsigned int ch = low; ch <= high; ch++) op->set[ch / 8] |= 1 << (ch % 8);
+            }
+            if (negate) {
+                for (int i = 0; i < 32; i++) op->set[i] = ~op->set[i];
+            }
+            p = close;
+        } else {
+        literal:
+            if (*p == '\\' && p[1] != '\0') p++;
+            if (matcher->count > 0 && op[-1].type == GLOB_LITERAL) {
+                *write++ = *p;
+                op[-1].length++;
+                continue;
+            }
+            op->type = GLOB_LITERAL;
+            op->text = write;
+            op->length = 1;
+            *write++ = *p;
+        }
+        matcher->count++;
+    }
+
+    // Fixed text at either end is checked up front
+    matcher->prefix = matcher->suffix = "";
+    matcher->prefixLength = matcher->suffixLength = 0;
+    if (matcher->count > 0 && matcher->ops[0].type == GLOB_LITERAL) {
+        matcher->prefix = matcher->ops[0].text;
+        matcher->prefixLength = matcher->ops[0].length;
+        matcher->ops++;
+        matcher->count--;
+    }
+    if (matcher->count > 0 && matcher->ops[matcher->count - 1].type == GLOB_LITERAL) {
+        matcher->suffix = matcher->ops[matcher->count - 1].text;
+        matcher->suffixLength = matcher->ops[matcher->count - 1].length;
+        matcher->count--;
+    }
+}
+
+int globMatch(struct globMatcher *matcher, const char *name, size_t length) {
+    if (name[0] == '.' && !matcher->dotOK) return 0;
+    if (length < matcher->prefixLength + matcher->suffixLength) return 0;
+    if (memcmp(name, matcher->prefix, matcher->prefixLength) != 0) return 0;
+    if (memcmp(name + length - matcher->suffixLength, matcher->suffix, matcher->suffixLength) != 0) return 0;
+
+    // Match the middle, going back to the last '*' (to let it take one more character) on a mismatch
+    const char *text = name + matcher->prefixLength;
+    size_t end = length - matcher->prefixLength - matcher->suffixLength;
+    size_t i = 0, starPosition = 0;
+    int op = 0, starOp = -1;
+    while (1) {
+        if (op < matcher->count) {
+            struct globOp *o = &matcher->ops[op];
+            if (o->type == GLOB_STAR) {
+                starOp = op++;
+                starPosition = i;
+                continue;
+            }
+            if (o->type == GLOB_LITERAL ? (i + o->length <= end && memcmp(text + i, o->text, o->length) == 0)
+                                        : (i < end && (o->type == GLOB_ANY ||
+                                                       (o->set[(unsigned char)text[i] / 8] & (1 << ((unsigned char)text[i] % 8)))))) {
+                i += (o->type == GLOB_LITERAL) ? o->length : 1;
+                op++;
+                continue;
+            }
+        } else if (i == end) {
+            return 1;
+        }
+        if (starOp == -1 || starPosition >= end) return 0;
+        i = ++starPosition;
+        op = starOp + 1;
+    }
+}
+
+struct globListing *listDirectory(const char *path) {
+    struct globListing *victim = &globCache[0];
+    struct stat info;
+    time_t now = time(NULL);
+
+    if (stat(path, &info) == -1 || !S_ISDIR(info.st_mode)) return NULL;
+
+    // WHY: Reading a directory of 500k entries takes far longer than the stat() that says it has not changed.
+    // WHAT: Reuse the listing while the mtime matches; one read in the same second as a change is not trusted.
+    globCacheTick++;
+    for (int i = 0; i < GLOB_CACHE_SIZE; i++) {
+        struct globListing *listing = &globCache[i];
+        if (listing->names != NULL && listing->device == info.st_dev && listing->inode == info.st_ino) {
+            if (listing->mtime.tv_sec == info.st_mtim.tv_sec && listing->mtime.tv_nsec == info.st_mtim.tv_nsec &&
+                listing->loaded > info.st_mtim.tv_sec && now - listing->loaded < GLOB_CACHE_SECONDS) {
+                listing->lastUse = globCacheTick;
+                return listing;
+            }
+            victim = listing;
+            break;
+        }
+        if (listing->lastUse < victim->lastUse) victim = listing;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    freeListing(victim);
+    readListing(fd, victim);
+    close(fd);
+
+    victim->device = info.st_dev;
+    victim->inode = info.st_ino;
+    victim->mtime = info.st_mtim;
+    victim->loaded = now;
+    victim->lastUse = globCacheTick;
+    return victim;
+}
+
+void readListing(int fd, struct globListing *listing) {
+    size_t capacity = 1024, namesCapacity = 16384, namesLength = 0;
+    listing->names = malloc(namesCapacity);
+    listing->offsets = malloc((capacity + 1) * sizeof(size_t));
+    listing->types = malloc(capacity);
+    char *batch = malloc(GLOB_BATCH_SIZE);
+    if (listing->names == NULL || listing->offsets == NULL || listing->types == NULL || batch == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Large batches: a few hundred entries per system call rather than readdir()'s usual 32KB
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, batch, GLOB_BATCH_SIZE)) > 0) {
+        for (long position = 0; position < n;) {
+            struct linuxDirent64 *entry = (struct linuxDirent64 *)(batch + position);
+            position += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+            size_t length = strlen(name) + 1;
+            if (listing->count == capacity) {
+                capacity *= 2;
+                listing->offsets = realloc(listing->offsets, (capacity + 1) * sizeof(size_t));
+                listing->types = realloc(listing->types, capacity);
+            }
+            if (namesLength + length > namesCapacity) {
+                while (namesLength + length > namesCapacity) namesCapacity *= 2;
+                listing->names = realloc(listing->names, namesCapacity);
+            }
+            if (listing->names == NULL || listing->offsets == NULL || listing->types == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            memcpy(listing->names + namesLength, name, length);
+            listing->offsets[listing->count] = namesLength;
+            listing->types[listing->count] = entry->d_type;
+            listing->count++;
+            namesLength += length;
+        }
+    }
+    free(batch);
+    listing->offsets[listing->count] = namesLength;  // The end of the last name
+}
+
+void freeListing(struct globListing *listing) {
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->types);
+    listing->names = NULL;
+    listing->offsets = NULL;
+    listing->types = NULL;
+    listing->count = 0;
+}
+
+int compareStrings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int expandRedirection(struct program *program, struct word *word, struct redirections *redirs) {
+    // parseRedirection() and expandWord() split the text up, so they work on a copy
+    int expanded = parseRedirection(arenaCopy(&lineArena, program->strings + word->text), redirs) == 1;
+    if (expanded && word->body != -1) {
+        // A here-document: its body was collected when the command was compiled
+        struct redirection *r = &redirs->list[redirs->count - 1];
+        char *body = program->strings + word->body;
+
+        // With an unquoted delimiter the body is expanded like a word (quotes in it stay as they are);
+        // quoting any part of the delimiter ("<<'EOF'", "<<\EOF") keeps it literal
+        const char *delimiter = strstr(program->strings + word->text, "<<") + 2;
+        if (strpbrk(delimiter, "'\"\\") == NULL && strchr(body, '$') != NULL) {
+            body = expandWord(arenaCopy(&lineArena, body));  // NULL: an unclosed "$(" or "${", reported
+        }
+        if (body != NULL) r->source = sealedMemfd("smallsh-heredoc", body, strlen(body));
+        r->path = NULL;
+        expanded = (r->source != -1);
+    }
+
+    // The command is not run, and fails like one whose redirection could not be opened
+    if (!expanded) setStatus(1 << 8);
+    return expanded;
+}
+
+pid_t forkSubshell() {
+    fflush(stdout);
+    pid_t spawnpid = fork();
+    if (spawnpid == -1) {
+        perror("fork");
+        exit(1);
+    } else if (spawnpid == 0) {
+        inheritCommandFDs();
+
+        // WHY: The epoll instance is shared with the parent, so the child must not add to or wait on it.
+        // WHAT: A fresh event loop, and no jobs, watchers or schedules; those stay with the parent.
+        close(epollFD);
+        initEventLoop();
+        jobCount = 0;
+        watchers = NULL;
+        schedules = NULL;
+
+        struct sigaction SIGINT_action = {{0}};
+        SIGINT_action.sa_handler = SIG_DFL;
+        sigaction(SIGINT, &SIGINT_action, NULL);
+    }
+    return spawnpid;
+}
+
+pid_t startSubshell(struct redirections *redirs, int background) {
+    resolveRedirections(redirs);
+    pid_t spawnpid = forkSubshell();
+    if (spawnpid == 0) {
+        if (background) {
+            struct sigaction SIGINT_action = {{0}};
+            SIGINT_action.sa_handler = SIG_IGN;
+            sigaction(SIGINT, &SIGINT_action, NULL);
+            setpgid(0, 0);
+            if (!redirectsFD(redirs, 0)) dup2(devNullFD, 0);
+            if (!redirectsFD(redirs, 1)) dup2(devNullFD, 1);
+        }
+        applyRedirections(redirs, 0);
+    }
+    return spawnpid;
+}
+
+void finishSubshell(pid_t spawnpid, int background) {
+    if (background) {
+        setpgid(spawnpid, spawnpid);
+        printf("background pid is %d\n", spawnpid);
+        fflush(stdout);
+        addJob(spawnpid);
+        lastBackgroundPid = spawnpid;
+    } else {
+        setStatus(waitForeground(spawnpid));
+        if (WIFSIGNALED(lastStatus) && WTERMSIG(lastStatus) == SIGINT) programInterrupted = 1;
+    }
+}
+
+void exitSubshell() {
+    exit(WIFEXITED(lastStatus) ? WEXITSTATUS(lastStatus) : 128 + WTERMSIG(lastStatus));
+}
+
+void captureSubshell(struct program *program, int node, struct capture *output) {
+    int pipeFD[2];
+    if (pipe2(pipeFD, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        setStatus(1 << 8);
+        return;
+    }
+
+    pid_t spawnpid = forkSubshell();
+    if (spawnpid == 0) {
+        dup2(pipeFD[1], 1);
+        runList(program, node);
+        exitSubshell();
+    }
+    close(pipeFD[1]);
+
+    ssize_t n;
+    while ((n = captureRead(output, pipeFD[0])) != 0) {
+        if (n == -1 && errno != EINTR) break;
+    }
+    close(pipeFD[0]);
+    setStatus(waitForeground(spawnpid));
+}
+
+int parseRedirection(char *token, struct redirections *redirs) {
+    char *p = token;
+    int fd = -1;       // Descriptor being redirected; -1 until given or defaulted
+    int both = 0;      // "&>" and "&>>" send stdout and stderr to the same file
+    int flags;
+
+    // An optional descriptor number comes first ("2>", "3<")
+    while (*p >= '0' && *p <= '9') p++;
+    if (p != token) {
+        if (*p != '<' && *p != '>') return 0;  // Just a number
+        if ((fd = parseDescriptor(token)) == -1) {
+            fprintf(stderr, "smallsh: bad file descriptor near '%s'\n", token);
+            return -1;
+        }
+    } else if (p[0] == '&' && p[1] == '>') {
+        both = 1;
+        p++;
+    }
+    if (*p != '<' && *p != '>') return 0;
+
+    // Here-strings ("<<<word") and here-documents ("<<EOF", "<<-EOF") feed stdin from a memfd
+    if (p[0] == '<' && p[1] == '<') {
+        int hereString = (p[2] == '<');
+        int stripTabs = (!hereString && p[2] == '-');
+        p += hereString ? 3 : (stripTabs ? 3 : 2);
+        char *word = (*p != '\0') ? p : NULL;
+        if (word != NULL && hereString) word = expandWord(word);
+        if (word == NULL || redirs->count == MAX_REDIRS) {
+            fprintf(stderr, "smallsh: bad redirection near '%s'\n", token);
+            return -1;
+        }
+
+        struct redirection *r = &redirs->list[redirs->count++];
+        r->type = REDIR_DATA;
+        r->fd = (fd == -1) ? 0 : fd;
+        r->dirFD = -1;
+        r->flags = 0;
+        r->path = NULL;
+        r->source = -1;
+        if (hereString) {
+            // The word plus a newline is the whole input; no temp file, no extra process
+            size_t length = strlen(word);
+            char *text = malloc(length + 1);
+            memcpy(text, word, length);
+            text[length] = '\n';
+            r->source = sealedMemfd("smallsh-herestring", text, length + 1);
+            free(text);
+            if (r->source == -1) {
+                redirs->count--;
+                return -1;
+            }
+        } else {
+            r->path = word;  // The caller attaches the body, which was collected at compile time
+        }
+        return 1;
+    }
+
+    // The operator decides the default descriptor and how the file is opened
+    int plain = 0;  // Only "<" and ">" may be followed by "&" to duplicate a descriptor
+    if (p[0] == '<' && p[1] == '>') {
+        flags = O_RDWR | O_CREAT;
+        p += 2;
+    } else if (p[0] == '<') {
+        flags = O_RDONLY;
+        plain = 1;
+        p += 1;
+    } else if (p[0] == '>' && p[1] == '>') {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        p += 2;
+    } else if (p[0] == '>' && p[1] == '|') {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        p += 2;
+    } else {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        plain = !both;
+        p += 1;
+    }
+    if (fd == -1) fd = (flags == O_RDONLY || flags == (O_RDWR | O_CREAT)) ? 0 : 1;
+
+    int duplicate = plain && *p == '&';
+    if (duplicate) p++;
+
+    // The target is either attached to the operator or the next token
+    char *target = (*p != '\0') ? p : NULL;
+    if (target != NULL && !duplicate) target = expandWord(target);  // "> $(date +%F).log"
+    if (target == NULL || redirs->count + 2 > MAX_REDIRS || *target == '<' || *target == '>') {
+        fprintf(stderr, "smallsh: bad redirection near '%s'\n", token);
+        return -1;
+    }
+
+    struct redirection *r = &redirs->list[redirs->count++];
+    r->fd = fd;
+    r->path = NULL;
+    r->dirFD = -1;
+    if (duplicate && strcmp(target, "-") == 0) {
+        r->type = REDIR_CLOSE;  // "2>&-"
+    } else if (duplicate && target[strspn(target, "0123456789")] == '\0') {
+        r->type = REDIR_DUP;  // "2>&1"
+        if ((r->source = parseDescriptor(target)) == -1) {
+            fprintf(stderr, "smallsh: bad file descriptor near '%s'\n", token);
+            redirs->count--;
+            return -1;
+        }
+    } else if (duplicate && token[0] == '>') {
+        both = 1;  // ">&file" is the old spelling of "&>file"
+    } else if (duplicate) {
+        fprintf(stderr, "smallsh: bad redirection near '%s'\n", token);
+        redirs->count--;
+        return -1;
+    }
+    if (!duplicate || both) {
+        r->type = REDIR_OPEN;
+        r->flags = flags;
+        r->path = target;
+    }
+    if (both) {
+        struct redirection *copy = &redirs->list[redirs->count++];
+        copy->type = REDIR_DUP;
+        copy->fd = 2;
+        copy->source = 1;
+        copy->path = NULL;
+        copy->dirFD = -1;
+    }
+    return 1;
+}
+
+int parseDescriptor(const char *text) {
+    errno = 0;
+    long value = strtol(text, NULL, 10);
+    return (errno == ERANGE || value > INT_MAX) ? -1 : (int)value;
+}
+
+char *findClosingParen(char *open) {
+    int depth = 0;
+
+    for (char *p = open; *p != '\0'; p++) {
+        if (*p == '\'' || *p == '"') {
+            // Parentheses inside quotes do not count ("$(echo ')')")
+            char *quote = strchr(p + 1, *p);
+            if (quote == NULL) return NULL;
+            p = quote;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+char *expandWord(char *token) {
+    struct capture word = { &lineArena, NULL, 0, 0 };
+    char *p = token;
+    char *arithEnd;
+    size_t length;
+
+    // Most words have nothing to expand and are used where they are
+    if (strchr(token, '$') == NULL) return token;
+
+    while (*p != '\0') {
+        if (p[0] == '$' && p[1] == '{') {
+            char *close = strchr(p + 2, '}');
+            if (close == NULL) {
+                fprintf(stderr, "smallsh: unterminated ${ in '%s'\n", token);
+                return NULL;
+            }
+            appendParameter(&word, p + 2, close - (p + 2));
+            p = close + 1;
+        } else if (p[0] == '$' && (length = nameLength(p + 1)) > 0) {
+            appendParameter(&word, p + 1, length);
+            p += 1 + length;
+        } else if (p[0] == '$' && p[1] != '\0' && strchr("$?!#@*0123456789", p[1]) != NULL) {
+            appendParameter(&word, p + 1, 1);
+            p += 2;
+        } else if ((arithEnd = findArithmeticEnd(p)) != NULL) {
+            // "$(( expr ))": evaluated right here, no process and no substitution
+            long long value;
+            char number[24];
+            *arithEnd = '\0';
+            char *expression = expandWord(p + 3);  // Parameters and substitutions inside come first
+            if (expression == NULL || evalArithmetic(expression, &value) == -1) return NULL;
+            captureAppend(&word, number, snprintf(number, sizeof(number), "%lld", value));
+            p = arithEnd + 2;
+        } else if (p[0] == '$' && p[1] == '(') {
+            char *close = findClosingParen(p + 1);
+            if (close == NULL) {
+                fprintf(stderr, "smallsh: unterminated $( in '%s'\n", token);
+                return NULL;
+            }
+            *close = '\0';
+
+            // The output goes straight into the word, then loses its trailing newlines
+            size_t start = word.length;
+            substituteCommand(p + 2, &word);
+            while (word.length > start && word.data[word.length - 1] == '\n') word.length--;
+            p = close + 1;
+        } else {
+            // Copy the literal run up to the next '$' in one go
+            length = strcspn(p + 1, "$") + 1;
+            captureAppend(&word, p, length);
+            p += length;
+        }
+    }
+    captureAppend(&word, "", 1);
+    return word.data;
+}
+
+int evalArithmetic(const char *text, long long *result) {
+    struct arithmetic a = { text, text, 0 };
+
+    *result = arithComma(&a, 1);
+    while (*a.p == ' ' || *a.p == '\t' || *a.p == '\n') a.p++;
+    if (*a.p != '\0') arithError(&a, "syntax error");
+    return a.error ? -1 : 0;
+}
+
+char *findArithmeticEnd(char *p) {
+    if (p[0] != '$' || p[1] != '(' || p[2] != '(') return NULL;
+    char *inner = findClosingParen(p + 2);
+    return (inner != NULL && inner[1] == ')') ? inner : NULL;
+}
+
+int arithAccept(struct arithmetic *a, const char *op) {
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') a->p++;
+    size_t length = strlen(op);
+    if (strncmp(a->p, op, length) != 0) return 0;
+    a->p += length;
+    return 1;
+}
+
+long long arithComma(struct arithmetic *a, int evaluate) {
+    long long value = arithAssignment(a, evaluate);
+    while (!a->error && arithAccept(a, ",")) value = arithAssignment(a, evaluate);
+    return value;
+}
+
+long long arithAssignment(struct arithmetic *a, int evaluate) {
+    static const char *assignOps[] = { "=", "+=", "-=", "*=", "/=", "%=", "<<=", ">>=", "&=", "^=", "|=", NULL };
+
+    // An assignment is a name followed by an assignment operator (but not "==")
+    const char *start = a->p;
+    while (*start == ' ' || *start == '\t' || *start == '\n') start++;
+    size_t length = nameLength(start);
+    if (length > 0) {
+        const char *after = start + length;
+        while (*after == ' ' || *after == '\t') after++;
+        for (int i = 0; assignOps[i] != NULL; i++) {
+            size_t opLength = strlen(assignOps[i]);
+            if (strncmp(after, assignOps[i], opLength) != 0 || after[opLength] == '=') continue;
+
+            a->p = after + opLength;
+            long long value = arithAssignment(a, evaluate);  // Right-associative: a = b = 1
+            if (!evaluate || a->error) return value;
+            if (i > 0) {
+                // "x op= y" is "x = x op y"
+                char op[4];
+                snprintf(op, sizeof(op), "%.*s", (int)opLength - 1, assignOps[i]);
+                value = arithApply(a, op, arithVariable(a, start, length), value);
+                if (a->error) return 0;
+            }
+            char number[24];
+            snprintf(number, sizeof(number), "%lld", value);
+            setVariable(start, length, number);
+            return value;
+        }
+    }
+    return arithTernary(a, evaluate);
+}
+
+long long arithTernary(struct arithmetic *a, int evaluate) {
+    long long condition = arithBinary(a, 1, evaluate);
+    if (a->error || !arithAccept(a, "?")) return condition;
+
+    long long whenTrue = arithAssignment(a, evaluate && condition);
+    if (!arithAccept(a, ":")) {
+        arithError(a, "':' expected");
+        return 0;
+    }
+    long long whenFalse = arithAssignment(a, evaluate && !condition);
+    return condition ? whenTrue : whenFalse;
+}
+
+long long arithBinary(struct arithmetic *a, int minPrecedence, int evaluate) {
+    // Longer spellings come before their prefixes ("<<" before "<", "**" before "*")
+    static const struct { const char *op; int precedence; } ops[] = {
+        { "||", 1 }, { "&&", 2 }, { "|", 3 }, { "^", 4 }, { "&", 5 }, { "==", 6 }, { "!=", 6 },
+        { "<<", 8 }, { ">>", 8 }, { "<=", 7 }, { ">=", 7 }, { "<", 7 }, { ">", 7 },
+        { "+", 9 }, { "-", 9 }, { "**", 11 }, { "*", 10 }, { "/", 10 }, { "%", 10 }, { NULL, 0 }
+    };
+
+    long long left = arithUnary(a, evaluate);
+    while (!a->error) {
+        while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') a->p++;
+
+        int i;
+        for (i = 0; ops[i].op != NULL; i++) {
+            size_t length = strlen(ops[i].op);
+            if (strncmp(a->p, ops[i].op, length) != 0) continue;
+            // "+=" and friends belong to an assignment, "++" to the operand that follows
+            char next = a->p[length];
+            if (next == '=' && strcmp(ops[i].op, "==") != 0 && strcmp(ops[i].op, "!=") != 0 &&
+                strcmp(ops[i].op, "<=") != 0 && strcmp(ops[i].op, ">=") != 0) i = -1;
+            break;
+        }
+        if (i < 0 || ops[i].op == NULL || ops[i].precedence < minPrecedence) break;
+
+        const char *op = ops[i].op;
+        a->p += strlen(op);
+        if (strcmp(op, "&&") == 0 || strcmp(op, "||") == 0) {
+            // Short-circuit: the right side is only evaluated when it decides the result
+            int decided = (op[0] == '&') ? !left : (left != 0);
+            long long right = arithBinary(a, ops[i].precedence + 1, evaluate && !decided);
+            left = decided ? (op[0] == '|') : (right != 0);
+        } else {
+            // "**" is right-associative; everything else groups to the left
+            int next = (strcmp(op, "**") == 0) ? ops[i].precedence : ops[i].precedence + 1;
+            long long right = arithBinary(a, next, evaluate);
+            if (!a->error) left = evaluate ? arithApply(a, op, left, right) : 0;
+        }
+    }
+    return left;
+}
+
+long long arithUnary(struct arithmetic *a, int evaluate) {
+    if (arithAccept(a, "++") || arithAccept(a, "--")) {
+        // Pre-increment and pre-decrement need a variable
+        int step = (a->p[-1] == '+') ? 1 : -1;
+        while (*a->p == ' ' || *a->p == '\t') a->p++;
+        size_t length = nameLength(a->p);
+        if (length == 0) {
+            arithError(a, "variable expected after ++ or --");
+            return 0;
+        }
+        const char *name = a->p;
+        a->p += length;
+        if (!evaluate) return 0;
+        long long value = arithApply(a, "+", arithVariable(a, name, length), step);
+        char number[24];
+        snprintf(number, sizeof(number), "%lld", value);
+        if (!a->error) setVariable(name, length, number);
+        return value;
+    }
+    if (arithAccept(a, "-")) {
+        long long value = arithUnary(a, evaluate);
+        if (value == INT64_MIN && evaluate) arithError(a, "arithmetic overflow");
+        return a->error ? 0 : -value;
+    }
+    if (arithAccept(a, "+")) return arithUnary(a, evaluate);
+    if (arithAccept(a, "!")) return !arithUnary(a, evaluate);
+    if (arithAccept(a, "~")) return ~arithUnary(a, evaluate);
+    return arithPrimary(a, evaluate);
+}
+
+long long arithPrimary(struct arithmetic *a, int evaluate) {
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') a->p++;
+
+    if (*a->p == '(') {
+        a->p++;
+        long long value = arithComma(a, evaluate);
+        if (!arithAccept(a, ")")) arithError(a, "')' expected");
+        return value;
+    }
+
+    if (*a->p >= '0' && *a->p <= '9') {
+        // Decimal, 0x hexadecimal or 0 octal, as in C
+        char *end;
+        errno = 0;
+        long long value = strtoll(a->p, &end, 0);
+        if (errno == ERANGE) arithError(a, "number too large");
+        if (nameLength(end) > 0 || (*end >= '0' && *end <= '9')) arithError(a, "bad number");
+        a->p = end;
+        return value;
+    }
+
+    // A variable, written with or without '$'
+    if (*a->p == '$') a->p++;
+    size_t length = nameLength(a->p);
+    if (length == 0) {
+        arithError(a, "syntax error");
+        return 0;
+    }
+    const char *name = a->p;
+    a->p += length;
+    long long value = arithVariable(a, name, length);
+
+    // Post-increment and post-decrement yield the old value
+    if (arithAccept(a, "++") || arithAccept(a, "--")) {
+        if (!evaluate || a->error) return value;
+        long long updated = arithApply(a, "+", value, (a->p[-1] == '+') ? 1 : -1);
+        char number[24];
+        snprintf(number, sizeof(number), "%lld", updated);
+        if (!a->error) setVariable(name, length, number);
+    }
+    return value;
+}
+
+long long arithApply(struct arithmetic *a, const char *op, long long left, long long right) {
+    long long result = 0;
+
+    switch (op[0]) {
+    case '+':
+        if (__builtin_add_overflow(left, right, &result)) arithError(a, "arithmetic overflow");
+        return result;
+    case '-':
+        if (__builtin_sub_overflow(left, right, &result)) arithError(a, "arithmetic overflow");
+        return result;
+    case '*':
+        if (op[1] == '*') {
+            // Exponentiation by squaring, with every step checked
+            if (right < 0) {
+                arithError(a, "negative exponent");
+                return 0;
+            }
+            result = 1;
+            while (right > 0 && !a->error) {
+                if ((right & 1) && __builtin_mul_overflow(result, left, &result)) arithError(a, "arithmetic overflow");
+                right >>= 1;
+                if (right > 0 && __builtin_mul_overflow(left, left, &left)) arithError(a, "arithmetic overflow");
+            }
+            return result;
+        }
+        if (__builtin_mul_overflow(left, right, &result)) arithError(a, "arithmetic overflow");
+        return result;
+    case '/':
+    case '%':
+        if (right == 0) {
+            arithError(a, "division by zero");
+            return 0;
+        }
+        if (left == INT64_MIN && right == -1) {
+            // The one quotient that does not fit; the remainder is simply 0
+            if (op[0] == '/') arithError(a, "arithmetic overflow");
+            return 0;
+        }
+        return (op[0] == '/') ? left / right : left % right;
+    case '<':
+        if (op[1] == '<') {
+            if (right < 0 || right > 63) {
+                arithError(a, "shift count out of range");
+                return 0;
+            }
+            return (long long)((unsigned long long)left << right);
+        }
+        return (op[1] == '=') ? left <= right : left < right;
+    case '>':
+        if (op[1] == '>') {
+            if (right < 0 || right > 63) {
+                arithError(a, "shift count out of range");
+                return 0;
+            }
+            return left >> right;
+        }
+        return (op[1] == '=') ? left >= right : left > right;
+    case '=':
+        return left == right;
+    case '!':
+        return left != right;
+    case '&':
+        return left & right;
+    case '^':
+        return left ^ right;
+    case '|':
+        return left | right;
+    }
+    arithError(a, "syntax error");
+    return 0;
+}
+
+void arithError(struct arithmetic *a, const char *message) {
+    if (!a->error) fprintf(stderr, "smallsh: %s: %s\n", a->text, message);
+    a->error = 1;
+}
+
+long long arithVariable(struct arithmetic *a, const char *name, size_t length) {
+    struct variable *variable = findVariable(name, length, 0);
+    if (variable == NULL || variable->value == NULL || variable->value[0] == '\0') return 0;
+
+    char *end;
+    errno = 0;
+    long long value = strtoll(variable->value, &end, 0);
+    if (errno == ERANGE || *end != '\0') {
+        fprintf(stderr, "smallsh: %.*s: not a number: %s\n", (int)length, name, variable->value);
+        a->error = 1;
+    }
+    return value;
+}
+
+void appendParameter(struct capture *word, const char *name, size_t length) {
+    char number[16];
+
+    if (length == 1 && name[0] == '$') {
+        captureAppend(word, shellPID, strlen(shellPID));
+    } else if (length == 1 && name[0] == '?') {
+        // Exit value, or 128 plus the signal number as other shells report it
+        int status = WIFEXITED(lastStatus) ? WEXITSTATUS(lastStatus) : 128 + WTERMSIG(lastStatus);
+        captureAppend(word, number, snprintf(number, sizeof(number), "%d", status));
+    } else if (length == 1 && name[0] == '!') {
+        if (lastBackgroundPid != 0) captureAppend(word, number, snprintf(number, sizeof(number), "%d", lastBackgroundPid));
+    } else if (length == 1 && name[0] == '#') {
+        captureAppend(word, number, snprintf(number, sizeof(number), "%d", positionalCount));
+    } else if (length == 1 && (name[0] == '@' || name[0] == '*')) {
+        for (int i = 1; i <= positionalCount; i++) {
+            if (i > 1) captureAppend(word, " ", 1);
+            captureAppend(word, positional[i], strlen(positional[i]));
+        }
+    } else if (length > 0 && strspn(name, "0123456789") >= length) {
+        int index = atoi(name);  // Stops at the first non-digit, which ends the name
+        if (index <= positionalCount) captureAppend(word, positional[index], strlen(positional[index]));
+    } else {
+        struct variable *variable = findVariable(name, length, 0);
+        if (variable != NULL && variable->value != NULL) captureAppend(word, variable->value, strlen(variable->value));
+    }
+}
+
+size_t nameLength(const char *text) {
+    if (!(*text == '_' || (*text >= 'A' && *text <= 'Z') || (*text >= 'a' && *text <= 'z'))) return 0;
+
+    size_t length = 1;
+    while (text[length] == '_' || (text[length] >= 'A' && text[length] <= 'Z') ||
+           (text[length] >= 'a' && text[length] <= 'z') || (text[length] >= '0' && text[length] <= '9')) {
+        length++;
+    }
+    return length;
+}
+
+int countAssignments(char **args) {
+    int count = 0;
+    while (args[count] != NULL) {
+        size_t length = nameLength(args[count]);
+        if (length == 0 || args[count][length] != '=') break;
+        count++;
+    }
+    return count;
+}
+
+struct variable *findVariable(const char *name, size_t length, int create) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+    // Grow before the table gets crowded, so probe runs stay short
+    if (create && (variables.count + 1) * 4 > variables.capacity * 3) {
+        struct variableTable old = variables;
+        variables.capacity = old.capacity ? old.capacity * 2 : MIN_VARIABLE_SLOTS;
+        variables.slots = calloc(variables.capacity, sizeof(struct variable));
+        if (variables.slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < old.capacity; i++) {
+            if (old.slots[i].name == NULL) continue;
+            size_t slot = old.slots[i].hash & (variables.capacity - 1);
+            while (variables.slots[slot].name != NULL) slot = (slot + 1) & (variables.capacity - 1);
+            variables.slots[slot] = old.slots[i];
+        }
+        free(old.slots);
+    }
+    if (variables.capacity == 0) return NULL;
+
+    size_t slot = hash & (variables.capacity - 1);
+    for (; variables.slots[slot].name != NULL; slot = (slot + 1) & (variables.capacity - 1)) {
+        struct variable *variable = &variables.slots[slot];
+        if (variable->hash == hash && variable->length == length && memcmp(variable->name, name, length) == 0) {
+            return variable;
+        }
+    }
+    if (!create) return NULL;
+
+    // Intern the name in the free slot the probe ended on
+    struct variable *variable = &variables.slots[slot];
+    variable->name = malloc(length + 1);
+    if (variable->name == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(variable->name, name, length);
+    variable->name[length] = '\0';
+    variable->length = length;
+    variable->hash = hash;
+    variable->envIndex = -1;
+    variables.count++;
+    return variable;
+}
+
+void setVariable(const char *name, size_t length, const char *value) {
+    struct variable *variable = findVariable(name, length, 1);
+    char *entry = NULL;
+
+    // One allocation holds "NAME=value", ready for the environment block
+    if (value != NULL) {
+        size_t valueLength = strlen(value);
+        entry = malloc(length + valueLength + 2);
+        if (entry == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(entry, variable->name, length);
+        entry[length] = '=';
+        memcpy(entry + length + 1, value, valueLength + 1);
+    }
+
+    if (!variable->borrowed) free(variable->entry);
+    variable->entry = entry;
+    variable->value = (entry != NULL) ? entry + length + 1 : NULL;
+    variable->borrowed = 0;
+    publishVariable(variable);
+}
+
+void publishVariable(struct variable *variable) {
+    int wanted = variable->exported && variable->entry != NULL;
+
+    if (wanted && variable->envIndex != -1) {
+        // Changed value: swap the pointer in its slot
+        environment[variable->envIndex] = variable->entry;
+    } else if (wanted) {
+        // Newly exported: append, keeping room for the NULL terminator
+        if (environmentCount + 2 > environmentCapacity) {
+            environmentCapacity = environmentCapacity ? environmentCapacity * 2 : MIN_VARIABLE_SLOTS;
+            environment = realloc(environment, environmentCapacity * sizeof(char *));
+            if (environment == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        variable->envIndex = environmentCount;
+        environment[environmentCount++] = variable->entry;
+        environment[environmentCount] = NULL;
+    } else if (variable->envIndex != -1) {
+        // Unset or unexported: move the last entry into the hole
+        char *last = environment[--environmentCount];
+        environment[environmentCount] = NULL;
+        if (variable->envIndex != environmentCount) {
+            environment[variable->envIndex] = last;
+            findVariable(last, strcspn(last, "="), 0)->envIndex = variable->envIndex;
+        }
+        variable->envIndex = -1;
+    }
+}
+
+void pushAssignments(char **args, int count, struct savedVariable *saved) {
+    for (int i = 0; i < count; i++) {
+        size_t length = nameLength(args[i]);
+        struct variable *variable = findVariable(args[i], length, 1);
+
+        saved[i] = (struct savedVariable){ variable->name, length, variable->entry, variable->borrowed, variable->exported };
+        // The word already reads "NAME=value", so it is used as the entry without copying
+        variable->entry = args[i];
+        variable->value = args[i] + length + 1;
+        variable->borrowed = 1;
+        variable->exported = 1;
+        publishVariable(variable);
+    }
+}
+
+void popAssignments(struct savedVariable *saved, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        struct variable *variable = findVariable(saved[i].name, saved[i].length, 1);
+
+        // The builtin may have set the variable itself (e.g. "A=1 export A=2"); the prefix still wins
+        if (!variable->borrowed) free(variable->entry);
+        variable->entry = saved[i].entry;
+        variable->value = (saved[i].entry != NULL) ? saved[i].entry + variable->length + 1 : NULL;
+        variable->borrowed = saved[i].borrowed;
+        variable->exported = saved[i].exported;
+        publishVariable(variable);
+    }
+}
+
+char **copyEnvironment() {
+    size_t size = (environmentCount + 1) * sizeof(char *);
+    for (int i = 0; i < environmentCount; i++) size += strlen(environment[i]) + 1;
+
+    char **copy = malloc(size);
+    if (copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    char *strings = (char *)(copy + environmentCount + 1);
+    for (int i = 0; i < environmentCount; i++) {
+        size_t length = strlen(environment[i]) + 1;
+        copy[i] = memcpy(strings, environment[i], length);
+        strings += length;
+    }
+    copy[environmentCount] = NULL;
+    return copy;
+}
+
+const char *getVariable(const char *name) {
+    struct variable *variable = findVariable(name, strlen(name), 0);
+    return (variable != NULL) ? variable->value : NULL;
+}
+
+void execCommand(char **args) {
+    extern char **environ;
+    int assignments = countAssignments(args);
+
+    // Only this child's copy of the block changes, one slot per assignment
+    for (int i = 0; i < assignments; i++) {
+        size_t length = nameLength(args[i]);
+        struct variable *variable = findVariable(args[i], length, 1);
+        variable->entry = args[i];
+        variable->borrowed = 1;
+        variable->exported = 1;
+        publishVariable(variable);
+    }
+
+    // execvpe() looks PATH up through environ, so point that at the block as well
+    environ = environment;
+    execvpe(args[assignments], args + assignments, environment);
+    perror(args[assignments]);
+    exit(1);
+}
+
+void assignVariable(const char *word) {
+    size_t length = nameLength(word);
+    setVariable(word, length, word + length + 1);
+}
+
+void initVariables(char **argv) {
+    extern char **environ;
+
+    snprintf(shellPID, sizeof(shellPID), "%d", getpid());
+
+    for (char **entry = environ; *entry != NULL; entry++) {
+        char *equals = strchr(*entry, '=');
+        if (equals == NULL) continue;
+        struct variable *variable = findVariable(*entry, equals - *entry, 1);
+        variable->entry = *entry;  // The startup environment stays allocated, so its strings are borrowed
+        variable->value = equals + 1;
+        variable->borrowed = 1;
+        variable->exported = 1;
+        publishVariable(variable);
+    }
+
+    positionalCount = 0;
+    while (argv[positionalCount + 1] != NULL) positionalCount++;
+    positional = malloc((positionalCount + 1) * sizeof(char *));
+    for (int i = 0; i <= positionalCount; i++) positional[i] = strdup(argv[i]);
+}
+
+void substituteCommand(char *text, struct capture *output) {
+    char *args[MAX_ARGS];
+    struct redirections redirs;
+    struct builtin *builtin;
+    struct program *program;
+    int background;
+
+    // The inner text is compiled like a command line of its own; '&' has no effect on it
+    int status = compileProgram(text, strlen(text), &program);
+    if (status != COMPILE_OK) {
+        if (status == COMPILE_INCOMPLETE) fprintf(stderr, "smallsh: syntax error: unexpected end of $(%s)\n", text);
+        setStatus(2 << 8);
+        return;
+    }
+    if (program->root == -1) {
+        releaseProgram(program);
+        return;
+    }
+
+    // Anything but a single simple command runs in a subshell
+    struct node *node = &program->nodes[program->root];
+    if (node->type != NODE_COMMAND || node->next != -1) {
+        captureSubshell(program, program->root, output);
+        releaseProgram(program);
+        return;
+    }
+    if (!expandCommand(program, program->root, args, &redirs, &background)) {
+        releaseProgram(program);
+        return;
+    }
+
+    int assignments = countAssignments(args);
+    builtin = (args[assignments] != NULL && findFunction(args[assignments]) == NULL) ? findBuiltin(args[assignments]) : NULL;
+    if (builtin != NULL && builtin->ownIO) {
+        // In-process fast path: no fork, no pipe; the builtin appends to the capture itself
+        struct builtinIO io = { {commandFD[0], CAPTURE_FD, commandFD[2]}, {0}, 0, output };
+        struct savedVariable saved[assignments + 1];
+        pushAssignments(args, assignments, saved);
+        runBuiltinWith(builtin, args + assignments, &redirs, &io);
+        popAssignments(saved, assignments);
+    } else if (args[assignments] == NULL || builtin != NULL || findFunction(args[assignments]) != NULL ||
+               strcmp(args[0], "exit") == 0 || strcmp(args[0], "cd") == 0) {
+        // WHY: Assignments, exit, cd, functions and builtins that start commands (timeout 5 cmd) must not affect this shell.
+        // WHAT: So, as in any subshell, they run in a child of their own.
+        captureSubshell(program, program->root, output);
+    } else {
+        int pipeFD[2];
+        if (redirs.count == MAX_REDIRS || pipe2(pipeFD, O_CLOEXEC) == -1) {
+            fprintf(stderr, "smallsh: cannot capture output of %s\n", args[0]);
+            setStatus(1 << 8);
+            releaseRedirections(&redirs);
+            releaseProgram(program);
+            return;
+        }
+
+        // stdout goes to the pipe ahead of the command's own redirections, so "$(cmd 2>&1)" captures both
+        memmove(&redirs.list[1], &redirs.list[0], redirs.count * sizeof(struct redirection));
+        redirs.list[0] = (struct redirection){ .type = REDIR_DUP, .fd = 1, .source = pipeFD[1], .dirFD = -1 };
+        redirs.count++;
+
+        pid_t spawnpid = spawnCommand(args, &redirs, 0, 0);
+        close(pipeFD[1]);
+
+        // Read until the command (and anything it left running) closes the pipe
+        ssize_t n;
+        while ((n = captureRead(output, pipeFD[0])) != 0) {
+            if (n == -1 && errno != EINTR) break;
+        }
+        close(pipeFD[0]);
+        setStatus(waitForeground(spawnpid));
+    }
+    releaseRedirections(&redirs);
+    releaseProgram(program);
+}
+
+void *arenaAlloc(struct arena *arena, size_t size) {
+    struct arenaBlock *block = arena->blocks;
+
+    size = (size + 15) & ~(size_t)15;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arenaBlock) + blockSize);
+        if (block == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        block->size = blockSize;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+void arenaReset(struct arena *arena) {
+    struct arenaBlock *block = arena->blocks;
+    if (block == NULL) return;
+
+    while (block->next != NULL) {
+        struct arenaBlock *next = block->next->next;
+        free(block->next);
+        block->next = next;
+    }
+    block->used = 0;
+}
+
+struct arenaMark arenaMark(struct arena *arena) {
+    struct arenaMark mark = { arena->blocks, arena->blocks ? arena->blocks->used : 0 };
+    return mark;
+}
+
+void arenaRelease(struct arena *arena, struct arenaMark mark) {
+    // Blocks are newest first: free those started after the mark, then rewind the marked one
+    while (arena->blocks != mark.block) {
+        struct arenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    if (mark.block != NULL) mark.block->used = mark.used;
+}
+
+char *arenaCopy(struct arena *arena, const char *text) {
+    size_t length = strlen(text);
+    char *copy = arenaAlloc(arena, length + 1);
+    memcpy(copy, text, length + 1);
+    return copy;
+}
+
+char *captureReserve(struct capture *capture, size_t size) {
+    if (capture->length + size > capture->capacity) {
+        size_t capacity = capture->capacity ? capture->capacity * 2 : 64;
+        while (capacity < capture->length + size) capacity *= 2;
+
+        char *data = arenaAlloc(capture->arena, capacity);
+        if (capture->length > 0) memcpy(data, capture->data, capture->length);
+        capture->data = data;
+        capture->capacity = capacity;
+    }
+    return capture->data + capture->length;
+}
+
+void captureAppend(struct capture *capture, const char *data, size_t length) {
+    memcpy(captureReserve(capture, length), data, length);
+    capture->length += length;
+}
+
+ssize_t captureRead(struct capture *capture, int fd) {
+    // Use the room already there, growing only when less than a chunk is left
+    if (capture->capacity - capture->length < CAPTURE_CHUNK) captureReserve(capture, CAPTURE_CHUNK);
+    if (waitDescriptor(fd, EPOLLIN) == -1) return -1;
+    ssize_t n = read(fd, capture->data + capture->length, capture->capacity - capture->length);
+    if (n > 0) capture->length += n;
+    return n;
+}
+
+void changeDirectory(char **args) {
+    setStatus(1 << 8);
+
+    // Check if the user provided a directory argument (args[1])
+    if (args[1] == NULL) {
+        // No directory specified, change to the user's home directory
+        const char *home = getVariable("HOME");
+        if (home == NULL) {
+            fprintf(stderr, "cd: HOME not set\n");
+        } else if (moveToDirectory(home, NULL, "cd") == 0) {
+            setStatus(0);
+        }
+    } else if (strcmp(args[1], "-") == 0) {
+        // WHY: Going back is the common case, and the previous directory may be many components deep.
+        // WHAT: Return through its saved O_PATH descriptor, then say where we are, as other shells do.
+        if (previousDirectory.fd == -1) {
+            fprintf(stderr, "cd: no previous directory\n");
+        } else if (moveToDirectory(previousDirectory.path, &previousDirectory, "cd") == 0) {
+            printf("%s\n", getVariable("PWD"));
+            fflush(stdout);
+            setStatus(0);
+        }
+    } else if (moveToDirectory(args[1], NULL, "cd") == 0) {
+        // Attempt to change to the specified directory; failures have been reported
+        setStatus(0);
+    }
+}
+
+int moveToDirectory(const char *path, struct savedDirectory *saved, const char *command) {
+    struct savedDirectory left;
+    char *leftPath = NULL;
+    int hadDirectory = (saveDirectory(&left) == 0);
+    if (hadDirectory) leftPath = strdup(left.path);
+
+    if ((saved != NULL ? returnToDirectory(saved) : chdir(path)) == -1) {
+        fprintf(stderr, "%s: %s: %s\n", command, path, strerror(errno));
+        if (hadDirectory) releaseDirectory(&left);
+        free(leftPath);
+        return -1;
+    }
+
+    // The directory left is where `cd -` goes next (saved may be that very entry, so it is replaced last)
+    releaseDirectory(&previousDirectory);
+    if (hadDirectory) previousDirectory = left;
+    flushRelativeDirCache();  // Cached relative directories now point at the old location
+
+    char current[PATH_MAX];
+    if (leftPath != NULL) setVariable("OLDPWD", 6, leftPath);
+    if (getcwd(current, sizeof(current)) != NULL) {
+        setVariable("PWD", 3, current);
+        recordVisit(current);
+    }
+    free(leftPath);
+    return 0;
+}
+
+int saveDirectory(struct savedDirectory *saved) {
+    char path[PATH_MAX];
+    saved->fd = -1;
+    saved->path = NULL;
+    if (getcwd(path, sizeof(path)) == NULL) return -1;
+    saved->fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (saved->fd == -1) return -1;
+    saved->path = strdup(path);
+    return 0;
+}
+
+int returnToDirectory(struct savedDirectory *saved) {
+    struct stat info;
+    if (fstat(saved->fd, &info) == 0 && info.st_nlink == 0) return chdir(saved->path);  // Removed: try the name
+    return fchdir(saved->fd);
+}
+
+void releaseDirectory(struct savedDirectory *saved) {
+    if (saved->fd != -1) close(saved->fd);
+    free(saved->path);
+    saved->fd = -1;
+    saved->path = NULL;
+}
+
+void pushdCommand(char **args, struct redirections *redirs, int background) {
+    struct savedDirectory here;
+    setStatus(1 << 8);
+
+    if (args[1] == NULL && directoryStackCount == 0) {
+        fprintf(stderr, "pushd: no other directory\n");
+        return;
+    }
+    if (saveDirectory(&here) == -1) {
+        perror("pushd");
+        return;
+    }
+
+    if (args[1] == NULL) {
+        // Swap: go to the top of the stack, which the current directory then replaces
+        struct savedDirectory *top = &directoryStack[directoryStackCount - 1];
+        if (moveToDirectory(top->path, top, "pushd") == -1) {
+            releaseDirectory(&here);
+            return;
+        }
+        releaseDirectory(top);
+        *top = here;
+    } else {
+        if (moveToDirectory(args[1], NULL, "pushd") == -1) {
+            releaseDirectory(&here);
+            return;
+        }
+        if (directoryStackCount == directoryStackCapacity) {
+            directoryStackCapacity = directoryStackCapacity ? directoryStackCapacity * 2 : 8;
+            directoryStack = realloc(directoryStack, directoryStackCapacity * sizeof(struct savedDirectory));
+            if (directoryStack == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        directoryStack[directoryStackCount++] = here;
+    }
+    dirsCommand(args, redirs, background);
+}
+
+void popdCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(1 << 8);
+    if (directoryStackCount == 0) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return;
+    }
+    struct savedDirectory *top = &directoryStack[directoryStackCount - 1];
+    if (moveToDirectory(top->path, top, "popd") == -1) return;
+    releaseDirectory(top);
+    directoryStackCount--;
+    dirsCommand(args, redirs, background);
+}
+
+void dirsCommand(char **args, struct redirections *redirs, int background) {
+    struct capture list = { &lineArena, NULL, 0, 0 };
+    char path[PATH_MAX];
+    const char *current = getcwd(path, sizeof(path)) ? path : "?";
+
+    captureAppend(&list, current, strlen(current));
+    for (int i = directoryStackCount - 1; i >= 0; i--) {
+        captureAppend(&list, " ", 1);
+        captureAppend(&list, directoryStack[i].path, strlen(directoryStack[i].path));
+    }
+    captureAppend(&list, "\n", 1);
+    setStatus((builtinWrite(currentIO->fd[1], list.data, list.length) == -1) ? 1 << 8 : 0);
+}
+
+void zCommand(char **args, struct redirections *redirs, int background) {
+    int listing = (args[1] != NULL && strcmp(args[1], "-l") == 0);
+    char **patterns = args + 1 + listing;
+    setStatus(1 << 8);
+
+    if (openFrecency() == -1) return;
+    if (patterns[0] == NULL) listing = 1;
+    time_t now = time(NULL);
+
+    flock(frecencyFD, LOCK_SH);
+    struct frecencyEntry *entries = (struct frecencyEntry *)(frecency + 1);
+    uint32_t count = frecency->count;
+    if (count > FRECENCY_MAX_ENTRIES) count = FRECENCY_MAX_ENTRIES;
+
+    // Matching entries by score: listed lowest first (so the best ends up next to the prompt), or the best
+    // one that still exists is the target
+    struct frecencyEntry **matches = malloc((count + 1) * sizeof(struct frecencyEntry *));
+    if (matches == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t matchCount = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (memchr(entries[i].path, '\0', FRECENCY_PATH_MAX) != NULL && matchesPatterns(entries[i].path, patterns)) {
+            matches[matchCount++] = &entries[i];
+        }
+    }
+    char target[FRECENCY_PATH_MAX] = "";
+    if (listing) {
+        struct capture list = { &lineArena, NULL, 0, 0 };
+        struct frecencyEntry *scored = arenaAlloc(&lineArena, (matchCount + 1) * sizeof(struct frecencyEntry));
+        for (size_t i = 0; i < matchCount; i++) {
+            scored[i] = *matches[i];
+            scored[i].rank = frecencyScore(matches[i], now);
+        }
+        qsort(scored, matchCount, sizeof(struct frecencyEntry), compareRanks);
+        for (size_t i = 0; i < matchCount; i++) {
+            char line[FRECENCY_PATH_MAX + 32];
+            captureAppend(&list, line, snprintf(line, sizeof(line), "%10.2f  %s\n", scored[i].rank, scored[i].path));
+        }
+        flock(frecencyFD, LOCK_UN);
+        free(matches);
+        setStatus((matchCount > 0 && builtinWrite(currentIO->fd[1], list.data, list.length) != -1) ? 0 : 1 << 8);
+        return;
+    }
+    while (matchCount > 0 && target[0] == '\0') {
+        size_t best = 0;
+        for (size_t i = 1; i < matchCount; i++) {
+            if (frecencyScore(matches[i], now) > frecencyScore(matches[best], now)) best = i;
+        }
+        struct stat info;
+        if (stat(matches[best]->path, &info) == 0 && S_ISDIR(info.st_mode)) {
+            strcpy(target, matches[best]->path);
+        } else {
+            matches[best] = matches[--matchCount];  // Gone since it was visited
+        }
+    }
+    flock(frecencyFD, LOCK_UN);
+    free(matches);
+
+    if (target[0] == '\0') {
+        fprintf(stderr, "z: no match\n");
+        return;
+    }
+    if (moveToDirectory(target, NULL, "z") == 0) setStatus(0);
+}
+
+int openFrecency() {
+    if (frecencyFD == -2) return -1;
+    if (frecency != NULL) return 0;
+
+    // The shell's variables, not environ: "export SMALLSH_Z=..." in the shell counts too
+    const char *path = getVariable("SMALLSH_Z");
+    const char *home = getVariable("HOME");
+    char defaultPath[PATH_MAX];
+    if (path == NULL && home != NULL) {
+        snprintf(defaultPath, sizeof(defaultPath), "%s/.smallsh_z", home);
+        path = defaultPath;
+    }
+    frecencyFD = (path != NULL) ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600) : -1;
+    if (frecencyFD == -1) {
+        if (path != NULL) fprintf(stderr, "smallsh: %s: %s\n", path, strerror(errno));
+        frecencyFD = -2;
+        return -1;
+    }
+
+    // The file is as large as it can get from the start (sparse, so only used entries take space), and
+    // is never remapped; a new file gets its header under the lock, once
+    size_t size = sizeof(struct frecencyHeader) + FRECENCY_MAX_ENTRIES * sizeof(struct frecencyEntry);
+    flock(frecencyFD, LOCK_EX);
+    struct stat info = { 0 };
+    if (fstat(frecencyFD, &info) == 0 && (size_t)info.st_size < size && ftruncate(frecencyFD, size) == -1) {
+        perror("z");
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, frecencyFD, 0);
+    if (map != MAP_FAILED && info.st_size == 0) memcpy(((struct frecencyHeader *)map)->magic, FRECENCY_MAGIC, 8);
+    flock(frecencyFD, LOCK_UN);
+    if (map == MAP_FAILED || memcmp(((struct frecencyHeader *)map)->magic, FRECENCY_MAGIC, 8) != 0) {
+        fprintf(stderr, "smallsh: %s: not a frecency database\n", path);
+        if (map != MAP_FAILED) munmap(map, size);
+        close(frecencyFD);
+        frecencyFD = -2;
+        return -1;
+    }
+    frecency = map;
+    return 0;
+}
+
+void recordVisit(const char *path) {
+    size_t length = strlen(path);
+    if (!editor.enabled || length >= FRECENCY_PATH_MAX || openFrecency() == -1) return;
+    time_t now = time(NULL);
+
+    flock(frecencyFD, LOCK_EX);
+    struct frecencyEntry *entries = (struct frecencyEntry *)(frecency + 1), *entry = NULL, *weakest = NULL;
+    uint32_t count = frecency->count;
+    if (count > FRECENCY_MAX_ENTRIES) count = FRECENCY_MAX_ENTRIES;
+    for (uint32_t i = 0; i < count && entry == NULL; i++) {
+        if (strncmp(entries[i].path, path, FRECENCY_PATH_MAX) == 0) entry = &entries[i];
+        if (weakest == NULL || frecencyScore(&entries[i], now) < frecencyScore(weakest, now)) weakest = &entries[i];
+    }
+
+    // A new directory takes a fresh entry, or once the file is full the one that has decayed the most
+    if (entry == NULL) {
+        entry = (count < FRECENCY_MAX_ENTRIES) ? &entries[count] : weakest;
+        if (count < FRECENCY_MAX_ENTRIES) frecency->count = count + 1;
+        entry->rank = 0;
+        entry->visited = now;
+        memset(entry->path, 0, FRECENCY_PATH_MAX);
+        memcpy(entry->path, path, length);
+    }
+    entry->rank = frecencyScore(entry, now) + 1;
+    entry->visited = now;
+    flock(frecencyFD, LOCK_UN);
+}
+
+double frecencyScore(struct frecencyEntry *entry, time_t now) {
+    return entry->rank * decayFactor(now - entry->visited);
+}
+
+double decayFactor(int64_t seconds) {
+    if (seconds <= 0) return 1;
+    int64_t halvings = seconds / FRECENCY_HALF_LIFE;
+    if (halvings >= 60) return 0;
+
+    // 2^-x on [0, 1) by a quadratic through its ends and middle (off by under 0.5%)
+    double x = (double)(seconds % FRECENCY_HALF_LIFE) / FRECENCY_HALF_LIFE;
+    return (1 - x * (0.6716 - 0.1716 * x)) / (double)(1ULL << halvings);
+}
+
+int compareRanks(const void *a, const void *b) {
+    double left = ((const struct frecencyEntry *)a)->rank, right = ((const struct frecencyEntry *)b)->rank;
+    return (left > right) - (left < right);
+}
+
+int matchesPatterns(const char *path, char **patterns) {
+    for (int i = 0; patterns[i] != NULL; i++) {
+        const char *found = patterns[i];
+        int ignoreCase = 1;
+        for (; *found != '\0'; found++) ignoreCase = ignoreCase && !(*found >= 'A' && *found <= 'Z');
+        found = ignoreCase ? strcasestr(path, patterns[i]) : strstr(path, patterns[i]);
+        if (found == NULL) return 0;
+        path = found + strlen(patterns[i]);
+    }
+    return 1;
+}
+
+void displayStatus() {
+    // Check if the last foreground process exited normally
+    if (WIFEXITED(lastStatus)) {
+        // If the process exited normally, print its exit value
+        builtinPrintf("exit value %d\n", WEXITSTATUS(lastStatus));
+        // WHY: `WIFEXITED` checks if the process terminated normally, and `WEXITSTATUS` extracts its exit code.
+        // WHAT: This provides the user with the exit status of the last foreground command.
+    } else {
+        // If the process was terminated by a signal, print the signal number
+        builtinPrintf("terminated by signal %d\n", WTERMSIG(lastStatus));
+        // WHY: `WIFSIGNALED` checks if the process was terminated by a signal, and `WTERMSIG` extracts the signal number.
+        // WHAT: This informs the user of the signal (e.g., SIGINT) that caused the process to terminate abnormally.
+    }
+    if (lastTimedOut) builtinPrintf("(timed out)\n");  // The signal or exit value above came from `timeout`
+    // WHY: builtinPrintf() writes straight to the builtin's stdout, so nothing is left sitting in a buffer
+    // WHAT: The status message appears promptly, and follows "status > file" redirections.
+}
+
+void setStatus(int status) {
+    lastStatus = status;
+    lastTimedOut = 0;
+}
+
+struct job *executeCommand(char **args, struct redirections *redirs, int background) {
+    // Foreground-only mode is applied by expandCommand(), which drops the '&' of typed commands.
+    // WHY: Runs started by the shell itself (watchers) must stay in the background in every mode.
+    // WHAT: `background` is taken as given here.
+
+    pid_t spawnpid = spawnCommand(args, redirs, background, background);
+
+    if (background) {  // For background processes
+        printf("background pid is %d\n", spawnpid);  // Print the PID of the background process
+        fflush(stdout);
+        // WHY: Notifies the user that a command is running in the background.
+        // WHAT: Provides feedback about the background process PID.
+        return addJob(spawnpid);
+    }
+
+    setStatus(waitForeground(spawnpid));  // Wait for the process to finish
+    if (WIFSIGNALED(lastStatus) && WTERMSIG(lastStatus) == SIGINT) programInterrupted = 1;  // Ctrl+C ends loops too
+    if (WIFSIGNALED(lastStatus)) {  // Check if process terminated due to a signal
+        printf("terminated by signal %d\n", WTERMSIG(lastStatus));  // Print the signal number
+        fflush(stdout);
+        // WHY: Informs the user if a process was terminated abnormally by a signal.
+        // WHAT: Provides feedback about unexpected terminations.
+    }
+    return NULL;
+}
+
+pid_t spawnCommand(char **args, struct redirections *redirs, int background, int ownGroup) {
+    resolveRedirections(redirs);  // Directory lookups happen once, in the shell, and are cached
+    pid_t spawnpid = fork();  // Create a child process to execute the command
+
+    if (spawnpid == -1) {
+        perror("fork");  // Print error if fork fails
+        exit(1);  // Exit the program as we cannot continue without forking
+        // WHY: Forking creates a new process to run the command; failure means no process is available.
+        // WHAT: The shell cannot execute further commands if forking fails.
+    } else if (spawnpid == 0) {  // Child process block
+        // Inside a pipeline stage, the stage's pipe ends become stdin and stdout
+        inheritCommandFDs();
+
+        // Child process: set up signal handling for foreground and background
+        struct sigaction SIGINT_action = {{0}};
+        sigemptyset(&SIGINT_action.sa_mask);
+
+        // Background processes ignore SIGINT; foreground processes handle it normally
+        SIGINT_action.sa_handler = (background) ? SIG_IGN : SIG_DFL;
+        sigaction(SIGINT, &SIGINT_action, NULL);
+        // WHY: SIGINT (Ctrl+C) should not terminate background processes.
+        // WHAT: Foreground processes can be interrupted by the user; background processes cannot.
+
+        // Background (and timed) processes get their own process group
+        if (ownGroup) {
+            int foreground = !background && ownsTerminal();  // Asked before leaving the shell's group
+            setpgid(0, 0);
+            if (foreground) setTerminalGroup(getpid());
+        }
+        // WHY: Keeps Ctrl+Z away from them and lets the shell signal a job together with its children.
+        // A foreground one takes the terminal itself too, or reading it first would stop it with SIGTTIN.
+
+        // Background processes without their own input read from /dev/null
+        if (background && !redirectsFD(redirs, 0)) {
+            if (dup2(devNullFD, 0) == -1) {  // Redirect input to the shell's /dev/null
+                perror("dup2 input to /dev/null");
+                exit(1);
+            }
+            // WHY: Background processes should not wait for user input.
+            // WHAT: Redirects input to /dev/null to avoid waiting for input.
+        }
+
+        // Background processes without their own output write to /dev/null
+        if (background && !redirectsFD(redirs, 1)) {
+            if (dup2(devNullFD, 1) == -1) {  // Redirect output to the shell's /dev/null
+                perror("dup2 output to /dev/null");
+                exit(1);
+            }
+            // WHY: Prevents background processes from cluttering the terminal with output.
+            // WHAT: Redirects output to /dev/null to suppress it.
+        }
+
+        // Apply the command's own redirections in the order they were written
+        applyRedirections(redirs, 0);
+        // WHY: Later steps see the effect of earlier ones, so "> out 2>&1" sends both streams to out.
+
+        // Execute the command
+        execCommand(args);  // Replace the child process with the specified command
+        // WHY: execvpe runs the specified command with the shell's environment block, replacing the child process image.
+        // WHAT: If it returns, execution failed, so execCommand() reports it and the child exits with an error.
+    }
+
+    // Parent: also set the group (and hand over the terminal) here so it is done before anyone relies on it
+    if (ownGroup) {
+        setpgid(spawnpid, spawnpid);
+        if (!background && ownsTerminal()) setTerminalGroup(spawnpid);
+    }
+    return spawnpid;
+}
+
+void setTerminalGroup(pid_t group) {
+    sigset_t ttou, old;
+
+    if (!isatty(STDIN_FILENO)) return;
+
+    // WHY: A process outside the foreground group that changes it is sent SIGTTOU, which would stop the shell.
+    // WHAT: Hold SIGTTOU off in this thread for the call; tcsetpgrp() then goes ahead.
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    pthread_sigmask(SIG_BLOCK, &ttou, &old);
+    if (tcsetpgrp(STDIN_FILENO, group) == -1) perror("tcsetpgrp");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+int ownsTerminal() {
+    return isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+}
+
+void applyRedirections(struct redirections *redirs, int skipStdio) {
+    for (int i = 0; i < redirs->count; i++) {
+        struct redirection *r = &redirs->list[i];
+        if (skipStdio && r->fd <= 1) continue;
+
+        if (r->type == REDIR_OPEN) {
+            // Open (or create) the file, relative to its cached directory when there is one
+            int fd = (r->dirFD != -1) ? openat(r->dirFD, r->name, r->flags, 0644) : open(r->path, r->flags, 0644);
+            if (fd == -1) {
+                perror(r->flags == O_RDONLY ? "cannot open input file" : "cannot open output file");
+                exit(1);
+            }
+            if (fd != r->fd) {
+                if (dup2(fd, r->fd) == -1) {  // Move it onto the requested descriptor
+                    perror("dup2");
+                    exit(1);
+                }
+                close(fd);
+            }
+        } else if (r->type == REDIR_DUP || r->type == REDIR_DATA) {
+            if (r->source == r->fd) continue;  // "1>&1" changes nothing
+            if (dup2(r->source, r->fd) == -1) {
+                perror("dup2");
+                exit(1);
+            }
+        } else {
+            close(r->fd);
+        }
+    }
+}
+
+void resolveRedirections(struct redirections *redirs) {
+    for (int i = 0; i < redirs->count; i++) {
+        struct redirection *r = &redirs->list[i];
+        if (r->type == REDIR_DATA) lseek(r->source, 0, SEEK_SET);  // Stored commands reuse their memfd
+        if (r->type != REDIR_OPEN) continue;
+
+        // Only paths with a directory part benefit; a bare name is already relative to the cwd
+        char *slash = strrchr(r->path, '/');
+        r->dirFD = -1;
+        if (slash == NULL || slash[1] == '\0') continue;
+
+        char dir[MAX_CMD_LEN];
+        int length = (slash == r->path) ? 1 : (int)(slash - r->path);  // "/file" lives in "/"
+        if (length >= (int)sizeof(dir)) continue;
+        memcpy(dir, r->path, length);
+        dir[length] = '\0';
+        r->dirFD = cachedDirFD(dir);
+        r->name = slash + 1;
+    }
+}
+
+int cachedDirFD(const char *dir) {
+    struct dirCacheEntry *victim = &dirCache[0];
+
+    struct stat info;
+
+    // The path is looked up on every use anyway; a stat() confirms it still names the cached directory
+    if (stat(dir, &info) == -1 || !S_ISDIR(info.st_mode)) return -1;  // The child's open() reports it
+
+    dirCacheTick++;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dirCache[i].dir != NULL && strcmp(dirCache[i].dir, dir) == 0) {
+            if (dirCache[i].device == info.st_dev && dirCache[i].inode == info.st_ino) {
+                dirCache[i].lastUse = dirCacheTick;
+                return dirCache[i].fd;
+            }
+            victim = &dirCache[i];  // Renamed or replaced since: reopen it in the same entry
+            break;
+        }
+        if (dirCache[i].lastUse < victim->lastUse) victim = &dirCache[i];
+    }
+
+    // Miss: resolve the directory once; O_PATH needs no permissions beyond the path walk itself
+    int opened = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (opened == -1) return -1;  // Let the child's open() report the error against the full path
+    if (fstat(opened, &info) == -1) {
+        close(opened);
+        return -1;
+    }
+
+    // WHY: A low descriptor could be the target of a later "N>" redirection, which would replace it.
+    // WHAT: Keep it at 10 or above, where redirectShell() keeps its saved descriptors too.
+    int fd = fcntl(opened, F_DUPFD_CLOEXEC, 10);
+    close(opened);
+    if (fd == -1) return -1;
+
+    if (victim->dir != NULL) {
+        free(victim->dir);
+        close(victim->fd);
+    }
+    victim->dir = strdup(dir);
+    victim->fd = fd;
+    victim->device = info.st_dev;
+    victim->inode = info.st_ino;
+    victim->lastUse = dirCacheTick;
+    return fd;
+}
+
+void flushRelativeDirCache() {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dirCache[i].dir != NULL && dirCache[i].dir[0] != '/') {
+            free(dirCache[i].dir);
+            close(dirCache[i].fd);
+            dirCache[i].dir = NULL;
+            dirCache[i].lastUse = 0;
+        }
+    }
+}
+
+int sealedMemfd(const char *name, const char *data, size_t length) {
+    int created = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (created == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+    int fd = fcntl(created, F_DUPFD_CLOEXEC, 10);  // Out of reach of the redirections applied before it
+    close(created);
+    if (fd == -1) {
+        perror("here-document");
+        return -1;
+    }
+
+    for (size_t written = 0; written < length; ) {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("here-document");
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+
+    // Seal it: the command can read the text but neither change nor resize it
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+void releaseRedirections(struct redirections *redirs) {
+    for (int i = 0; i < redirs->count; i++) {
+        if (redirs->list[i].type == REDIR_DATA && redirs->list[i].source != -1) {
+            close(redirs->list[i].source);
+            redirs->list[i].source = -1;
+        }
+    }
+    redirs->count = 0;
+}
+
+int redirectsFD(struct redirections *redirs, int fd) {
+    for (int i = 0; i < redirs->count; i++) {
+        if (redirs->list[i].fd == fd) return 1;
+    }
+    return 0;
+}
+
+struct redirection *findRedirection(struct redirections *redirs, int fd) {
+    struct redirection *found = NULL;
+    for (int i = 0; i < redirs->count; i++) {
+        if (redirs->list[i].fd == fd) found = &redirs->list[i];
+    }
+    return found;
+}
+
+void splitCommand(char **args, struct redirections *redirs, int background) {
+    long ways = sysconf(_SC_NPROCESSORS_ONLN);  // Default to one chunk per online CPU
+    int cmdStart = 1;
+
+    // Parse the optional "-j N" chunk count
+    if (args[1] != NULL && strcmp(args[1], "-j") == 0) {
+        char *end;
+        ways = (args[2] != NULL) ? strtol(args[2], &end, 10) : 0;
+        if (args[2] == NULL || *end != '\0' || ways < 1) {
+            fprintf(stderr, "split: -j expects a positive number\n");
+            setStatus(1 << 8);
+            return;
+        }
+        cmdStart = 3;
+    }
+    if (ways > MAX_SPLIT_JOBS) ways = MAX_SPLIT_JOBS;
+
+    // The chunks are cut from the file opened on stdin; a file opened on stdout collects the outputs
+    struct redirection *input = findRedirection(redirs, 0);
+    struct redirection *output = findRedirection(redirs, 1);
+    if (output != NULL && output->type != REDIR_OPEN) output = NULL;
+    if (args[cmdStart] == NULL || input == NULL || input->type != REDIR_OPEN) {
+        fprintf(stderr, "usage: split [-j N] command [args...] < inputFile [> outputFile]\n");
+        setStatus(1 << 8);
+        return;
+    }
+    char **cmd = args + cmdStart;
+
+    // Map the whole input file so chunk boundaries can be found without reading it through a buffer
+    int inputFD = open(input->path, O_RDONLY | O_CLOEXEC);
+    if (inputFD == -1) {
+        perror("cannot open input file");
+        setStatus(1 << 8);
+        return;
+    }
+    struct stat st;
+    if (fstat(inputFD, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "split: %s is not a regular file\n", input->path);
+        close(inputFD);
+        setStatus(1 << 8);
+        return;
+    }
+    size_t size = st.st_size;
+    char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, inputFD, 0);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            close(inputFD);
+            setStatus(1 << 8);
+            return;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(inputFD);  // The mapping stays valid after the descriptor is closed
+
+    // Cut the file into chunks, moving each cut forward to just past the next newline
+    // WHY: A line-oriented filter must see whole lines, so no line may straddle two chunks.
+    // WHAT: bounds[i]..bounds[i+1] is chunk i; chunks that collapse to nothing are dropped.
+    size_t *bounds = malloc((ways + 1) * sizeof(size_t));
+    int chunks = 0;
+    bounds[0] = 0;
+    for (long i = 1; i <= ways; i++) {
+        size_t cut = (i == ways) ? size : size / ways * i;
+        if (cut < bounds[chunks]) cut = bounds[chunks];
+        if (cut < size) {
+            char *nl = memchr(data + cut, '\n', size - cut);
+            cut = nl ? (size_t)(nl - data) + 1 : size;
+        }
+        if (cut > bounds[chunks] || (i == ways && chunks == 0)) bounds[++chunks] = cut;
+    }
+
+    // The first chunk writes straight into the output; later ones are held in memfds until their turn
+    int outputFD = STDOUT_FILENO;
+    if (output != NULL) {
+        outputFD = open(output->path, output->flags | O_CLOEXEC, 0644);
+        if (outputFD == -1) {
+            perror("cannot open output file");
+            if (data) munmap(data, size);
+            free(bounds);
+            setStatus(1 << 8);
+            return;
+        }
+    }
+
+    resolveRedirections(redirs);
+    pid_t *pids = calloc(chunks, sizeof(pid_t));
+    int *feeds = malloc(chunks * sizeof(int));    // Write end of each chunk's stdin pipe
+    int *held = malloc(chunks * sizeof(int));     // memfd holding each chunk's output
+    size_t *fed = malloc(chunks * sizeof(size_t));  // Bytes of each chunk delivered so far
+    int failed = 0;
+    for (int i = 0; i < chunks; i++) {
+        feeds[i] = held[i] = -1;
+        fed[i] = bounds[i];
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < chunks; i++) {
+        int pipeFDs[2];
+        if (pipe2(pipeFDs, O_CLOEXEC) == -1) {
+            perror("pipe");
+            failed = 1;
+            break;
+        }
+        if (i > 0 && (held[i] = memfd_create("smallsh-split", MFD_CLOEXEC)) == -1) {
+            perror("memfd_create");
+            close(pipeFDs[0]);
+            close(pipeFDs[1]);
+            failed = 1;
+            break;
+        }
+
+        pids[i] = fork();
+        if (pids[i] == -1) {
+            perror("fork");
+            close(pipeFDs[0]);
+            close(pipeFDs[1]);
+            if (held[i] != -1) close(held[i]);
+            failed = 1;
+            break;
+        } else if (pids[i] == 0) {
+            // Child: a foreground process, so SIGINT keeps its default action
+            struct sigaction SIGINT_action = {{0}};
+            SIGINT_action.sa_handler = SIG_DFL;
+            sigaction(SIGINT, &SIGINT_action, NULL);
+            sigaction(SIGPIPE, &inheritedPipeAction, NULL);  // A pipeline running this may be ignoring it
+
+            if (dup2(pipeFDs[0], 0) == -1 || dup2(i == 0 ? outputFD : held[i], 1) == -1) {
+                perror("dup2");
+                exit(1);
+            }
+            applyRedirections(redirs, 1);  // e.g. "2> errors.log"; stdin and stdout are wired above
+            execCommand(cmd);
+        }
+        close(pipeFDs[0]);
+        feeds[i] = pipeFDs[1];
+        fcntl(feeds[i], F_SETFL, O_NONBLOCK);
+    }
+
+    // Feed every chunk to its child concurrently; a child that quits early only stops its own feed
+    // WHY: Each pipe holds only 64KB, so writing the chunks one after another would serialize the filters.
+    // WHAT: vmsplice hands the mapped pages to the pipe without copying them through a buffer.
+    struct sigaction ignorePipe = {{0}}, oldPipe;
+    ignorePipe.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignorePipe, &oldPipe);
+    struct pollfd *pfds = malloc(chunks * sizeof(struct pollfd));
+    while (1) {
+        int waiting = 0;
+        for (int i = 0; i < chunks; i++) {
+            if (feeds[i] != -1 && fed[i] >= bounds[i + 1]) {
+                close(feeds[i]);  // Signals end-of-input to this copy of the filter
+                feeds[i] = -1;
+            }
+            pfds[i].fd = feeds[i];
+            pfds[i].events = POLLOUT;
+            if (feeds[i] != -1) waiting++;
+        }
+        if (waiting == 0) break;
+
+        // In a pipeline stage, the other stages run (and read what the copies write) while the feeds are full
+        int ready = poll(pfds, chunks, currentCoroutine != NULL ? 0 : -1);
+        if (ready == 0) {
+            for (int i = 0; i < chunks; i++) {
+                if (feeds[i] != -1) {
+                    waitDescriptor(feeds[i], EPOLLOUT);
+                    break;
+                }
+            }
+            continue;
+        }
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < chunks; i++) {
+            if (feeds[i] == -1 || pfds[i].revents == 0) continue;
+            struct iovec iov = { data + fed[i], bounds[i + 1] - fed[i] };
+            ssize_t n = vmsplice(feeds[i], &iov, 1, SPLICE_F_NONBLOCK);
+            if (n == -1 && errno == EINVAL) n = write(feeds[i], iov.iov_base, iov.iov_len);
+            if (n > 0) {
+                fed[i] += n;
+            } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                fed[i] = bounds[i + 1];  // EPIPE: the filter stopped reading
+            }
+        }
+    }
+    sigaction(SIGPIPE, &oldPipe, NULL);
+    free(pfds);
+    for (int i = 0; i < chunks; i++) {
+        if (feeds[i] != -1) close(feeds[i]);
+    }
+
+    // Wait for the copies in order, appending each held output as soon as everything before it is out
+    setStatus(0);
+    for (int i = 0; i < chunks; i++) {
+        if (pids[i] <= 0) break;
+        int childStatus;
+        if (currentCoroutine != NULL) {
+            childStatus = waitForeground(pids[i]);  // Lets the stage reading the output run meanwhile
+        } else if (waitpid(pids[i], &childStatus, 0) == -1) {
+            continue;
+        }
+        if (lastStatus == 0) setStatus(childStatus);  // Report the first copy that failed
+        if (held[i] != -1) {
+            off_t offset = 0;
+            struct stat heldStat;
+            fstat(held[i], &heldStat);
+            while (offset < heldStat.st_size) {
+                ssize_t n = sendfile(outputFD, held[i], &offset, heldStat.st_size - offset);
+                if (n == -1 && errno == EINVAL) {
+                    // Outputs such as O_APPEND files refuse sendfile; copy through a buffer instead
+                    char buf[65536];
+                    n = pread(held[i], buf, sizeof(buf), offset);
+                    if (n > 0 && (n = write(outputFD, buf, n)) > 0) offset += n;
+                }
+                if (n <= 0) {
+                    perror("split: output");
+                    break;
+                }
+            }
+            close(held[i]);
+        }
+    }
+    if (failed && lastStatus == 0) setStatus(1 << 8);
+    if (WIFSIGNALED(lastStatus)) {
+        printf("terminated by signal %d\n", WTERMSIG(lastStatus));
+        fflush(stdout);
+    }
+
+    if (outputFD != STDOUT_FILENO) close(outputFD);
+    if (data) munmap(data, size);
+    free(bounds);
+    free(pids);
+    free(feeds);
+    free(held);
+    free(fed);
+}
+
+void handle_SIGTSTP(int signo) {
+    // Check if foreground-only mode is currently disabled
+    if (fgOnlyMode == 0) {
+        fgOnlyMode = 1;  // Enable foreground-only mode
+        char *message = "\nEntering foreground-only mode (& is now ignored)\n";
+        // Write the message to the standard output (terminal)
+        if (write(STDOUT_FILENO, message, strlen(message)) == -1) {
+            perror("write");  // Print an error if the write operation fails
+        }
+        // WHY: Enables foreground-only mode, which forces all commands to run in the foreground.
+        // WHAT: Notifies the user that foreground-only mode has been activated.
+    } else {
+        fgOnlyMode = 0;  // Disable foreground-only mode
+        char *message = "\nExiting foreground-only mode\n";
+        // Write the message to the standard output (terminal)
+        if (write(STDOUT_FILENO, message, strlen(message)) == -1) {
+            perror("write");  // Print an error if the write operation fails
+        }
+        // WHY: Disables foreground-only mode, allowing background execution with '&'.
+        // WHAT: Notifies the user that foreground-only mode has been deactivated.
+    }
+}
+
+void handle_SIGWINCH(int signo) {
+    terminalResized = 1;
+}
+
+void handle_SIGINT(int signo) {
+    // Only installed while a foreground `timeout` job runs; it sits in its own process group,
+    // so the terminal's Ctrl+C reaches the shell instead and is passed on here
+    if (timedGroup > 0) kill(-timedGroup, SIGINT);
+
+    // Also installed while an in-process builtin runs: the interrupted system call returns EINTR
+    builtinInterrupted = 1;
+}
+
+void checkBackgroundProcesses() {
+    // Loop to reap all finished background processes
+    reapJobs();
+    // WHAT: Catches jobs whose pidfd the event loop has not handled yet (or that have none).
+
+    // Report and forget every job that has finished, whether reaped above or by the event loop
+    int kept = 0;
+    for (int i = 0; i < jobCount; i++) {
+        struct job *job = jobs[i];
+        if (!job->done) {
+            jobs[kept++] = job;
+            continue;
+        }
+
+        // Only print status if a background process has finished
+        if (!fgOnlyMode) {  // Print background completion status only if not in fgOnlyMode
+            printf("background pid %d is done: ", job->pid);
+            // WHY: In foreground-only mode, background processes aren't relevant, so we skip reporting them.
+
+            // Check if the process terminated normally
+            if (WIFEXITED(job->status)) {
+                printf("exit value %d", WEXITSTATUS(job->status));
+                // WHY: If the process exited normally, we report its exit value.
+                // WHAT: `WEXITSTATUS(status)` extracts the exit code from the wait status.
+            } else if (WIFSIGNALED(job->status)) {
+                printf("terminated by signal %d", WTERMSIG(job->status));
+                // WHY: If the process was terminated by a signal, we report the signal number.
+                // WHAT: `WTERMSIG(status)` extracts the signal that caused the termination.
+            }
+            printf("%s\n", job->timedOut ? " (timed out)" : "");
+            fflush(stdout);  // Ensure all output is immediately displayed
+            // WHY: We flush the output to prevent delays in displaying the status.
+        }
+        free(job);
+    }
+    jobCount = kept;
+}
+
+void reapJobs() {
+    int childStatus;
+    siginfo_t info;
+
+    // WHY: waitpid(-1) would also reap children that are not jobs, whose owners would then wait in vain
+    // (or, once the pid is reused, for someone else). WNOWAIT looks at an exited child without reaping it.
+    // WHAT: Reap the exited children one by one while they are jobs; the first one that is not makes
+    // the rest of the jobs be asked for by pid.
+    while (1) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0) return;
+
+        struct job *job = NULL;
+        for (int i = 0; i < jobCount && job == NULL; i++) {
+            if (jobs[i]->pid == info.si_pid && !jobs[i]->done) job = jobs[i];
+        }
+        if (job == NULL) break;
+        if (waitpid(job->pid, &childStatus, WNOHANG) == job->pid) jobReaped(job, childStatus);
+    }
+
+    for (int i = 0; i < jobCount; i++) {
+        if (!jobs[i]->done && waitpid(jobs[i]->pid, &childStatus, WNOHANG) == jobs[i]->pid) {
+            jobReaped(jobs[i], childStatus);
+        }
+    }
+}
+
+void killBackgroundProcesses() {
+    // Nothing may start new jobs while the old ones are being shut down
+    while (watchers != NULL) removeWatcher(watchers);
+    while (schedules != NULL) removeSchedule(schedules);
+
+    // Ask every job's process group to terminate, all at once
+    int missingPidfd = 0;
+    for (int i = 0; i < jobCount; i++) {
+        if (jobs[i]->done) continue;
+        kill(-jobs[i]->pid, SIGTERM);
+        kill(-jobs[i]->pid, SIGCONT);  // A stopped group would sit on SIGTERM until SIGKILL at the deadline
+        if (jobs[i]->pidfd == -1) missingPidfd = 1;
+        // WHY: Signalling the group also reaches whatever the job itself started.
+    }
+
+    // Wait for the exits in parallel until the deadline
+    // WHY: Waiting for the jobs one after another would make shutdown O(n) in the slowest exits.
+    // WHAT: Each pidfd is already in the event loop, so one epoll_wait covers every job at once.
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += SHUTDOWN_GRACE_MS / 1000;
+    deadline.tv_nsec += (SHUTDOWN_GRACE_MS % 1000) * 1000000L;
+    while (1) {
+        int remaining = 0;
+        for (int i = 0; i < jobCount; i++) remaining += !jobs[i]->done;
+        if (remaining == 0) break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long left = (deadline.tv_sec - now.tv_sec) * 1000LL + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (left <= 0) break;
+
+        if (missingPidfd) {
+            // Jobs without a pidfd never wake the loop, so sweep for them every few milliseconds
+            reapJobs();
+            if (left > 10) left = 10;
+        }
+        runEvents(left);
+    }
+
+    // Whatever is left ignored SIGTERM: kill it outright and say so
+    for (int i = 0; i < jobCount; i++) {
+        if (jobs[i]->done) continue;
+        kill(-jobs[i]->pid, SIGKILL);
+        printf("background pid %d killed after ignoring SIGTERM\n", jobs[i]->pid);
+    }
+    for (int i = 0; i < jobCount; i++) {
+        if (!jobs[i]->done) waitpid(jobs[i]->pid, NULL, 0);  // SIGKILL cannot be ignored, so these return promptly
+        free(jobs[i]);
+    }
+    jobCount = 0;
+    fflush(stdout);
+}
+void initEventLoop() {
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFD == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    stdinSource.fd = STDIN_FILENO;
+    stdinSource.handler = handleStdinReady;
+
+    // stdin is armed one-shot and re-armed by readLine() only while it actually waits for input
+    // WHY: Level-triggered stdin would keep firing while typed-ahead input sits unread during other waits.
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = &stdinSource };
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1) {
+        stdinAlwaysReady = 1;  // Regular files cannot be polled, but reading them never blocks either
+    }
+}
+
+int addEventSource(struct eventSource *source) {
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = source };
+    return epoll_ctl(epollFD, EPOLL_CTL_ADD, source->fd, &event);
+}
+
+void removeEventSource(struct eventSource *source) {
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+void runEvents(int timeoutMs) {
+    struct epoll_event ready[64];
+
+    // Inside a pipeline stage, the scheduler runs the loop once the other stages have had their turn
+    if (currentCoroutine != NULL) {
+        currentCoroutine->polling = 1;
+        currentCoroutine->timeoutMs = timeoutMs;
+        yieldCoroutine();
+        return;
+    }
+
+    int count = epoll_wait(epollFD, ready, 64, timeoutMs);
+    // WHY: EINTR (e.g. after SIGTSTP) just ends this round; callers loop until what they wait for happens.
+    for (int i = 0; i < count; i++) {
+        struct eventSource *source = ready[i].data.ptr;
+        source->handler(source);
+    }
+}
+
+void handleStdinReady(struct eventSource *source) {
+    stdinReady = 1;
+}
+
+char *readLine(char *line, int size) {
+    // Bytes read from stdin but not yet returned; sized so a full line plus read-ahead always fits
+    static char buffer[MAX_CMD_LEN * 2];
+    static int start = 0, end = 0;
+
+    // At a terminal, lines come from the line editor
+    if (editor.enabled) {
+        if (editor.delivered == editor.length && editLine() == -1) {
+            inputEOF = 1;
+            return NULL;
+        }
+        size_t length = editor.length - editor.delivered;
+        if (length > (size_t)size - 1) length = size - 1;
+        memcpy(line, editor.text + editor.delivered, length);
+        line[length] = '\0';
+        editor.delivered += length;
+        return line;
+    }
+
+    while (1) {
+        int available = end - start;
+        char *newline = memchr(buffer + start, '\n', available);
+
+        // Hand out a complete line, a piece of an overlong one, or the unterminated tail at EOF
+        if (newline != NULL || available >= size - 1 || (inputEOF && available > 0)) {
+            int length = newline ? (int)(newline - (buffer + start)) + 1 : available;
+            if (length > size - 1) length = size - 1;
+            memcpy(line, buffer + start, length);
+            line[length] = '\0';
+            start += length;
+            return line;
+        }
+        if (inputEOF) return NULL;
+
+        // Make room at the end of the buffer, then wait for stdin while serving other events
+        memmove(buffer, buffer + start, available);
+        start = 0;
+        end = available;
+        if (stdinAlwaysReady) {
+            runEvents(0);
+        } else if (!stdinReady) {
+            struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = &stdinSource };
+            epoll_ctl(epollFD, EPOLL_CTL_MOD, STDIN_FILENO, &event);
+        }
+        while (!stdinAlwaysReady && !stdinReady) runEvents(-1);
+        stdinReady = 0;
+
+        ssize_t n = read(STDIN_FILENO, buffer + end, sizeof(buffer) - end);
+        if (n > 0) {
+            end += n;
+        } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+            inputEOF = 1;
+        }
+    }
+}
+
+void showPrompt(const char *prompt) {
+    promptText = prompt;
+    printf("%s", prompt);
+    fflush(stdout);
+}
+
+const char *renderPrompt() {
+    const char *template = getVariable("PROMPT");
+    if (template == NULL) return ": ";
+
+    char *out = promptBuffer, *end = promptBuffer + sizeof(promptBuffer) - 1;
+    for (const char *p = template; *p != '\0' && out < end;) {
+        const char *close = (*p == '{') ? strchr(p, '}') : NULL;
+        size_t length = close ? (size_t)(close - p) + 1 : 0;
+        char segment[PATH_MAX];
+        segment[0] = '\0';
+
+        if (length == 5 && memcmp(p, "{cwd}", 5) == 0) {
+            // The home directory shows as ~
+            const char *home = getVariable("HOME");
+            size_t homeLength = home ? strlen(home) : 0;
+            if (getcwd(segment, sizeof(segment)) == NULL) strcpy(segment, "?");
+            if (homeLength > 1 && strncmp(segment, home, homeLength) == 0 && (segment[homeLength] == '/' || segment[homeLength] == '\0')) {
+                segment[0] = '~';
+                memmove(segment + 1, segment + homeLength, strlen(segment + homeLength) + 1);
+            }
+        } else if (length == 6 && memcmp(p, "{jobs}", 6) == 0) {
+            snprintf(segment, sizeof(segment), "%d", jobCount);
+        } else if (length == 8 && memcmp(p, "{status}", 8) == 0) {
+            snprintf(segment, sizeof(segment), "%d", WIFEXITED(lastStatus) ? WEXITSTATUS(lastStatus) : 128 + WTERMSIG(lastStatus));
+        } else if (length == 10 && memcmp(p, "{duration}", 10) == 0) {
+            long long ms = lastDuration / 1000000;
+            if (lastDuration < 0) {
+                segment[0] = '\0';
+            } else if (ms < 1000) {
+                snprintf(segment, sizeof(segment), "%lldms", ms);
+            } else if (ms < 60000) {
+                snprintf(segment, sizeof(segment), "%lld.%llds", ms / 1000, ms % 1000 / 100);
+            } else {
+                snprintf(segment, sizeof(segment), "%lldm%02llds", ms / 60000, ms % 60000 / 1000);
+            }
+        } else if (length == 5 && memcmp(p, "{git}", 5) == 0) {
+            char directory[PATH_MAX];
+            if (getcwd(directory, sizeof(directory)) != NULL) snprintf(segment, sizeof(segment), "%s", slowSegments(directory));
+        } else {
+            *out++ = *p++;  // Text, and braces that are not a segment, stand for themselves
+            continue;
+        }
+        size_t segmentLength = strlen(segment);
+        if (segmentLength > (size_t)(end - out)) segmentLength = end - out;
+        memcpy(out, segment, segmentLength);
+        out += segmentLength;
+        p += length;
+    }
+    *out = '\0';
+    return promptBuffer;
+}
+
+const char *slowSegments(const char *directory) {
+    // WHY: `git status` in a large repository takes far longer than anyone should wait for a prompt.
+    // WHAT: Show what was last computed for the directory, and have the prompt thread recompute it.
+    if (!promptWorker.started && startPromptWorker() == -1) return "";
+    struct promptCacheEntry *entry = NULL, *victim = NULL;
+    promptWorker.tick++;
+    for (int i = 0; i < PROMPT_CACHE_SIZE && entry == NULL; i++) {
+        struct promptCacheEntry *candidate = &promptWorker.cache[i];
+        if ((candidate->valid || candidate->pending) && strcmp(candidate->directory, directory) == 0) entry = candidate;
+        if (!candidate->pending && (victim == NULL || candidate->lastUse < victim->lastUse)) victim = candidate;
+    }
+    if (entry == NULL) {
+        if (victim == NULL) return "";  // Every entry is waiting on the thread
+        entry = victim;
+        snprintf(entry->directory, sizeof(entry->directory), "%s", directory);
+        entry->git[0] = '\0';
+        entry->valid = 0;
+    }
+    entry->lastUse = promptWorker.tick;
+
+    if (!entry->pending) {
+        struct promptJob job;
+        snprintf(job.directory, sizeof(job.directory), "%s", directory);
+        job.environment = copyEnvironment();
+        uint64_t post = 1;
+        if (!pushPromptJob(&promptWorker.requests, &job)) {
+            free(job.environment);
+        } else if (write(promptWorker.wake, &post, sizeof(post)) == sizeof(post)) {
+            entry->pending = 1;
+        }
+    }
+    return entry->git;
+}
+
+int startPromptWorker() {
+    promptWorker.wake = eventfd(0, EFD_CLOEXEC);
+    promptWorker.ready.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    promptWorker.ready.handler = handlePromptReady;
+    if (promptWorker.wake == -1 || promptWorker.ready.fd == -1) {
+        perror("prompt");
+        return -1;
+    }
+    addEventSource(&promptWorker.ready);
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    promptWorker.started = (pthread_create(&promptWorker.thread, NULL, promptThread, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!promptWorker.started) {
+        perror("prompt");
+        removeEventSource(&promptWorker.ready);
+        close(promptWorker.ready.fd);
+        close(promptWorker.wake);
+        promptWorker.ready.fd = promptWorker.wake = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void *promptThread(void *arg) {
+    struct promptJob job;
+    uint64_t posts;
+
+    while (read(promptWorker.wake, &posts, sizeof(posts)) == sizeof(posts)) {
+        while (popPromptJob(&promptWorker.requests, &job)) {
+            gitSegment(job.directory, job.environment, job.git, sizeof(job.git));
+            free(job.environment);
+            job.environment = NULL;
+
+            // The shell takes results whenever it gets to the event loop; until then, wait for room
+            while (!pushPromptJob(&promptWorker.results, &job)) usleep(1000);
+            uint64_t post = 1;
+            if (write(promptWorker.ready.fd, &post, sizeof(post)) == -1) perror("prompt");
+        }
+    }
+    return NULL;
+}
+
+void gitSegment(const char *directory, char **environment, char *out, size_t size) {
+    char root[PATH_MAX], path[PATH_MAX + 16], head[256];
+    struct stat info;
+    out[0] = '\0';
+
+    // The repository is the nearest directory, upwards, that has a .git
+    snprintf(root, sizeof(root), "%s", directory);
+    while (1) {
+        snprintf(path, sizeof(path), "%s/.git", strcmp(root, "/") == 0 ? "" : root);
+        if (stat(path, &info) == 0) break;
+        char *slash = strrchr(root, '/');
+        if (slash == NULL || strcmp(root, "/") == 0) return;
+        if (slash == root) slash++;  // "/a" goes up to "/"
+        *slash = '\0';
+    }
+
+    // A worktree or submodule has a .git file that names the real git directory
+    if (S_ISREG(info.st_mode)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        ssize_t n = (fd != -1) ? read(fd, head, sizeof(head) - 1) : -1;
+        if (fd != -1) close(fd);
+        if (n <= 8 || strncmp(head, "gitdir: ", 8) != 0) return;
+        head[n] = '\0';
+        head[strcspn(head, "\n")] = '\0';
+        int length = (head[8] == '/') ? snprintf(path, sizeof(path), "%s", head + 8)
+                                      : snprintf(path, sizeof(path), "%s/%s", root, head + 8);
+        if (length >= (int)sizeof(path) - 5) return;  // No room left for "/HEAD"
+    }
+
+    // HEAD holds "ref: refs/heads/<branch>", or a commit id when it is detached
+    size_t pathLength = strlen(path);
+    snprintf(path + pathLength, sizeof(path) - pathLength, "/HEAD");
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = (fd != -1) ? read(fd, head, sizeof(head) - 1) : -1;
+    if (fd != -1) close(fd);
+    if (n <= 0) return;
+    head[n] = '\0';
+    head[strcspn(head, "\n")] = '\0';
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        snprintf(out, size, "%s", head + 16);
+    } else {
+        snprintf(out, size, "%.7s", head);
+    }
+
+    // Uncommitted changes need git itself; any output from it means there are some
+    int pipeFDs[2];
+    if (pipe2(pipeFDs, O_CLOEXEC) == -1) return;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipeFDs[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &none);  // This thread blocks every signal; git should not
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    char *argv[] = { "git", "-C", (char *)directory, "--no-optional-locks", "status", "--porcelain",
+                     "--untracked-files=no", NULL };
+    pid_t pid;
+    int spawned = 0;
+
+    // posix_spawnp() would search the PATH this process started with, so search the shell's own
+    const char *search = "/usr/local/bin:/usr/bin:/bin";
+    for (int i = 0; environment[i] != NULL; i++) {
+        if (strncmp(environment[i], "PATH=", 5) == 0) search = environment[i] + 5;
+    }
+    while (!spawned && *search != '\0') {
+        size_t length = strcspn(search, ":");
+        snprintf(path, sizeof(path), "%.*s/git", length > 0 ? (int)length : 1, length > 0 ? search : ".");
+        spawned = (access(path, X_OK) == 0 && posix_spawn(&pid, path, &actions, &attributes, argv, environment) == 0);
+        search += length + (search[length] == ':');
+    }
+    close(pipeFDs[1]);
+    char byte;
+    if (spawned && read(pipeFDs[0], &byte, 1) == 1 && strlen(out) + 1 < size) strcat(out, "*");
+    close(pipeFDs[0]);
+
+    // WHY: The shell reaps only its jobs (reapJobs()), so git stays this thread's child until waited for.
+    // WHAT: Wait through a pidfd, which names this process whatever happens to its pid.
+    int pidfd = spawned ? syscall(SYS_pidfd_open, pid, 0) : -1;
+    siginfo_t exited;
+    if (pidfd != -1) {
+        while (waitid(P_PIDFD, pidfd, &exited, WEXITED) == -1 && errno == EINTR) {}
+        close(pidfd);
+    } else if (spawned) {
+        waitpid(pid, NULL, 0);  // No pidfd support
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+}
+
+void handlePromptReady(struct eventSource *source) {
+    uint64_t posts;
+    struct promptJob job;
+
+    if (read(source->fd, &posts, sizeof(posts)) != sizeof(posts)) return;
+    while (popPromptJob(&promptWorker.results, &job)) {
+        for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+            struct promptCacheEntry *entry = &promptWorker.cache[i];
+            if (!entry->pending || strcmp(entry->directory, job.directory) != 0) continue;
+            memcpy(entry->git, job.git, sizeof(entry->git));
+            entry->valid = 1;
+            entry->pending = 0;
+        }
+    }
+
+    // The main prompt, while a line is being typed after it, is redrawn in place if it came out different
+    if (!editor.editing || promptText != promptBuffer) return;
+    char shown[MAX_PROMPT_LEN];
+    memcpy(shown, promptBuffer, sizeof(shown));
+    renderPrompt();
+    if (strcmp(shown, promptBuffer) == 0) return;
+    editor.promptWidth = displayWidth(promptBuffer, strlen(promptBuffer));
+    editorRedraw(0);
+    editorFlush();
+}
+
+int pushPromptJob(struct promptQueue *queue, const struct promptJob *job) {
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == PROMPT_QUEUE_SIZE) return 0;
+    queue->slots[head % PROMPT_QUEUE_SIZE] = *job;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int popPromptJob(struct promptQueue *queue, struct promptJob *job) {
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) return 0;
+    *job = queue->slots[tail % PROMPT_QUEUE_SIZE];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void initLineEditor() {
+    const char *term = getVariable("TERM");
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || (term != NULL && strcmp(term, "dumb") == 0) ||
+        tcgetattr(STDIN_FILENO, &editor.saved) == -1) {
+        return;
+    }
+    editor.enabled = 1;
+    editor.capacity = MAX_CMD_LEN;
+    editor.text = malloc(editor.capacity);
+    editor.inputCapacity = EDITOR_INPUT_SIZE;
+    editor.input = malloc(editor.inputCapacity);
+    if (editor.text == NULL || editor.input == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    openHistory();
+    startCompletionBuild();
+
+    // Without SA_RESTART, a resize interrupts the wait for input so the line is redrawn at once
+    struct sigaction SIGWINCH_action = {{0}};
+    SIGWINCH_action.sa_handler = handle_SIGWINCH;
+    sigaction(SIGWINCH, &SIGWINCH_action, NULL);
+}
+
+int editLine() {
+    int result = 0;
+    int previousKey = -1;
+
+    // Raw mode: every key arrives as typed, and Ctrl+C, Ctrl+Z and Ctrl+D are keys like any other
+    struct termios raw = editor.saved;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    editorAppend("\033[?2004h", 8);  // Bracketed paste: pasted text comes between ESC [200~ and ESC [201~
+
+    editor.length = editor.position = editor.delivered = 0;
+    editor.columns = terminalColumns();
+    editor.promptWidth = displayWidth(promptText, strlen(promptText));
+    editor.cursor = editor.promptWidth;
+    editor.historyOffset = SIZE_MAX;
+    editor.searching = 0;
+    editor.editing = 1;
+    syncHistory(0);
+    while (1) {
+        editorFlush();
+        if (terminalResized) {
+            // Terminals rewrap the line on a resize, so its cells keep their numbers under the new width
+            terminalResized = 0;
+            editor.columns = terminalColumns();
+            editorRedraw(0);
+            continue;
+        }
+        if (editor.inputStart == editor.inputEnd) {
+            int n = editorRead(-1);
+            if (n == -1) {
+                result = -1;
+                break;
+            }
+            continue;
+        }
+        char *p = editor.input + editor.inputStart;
+        size_t available = editor.inputEnd - editor.inputStart;
+
+        // WHY: A 100KB paste inserted a key at a time would redraw the rest of the line 100K times.
+        // WHAT: Take pasted text as a whole, up to a newline (which enters the line) or the end of the paste.
+        if (editor.pasting) {
+            char *end = memmem(p, available, "\033[201~", 6);
+            size_t span = end ? (size_t)(end - p) : available;
+            char *newline = NULL;
+            for (size_t i = 0; i < span && newline == NULL; i++) {
+                if (p[i] == '\r' || p[i] == '\n') newline = p + i;
+            }
+            if (newline != NULL) span = newline - p;
+            if (newline == NULL && end == NULL) {
+                // Hold back what may be the start of the end marker
+                for (size_t keep = 5; keep > 0; keep--) {
+                    if (span >= keep && memcmp(p + span - keep, "\033[201~", keep) == 0) {
+                        span -= keep;
+                        break;
+                    }
+                }
+                if (span == 0) {
+                    if (editorRead(-1) == -1) editor.pasting = 0;
+                    continue;
+                }
+            }
+            editorReplace(editor.position, editor.position, p, span);
+            editor.inputStart += span;
+            if (newline != NULL) {
+                editor.inputStart++;
+                break;
+            }
+            if (end != NULL) {
+                editor.inputStart += 6;
+                editor.pasting = 0;
+            }
+            continue;
+        }
+
+        // Printable text (typed ahead, or pasted by a terminal without bracketed paste) is inserted in one go
+        unsigned char c = *p;
+        if (c >= 0x20 && c != 0x7f) {
+            size_t run = 1;
+            while (run < available && (unsigned char)p[run] >= 0x20 && p[run] != 0x7f) run++;
+            editor.inputStart += run;
+            previousKey = -1;
+            if (!editor.searching) {
+                editorReplace(editor.position, editor.position, p, run);
+                continue;
+            }
+
+            // While searching, text extends the query; the entry shown may still match
+            if (run > MAX_QUERY_LEN - editor.queryLength) run = MAX_QUERY_LEN - editor.queryLength;
+            memcpy(editor.query + editor.queryLength, p, run);
+            editor.queryLength += run;
+            size_t before = SIZE_MAX;
+            if (editor.match != SIZE_MAX) {
+                before = (char *)memchr(history.map + editor.match, '\n', history.mapSize - editor.match) - history.map + 1;
+            }
+            editorSearch(before);
+            continue;
+        }
+
+        int key = c;
+        size_t used = 1;
+        if (c == 0x1b) {
+            used = parseEscape(p, available, &key);
+            if (used == 0) {
+                // The rest of the sequence may still be on its way; a lone Escape does nothing
+                if (editorRead(ESCAPE_TIMEOUT_MS) > 0) continue;
+                used = 1;
+                key = KEY_NONE;
+            }
+        }
+        editor.inputStart += used;
+        int repeated = (key == previousKey);
+        previousKey = key;
+
+        // Ctrl+R searches older entries; Backspace shortens the query; Ctrl+G and Escape give up
+        // the search. Any other key ends it, keeping the entry found, and then acts as usual.
+        if (key == 0x12 && !editor.searching) {
+            mapHistory();
+            finishIndexing();
+            indexHistory(history.map, history.mapSize);
+            if (editor.historyOffset == SIZE_MAX) {
+                free(editor.draft);
+                editor.draft = strndup(editor.text, editor.length);
+            }
+            editor.searching = 1;
+            editor.queryLength = 0;
+            editor.match = SIZE_MAX;
+            editor.savedPrompt = promptText;
+            editorSearch(SIZE_MAX);
+            continue;
+        } else if (editor.searching) {
+            if (key == 0x12) {
+                editorSearch(editor.match);
+                continue;
+            } else if (key == 0x7f || key == 0x08) {
+                while (editor.queryLength > 0 && ((unsigned char)editor.query[--editor.queryLength] & 0xc0) == 0x80) {}
+                editorSearch(SIZE_MAX);
+                continue;
+            }
+            editor.searching = 0;
+            promptText = editor.savedPrompt;
+            editor.promptWidth = displayWidth(promptText, strlen(promptText));
+            if (key == 0x07 || key == KEY_NONE) {
+                editorSetLine(editor.draft, strlen(editor.draft));
+                editorRedraw(0);
+                continue;
+            }
+            if (editor.match != SIZE_MAX) editor.historyOffset = editor.match;  // Up and Down go on from there
+            editorRedraw(0);
+        }
+
+        size_t to = editor.position, from = editor.position;
+        switch (key) {
+        case '\r':
+        case '\n':
+            break;
+        case 0x7f:  // Backspace
+        case 0x08:
+            while (from > 0 && ((unsigned char)editor.text[--from] & 0xc0) == 0x80) {}
+            editorReplace(from, to, "", 0);
+            continue;
+        case 0x04:  // Ctrl+D: end of input on an empty line, otherwise Delete
+            if (editor.length == 0) {
+                result = -1;
+                break;
+            }
+            // Fall through
+        case KEY_DELETE:
+            if (to < editor.length) to++;
+            while (to < editor.length && ((unsigned char)editor.text[to] & 0xc0) == 0x80) to++;
+            editorReplace(from, to, "", 0);
+            continue;
+        case 0x02:  // Ctrl+B
+        case KEY_LEFT:
+            while (from > 0 && ((unsigned char)editor.text[--from] & 0xc0) == 0x80) {}
+            editorMove(from);
+            continue;
+        case 0x06:  // Ctrl+F
+        case KEY_RIGHT:
+            if (to < editor.length) to++;
+            while (to < editor.length && ((unsigned char)editor.text[to] & 0xc0) == 0x80) to++;
+            editorMove(to);
+            continue;
+        case 0x01:  // Ctrl+A
+        case KEY_HOME:
+            editorMove(0);
+            continue;
+        case 0x05:  // Ctrl+E
+        case KEY_END:
+            editorMove(editor.length);
+            continue;
+        case KEY_WORD_LEFT:
+        case KEY_DELETE_WORD:
+        case 0x17:  // Ctrl+W
+            while (from > 0 && editor.text[from - 1] == ' ') from--;
+            while (from > 0 && editor.text[from - 1] != ' ') from--;
+            if (key == KEY_WORD_LEFT) {
+                editorMove(from);
+            } else {
+                editorReplace(from, to, "", 0);
+            }
+            continue;
+        case KEY_WORD_RIGHT:
+            while (to < editor.length && editor.text[to] == ' ') to++;
+            while (to < editor.length && editor.text[to] != ' ') to++;
+            editorMove(to);
+            continue;
+        case 0x0b:  // Ctrl+K
+            editorReplace(from, editor.length, "", 0);
+            continue;
+        case 0x15:  // Ctrl+U
+            editorReplace(0, to, "", 0);
+            continue;
+        case 0x0c:  // Ctrl+L
+            editorRedraw(1);
+            continue;
+        case 0x10:  // Ctrl+P
+        case KEY_UP:
+            editorHistory(-1);
+            continue;
+        case 0x0e:  // Ctrl+N
+        case KEY_DOWN:
+            editorHistory(1);
+            continue;
+        case 0x03:  // Ctrl+C: drop the line
+            editorMove(editor.length);
+            editorAppend("^C", 2);
+            editor.cursor += 2;
+            editor.length = editor.position = 0;
+            lineCancelled = 1;
+            break;
+        case 0x1a:  // Ctrl+Z: toggle foreground-only mode, as SIGTSTP does outside the editor
+            editorMove(editor.length);
+            editorFlush();
+            raise(SIGTSTP);
+            editor.cursor = 0;  // The message ends with a newline, so the prompt starts a fresh row
+            editorRedraw(0);
+            continue;
+        case '\t':
+            editorComplete(repeated);
+            continue;
+        case KEY_PASTE:
+            editor.pasting = 1;
+            continue;
+        default:
+            continue;  // Keys without a binding
+        }
+        break;
+    }
+
+    // Leave the cursor on a fresh row below the line, and the terminal as commands expect it
+    if (result == 0) editorMove(editor.length);
+    if (editor.cursor % editor.columns != 0 || result == -1) editorAppend("\r\n", 2);
+    editorAppend("\033[?2004l", 8);
+    editorFlush();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.saved);
+    editor.editing = 0;
+    if (result == -1) {
+        editor.length = 0;
+        return -1;
+    }
+
+    addHistory(editor.text, editor.length);
+    free(editor.draft);
+    editor.draft = NULL;
+
+    if (editor.length + 1 > editor.capacity) {
+        editor.capacity = editor.length + 1;
+        editor.text = realloc(editor.text, editor.capacity);
+    }
+    editor.text[editor.length++] = '\n';
+    return 0;
+}
+
+int editorRead(int timeoutMs) {
+    // Keep unread input at the front, with room behind it for a whole paste in one read()
+    if (editor.inputStart > 0) {
+        memmove(editor.input, editor.input + editor.inputStart, editor.inputEnd - editor.inputStart);
+        editor.inputEnd -= editor.inputStart;
+        editor.inputStart = 0;
+    }
+    if (editor.inputEnd == editor.inputCapacity) {
+        editor.inputCapacity *= 2;
+        editor.input = realloc(editor.input, editor.inputCapacity);
+        if (editor.input == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    // Wait for a key while serving the event loop, or just for the rest of an escape sequence
+    if (timeoutMs < 0) {
+        if (!stdinReady) {
+            struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = &stdinSource };
+            epoll_ctl(epollFD, EPOLL_CTL_MOD, STDIN_FILENO, &event);
+        }
+        while (!stdinReady && !terminalResized) runEvents(-1);
+        timeoutMs = 0;
+    }
+    struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+    if (poll(&input, 1, timeoutMs) <= 0) return 0;
+    stdinReady = 0;
+
+    ssize_t n = read(STDIN_FILENO, editor.input + editor.inputEnd, editor.inputCapacity - editor.inputEnd);
+    if (n > 0) {
+        editor.inputEnd += n;
+        return n;
+    }
+    return (n == -1 && (errno == EINTR || errno == EAGAIN)) ? 0 : -1;
+}
+
+size_t parseEscape(const char *p, size_t available, int *key) {
+    if (available < 2) return 0;
+    *key = KEY_NONE;
+
+    // Alt+b, Alt+f and Alt+Backspace
+    if (p[1] != '[' && p[1] != 'O') {
+        if (p[1] == 'b') *key = KEY_WORD_LEFT;
+        if (p[1] == 'f') *key = KEY_WORD_RIGHT;
+        if (p[1] == 0x7f) *key = KEY_DELETE_WORD;
+        return 2;
+    }
+
+    // ESC [ or ESC O, parameters, then a final byte
+    size_t end = 2;
+    while (end < available && (p[end] < 0x40 || p[end] > 0x7e)) end++;
+    if (end == available) return (available > 32) ? available : 0;
+    int parameter = atoi(p + 2);
+    int modified = (memchr(p + 2, ';', end - 2) != NULL);  // e.g. Ctrl+Right is ESC [1;5C
+    switch (p[end]) {
+    case 'A': *key = KEY_UP; break;
+    case 'B': *key = KEY_DOWN; break;
+    case 'C': *key = modified ? KEY_WORD_RIGHT : KEY_RIGHT; break;
+    case 'D': *key = modified ? KEY_WORD_LEFT : KEY_LEFT; break;
+    case 'H': *key = KEY_HOME; break;
+    case 'F': *key = KEY_END; break;
+    case '~':
+        if (parameter == 1 || parameter == 7) *key = KEY_HOME;
+        if (parameter == 4 || parameter == 8) *key = KEY_END;
+        if (parameter == 3) *key = KEY_DELETE;
+        if (parameter == 200) *key = KEY_PASTE;
+        break;
+    }
+    return end + 1;
+}
+
+void editorReplace(size_t from, size_t to, const char *data, size_t length) {
+    size_t fromCell = editorCell(from);
+    size_t removed = displayWidth(editor.text + from, to - from);
+    size_t inserted = displayWidth(data, length);
+    int atEnd = (to == editor.length);
+    size_t tail = atEnd ? 0 : displayWidth(editor.text + to, editor.length - to);
+    size_t columns = editor.columns;
+
+    size_t needed = editor.length - (to - from) + length;
+    if (needed + 1 > editor.capacity) {
+        while (needed + 1 > editor.capacity) editor.capacity *= 2;
+        editor.text = realloc(editor.text, editor.capacity);
+        if (editor.text == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memmove(editor.text + from + length, editor.text + to, editor.length - to);
+    memcpy(editor.text + from, data, length);
+    editor.length = needed;
+    editor.position = from + length;
+    moveCursor(fromCell);
+
+    // The rest of the line stays on this row: let the terminal shift it
+    if (!atEnd && removed == 0 && fromCell / columns == (fromCell + inserted + tail - 1) / columns) {
+        char sequence[32];
+        editorAppend(sequence, snprintf(sequence, sizeof(sequence), "\033[%zu@", inserted));
+        editorAppendText(data, length);
+        editor.cursor += inserted;
+        return;
+    }
+    if (!atEnd && inserted == 0 && fromCell / columns == (fromCell + removed + tail - 1) / columns) {
+        char sequence[32];
+        editorAppend(sequence, snprintf(sequence, sizeof(sequence), "\033[%zuP", removed));
+        return;
+    }
+
+    // Otherwise write the new text and everything after it, and clear what is left of the old line
+    editorAppendText(data, length);
+    editorAppendText(editor.text + editor.position, editor.length - editor.position);
+    editor.cursor = fromCell + inserted + tail;
+    if (inserted + tail > 0 && editor.cursor % columns == 0) editorAppend("\r\n", 2);  // Past the last column
+    if (removed > inserted) editorAppend("\033[J", 3);
+    moveCursor(fromCell + inserted);
+}
+
+void editorMove(size_t position) {
+    moveCursor(editorCell(position));
+    editor.position = position;
+}
+
+void editorRedraw(int clearScreen) {
+    if (clearScreen) {
+        editorAppend("\033[H\033[2J", 7);
+        editor.cursor = 0;
+    } else {
+        moveCursor(0);
+        editorAppend("\033[J", 3);
+    }
+    editorAppend(promptText, strlen(promptText));
+    editorAppendText(editor.text, editor.length);
+    editor.cursor = editor.promptWidth + displayWidth(editor.text, editor.length);
+    if (editor.cursor % editor.columns == 0) editorAppend("\r\n", 2);
+    moveCursor(editor.promptWidth + displayWidth(editor.text, editor.position));
+}
+
+void editorHistory(int direction) {
+    const char *start, *end;
+
+    // Entries are found by scanning for the newlines around them, so nothing reads the whole file
+    if (editor.historyOffset == SIZE_MAX) mapHistory();
+    if (editor.historyOffset != SIZE_MAX && editor.historyOffset > history.mapSize) editor.historyOffset = SIZE_MAX;
+    if (direction < 0) {
+        size_t offset = (editor.historyOffset == SIZE_MAX) ? history.mapSize : editor.historyOffset;
+        end = (offset > 0) ? memrchr(history.map, '\n', offset) : NULL;  // A line still being written has none
+        if (end == NULL) return;
+        start = memrchr(history.map, '\n', end - history.map);
+        start = (start != NULL) ? start + 1 : history.map;
+    } else {
+        if (editor.historyOffset == SIZE_MAX) return;
+        start = memchr(history.map + editor.historyOffset, '\n', history.mapSize - editor.historyOffset) + 1;
+        end = memchr(start, '\n', history.map + history.mapSize - start);
+    }
+
+    // The line being typed is put aside while older ones are shown
+    if (editor.historyOffset == SIZE_MAX) {
+        free(editor.draft);
+        editor.draft = strndup(editor.text, editor.length);
+    }
+    if (end == NULL) {
+        editor.historyOffset = SIZE_MAX;
+        editorReplace(0, editor.length, editor.draft, strlen(editor.draft));
+        return;
+    }
+    editor.historyOffset = start - history.map;
+    editorReplace(0, editor.length, start, end - start);
+}
+
+void editorSearch(size_t before) {
+    size_t match = (editor.queryLength > 0) ? searchHistory(editor.query, editor.queryLength, before) : SIZE_MAX;
+    if (match != SIZE_MAX) {
+        const char *end = memchr(history.map + match, '\n', history.mapSize - match);
+        editor.match = match;
+        editorSetLine(history.map + match, end - (history.map + match));
+    }
+    snprintf(editor.searchPrompt, sizeof(editor.searchPrompt), "(%sreverse-i-search)`%.*s': ",
+             (editor.queryLength > 0 && match == SIZE_MAX) ? "failed " : "", (int)editor.queryLength, editor.query);
+    promptText = editor.searchPrompt;
+    editor.promptWidth = displayWidth(promptText, strlen(promptText));
+    editorRedraw(0);
+}
+
+void editorSetLine(const char *text, size_t length) {
+    if (length + 1 > editor.capacity) {
+        while (length + 1 > editor.capacity) editor.capacity *= 2;
+        editor.text = realloc(editor.text, editor.capacity);
+        if (editor.text == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memmove(editor.text, text, length);
+    editor.length = editor.position = length;
+}
+
+void openHistory() {
+    const char *path = getVariable("HISTFILE");
+    const char *home = getVariable("HOME");
+    char defaultPath[PATH_MAX];
+
+    if (path == NULL && home != NULL) {
+        snprintf(defaultPath, sizeof(defaultPath), "%s/.smallsh_history", home);
+        path = defaultPath;
+    }
+    history.fd = (path != NULL) ? open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600) : -1;
+    if (history.fd == -1) {
+        if (path != NULL) fprintf(stderr, "smallsh: %s: %s (history is kept for this session only)\n", path, strerror(errno));
+        history.fd = memfd_create("smallsh-history", MFD_CLOEXEC);
+    }
+    history.lastSync = time(NULL);
+    mapHistory();
+
+    // A line left unfinished by a session that crashed must not swallow the next one
+    if (history.mapSize > 0 && history.map[history.mapSize - 1] != '\n' && write(history.fd, "\n", 1) == -1) {
+        perror("history");
+    }
+
+    // WHY: Indexing millions of lines takes a few hundred milliseconds, which the first Ctrl+R should not wait for.
+    // WHAT: Index a large file in the background while the first commands are typed.
+    if (history.mapSize >= 64 * HISTORY_BLOCK_SIZE) {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        history.indexing = (pthread_create(&history.indexer, NULL, indexHistoryThread, NULL) == 0);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+}
+
+void *indexHistoryThread(void *arg) {
+    struct stat info;
+    if (fstat(history.fd, &info) == -1 || info.st_size == 0) return NULL;
+    char *map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (map == MAP_FAILED) return NULL;
+    indexHistory(map, info.st_size);
+    munmap(map, info.st_size);
+    return NULL;
+}
+
+void finishIndexing() {
+    if (!history.indexing) return;
+    pthread_join(history.indexer, NULL);
+    history.indexing = 0;
+}
+
+void addHistory(const char *line, size_t length) {
+    if (history.fd == -1 || length == 0) return;
+
+    // Skip a repeat of the newest entry
+    mapHistory();
+    const char *end = (history.mapSize > 0) ? memrchr(history.map, '\n', history.mapSize) : NULL;
+    if (end != NULL) {
+        const char *start = memrchr(history.map, '\n', end - history.map);
+        start = (start != NULL) ? start + 1 : history.map;
+        if ((size_t)(end - start) == length && memcmp(start, line, length) == 0) return;
+    }
+
+    // One writev() per line: with O_APPEND it is added whole, after whatever other sessions wrote
+    struct iovec record[2] = { { (void *)line, length }, { "\n", 1 } };
+    if (writev(history.fd, record, 2) == -1) {
+        perror("history");
+        return;
+    }
+    history.unsynced = 1;
+    syncHistory(0);
+}
+
+void syncHistory(int force) {
+    time_t now = time(NULL);
+
+    // WHY: An fdatasync() per command would make every line wait for the disk.
+    // WHAT: Sync at most every HISTORY_SYNC_SECONDS; at worst the lines of the last few seconds are lost.
+    if (!history.unsynced || (!force && now - history.lastSync < HISTORY_SYNC_SECONDS)) return;
+    fdatasync(history.fd);
+    history.lastSync = now;
+    history.unsynced = 0;
+}
+
+void mapHistory() {
+    struct stat info;
+    if (history.fd == -1 || fstat(history.fd, &info) == -1 || (size_t)info.st_size == history.mapSize) return;
+
+    char *map = MAP_FAILED;
+    if (history.map != NULL && (size_t)info.st_size > 0) {
+        map = mremap(history.map, history.mapSize, info.st_size, MREMAP_MAYMOVE);
+    } else if (info.st_size > 0) {
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+    }
+    if (map == MAP_FAILED && history.map != NULL) munmap(history.map, history.mapSize);
+    history.map = (map == MAP_FAILED) ? NULL : map;
+    history.mapSize = (map == MAP_FAILED) ? 0 : (size_t)info.st_size;
+}
+
+void indexHistory(const char *map, size_t size) {
+    size_t filterSize = (1 << HISTORY_FILTER_SHIFT) / 8;
+
+    // A file that shrank (it was cleared) is indexed again; otherwise the last block is cut again if it was left short
+    if (history.indexed > size) history.blockCount = history.indexed = 0;
+    if (history.blockCount > 0 && history.indexed - history.blockStarts[history.blockCount - 1] < HISTORY_BLOCK_SIZE) {
+        history.indexed = history.blockStarts[--history.blockCount];
+    }
+    if (size == history.indexed) return;
+    const char *last = memrchr(map + history.indexed, '\n', size - history.indexed);
+    if (last == NULL) return;
+    size_t end = last - map + 1;
+
+    while (history.indexed < end) {
+        size_t start = history.indexed, stop = start + HISTORY_BLOCK_SIZE;
+        if (stop >= end) {
+            stop = end;
+        } else {
+            stop = (const char *)memchr(map + stop - 1, '\n', end - stop + 1) - map + 1;
+        }
+        if (history.blockCount == history.blockCapacity) {
+            history.blockCapacity = history.blockCapacity ? history.blockCapacity * 2 : 64;
+            history.blockStarts = realloc(history.blockStarts, history.blockCapacity * sizeof(size_t));
+            history.filters = realloc(history.filters, history.blockCapacity * filterSize);
+            if (history.blockStarts == NULL || history.filters == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        unsigned char *filter = history.filters + history.blockCount * filterSize;
+        memset(filter, 0, filterSize);
+        const unsigned char *text = (const unsigned char *)map;
+        for (size_t i = start; i + 1 < stop; i++) {
+            unsigned int gram = (unsigned int)text[i] << 16 | text[i + 1] << 8;
+            unsigned int bit = gramHash(gram);
+            filter[bit >> 3] |= 1 << (bit & 7);
+            if (i + 2 == stop) break;
+            bit = gramHash(gram | text[i + 2]);
+            filter[bit >> 3] |= 1 << (bit & 7);
+        }
+        history.blockStarts[history.blockCount++] = start;
+        history.indexed = stop;
+    }
+}
+
+size_t searchHistory(const char *query, size_t length, size_t before) {
+    size_t filterSize = (1 << HISTORY_FILTER_SHIFT) / 8;
+    const unsigned char *text = (const unsigned char *)query;
+    unsigned int bits[MAX_QUERY_LEN];
+    size_t count = 0;
+
+    // The query's trigrams, or its bigram if it is two characters long
+    for (size_t i = 0; i + 2 < length; i++) bits[count++] = gramHash((unsigned int)text[i] << 16 | text[i + 1] << 8 | text[i + 2]);
+    if (length == 2) bits[count++] = gramHash((unsigned int)text[0] << 16 | text[1] << 8);
+    if (before > history.indexed) before = history.indexed;
+
+    // Newest block first; a block whose filter lacks one of the query's trigrams cannot hold it
+    for (size_t block = history.blockCount; block-- > 0;) {
+        size_t start = history.blockStarts[block];
+        size_t end = (block + 1 < history.blockCount) ? history.blockStarts[block + 1] : history.indexed;
+        if (start >= before) continue;
+        if (end > before) end = before;
+
+        const unsigned char *filter = history.filters + block * filterSize;
+        size_t i = 0;
+        while (i < count && (filter[bits[i] >> 3] & (1 << (bits[i] & 7)))) i++;
+        if (i < count) continue;
+
+        // The newest entry in the block holding it is the one with the last match
+        const char *hit = NULL, *p = history.map + start;
+        while ((p = memmem(p, history.map + end - p, query, length)) != NULL) hit = p++;
+        if (hit != NULL) {
+            const char *line = memrchr(history.map, '\n', hit - history.map);
+            return (line != NULL) ? (size_t)(line - history.map) + 1 : 0;
+        }
+    }
+    return SIZE_MAX;
+}
+
+unsigned int gramHash(unsigned int gram) {
+    return (gram * 2654435761u) >> (32 - HISTORY_FILTER_SHIFT);
+}
+
+void editorComplete(int list) {
+    const char *text = editor.text;
+
+    // The word runs back from the cursor to a blank or an operator ("ls>out.t", "make&&./a.o")
+    size_t start = editor.position;
+    while (start > 0 && memchr(" \t;&|()<>", text[start - 1], 10) == NULL) start--;
+    const char *word = text + start;
+    size_t length = editor.position - start;
+
+    // It names a command if it starts the line, follows an operator (not a redirection) or a keyword
+    size_t before = start;
+    while (before > 0 && (text[before - 1] == ' ' || text[before - 1] == '\t')) before--;
+    size_t previous = before;
+    while (previous > 0 && text[previous - 1] != ' ' && text[previous - 1] != '\t') previous--;
+    int command = (before == 0 || memchr(";&|(", text[before - 1], 4) != NULL);
+    const char *keywords[] = { "if", "then", "else", "elif", "while", "until", "do", "{", "!", NULL };
+    for (int i = 0; keywords[i] != NULL && !command; i++) {
+        command = (strlen(keywords[i]) == before - previous && memcmp(text + previous, keywords[i], before - previous) == 0);
+    }
+    if (memchr(word, '/', length) != NULL) command = 0;  // "./run", "/usr/bin/x": a path
+
+    size_t count = 0, capacity = 64, typed = length;
+    struct completionItem *items = malloc(capacity * sizeof(struct completionItem));
+    if (items == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    char path[PATH_MAX];
+    if (command) {
+        // The trie may be a build behind after $PATH was changed: then this Tab waits for a new one
+        finishCompletionBuild(1);
+        const char *currentPath = getVariable("PATH");
+        if (currentPath == NULL) currentPath = "";
+        if (completion.trie == NULL || strcmp(completion.trie->path, currentPath) != 0) {
+            startCompletionBuild();
+            finishCompletionBuild(1);
+        }
+
+        size_t first, last;
+        if (completion.trie != NULL && findCommands(completion.trie, word, length, &first, &last)) {
+            capacity = last - first + 64;
+            items = realloc(items, capacity * sizeof(struct completionItem));
+            for (size_t i = first; i < last; i++) items[count++] = (struct completionItem){ completion.trie->list[i], DT_UNKNOWN };
+        }
+
+        // Functions and aliases come and go with every command, so they are looked up as they are
+        for (size_t i = 0; i < variables.capacity; i++) {
+            struct variable *variable = &variables.slots[i];
+            if (variable->name == NULL || (variable->function == NULL && variable->alias == NULL)) continue;
+            if (variable->length < length || memcmp(variable->name, word, length) != 0) continue;
+            if (count == capacity) {
+                capacity *= 2;
+                items = realloc(items, capacity * sizeof(struct completionItem));
+            }
+            items[count++] = (struct completionItem){ variable->name, DT_UNKNOWN };
+        }
+    } else {
+        // File names come from the same cached listings as globbing; "~/" is the home directory
+        const char *slash = memrchr(word, '/', length);
+        size_t directoryLength = slash ? (size_t)(slash - word) + 1 : 0;
+        const char *home = getVariable("HOME");
+        if (directoryLength == 0) {
+            strcpy(path, ".");
+        } else if (word[0] == '~' && word[1] == '/' && home != NULL) {
+            snprintf(path, sizeof(path), "%s%.*s", home, (int)directoryLength - 1, word + 1);
+        } else {
+            snprintf(path, sizeof(path), "%.*s", (int)directoryLength, word);
+        }
+        const char *base = word + directoryLength;
+        typed = length - directoryLength;
+
+        struct globListing *listing = listDirectory(path);
+        for (size_t i = 0; listing != NULL && i < listing->count; i++) {
+            const char *name = listing->names + listing->offsets[i];
+            if (name[0] == '.' && (typed == 0 || base[0] != '.')) continue;  // Hidden unless asked for
+            if (strncmp(name, base, typed) != 0) continue;
+            if (count == capacity) {
+                capacity *= 2;
+                items = realloc(items, capacity * sizeof(struct completionItem));
+            }
+            if (items == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            items[count++] = (struct completionItem){ name, listing->types[i] };
+        }
+    }
+    if (items == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+
+    // The longest prefix the candidates share; it is the only one if they all end there
+    size_t common = count ? strlen(items[0].name) : 0;
+    int unique = (count > 0);
+    for (size_t i = 1; i < count; i++) {
+        size_t j = typed;
+        while (j < common && items[i].name[j] == items[0].name[j]) j++;
+        common = j;
+    }
+    for (size_t i = 0; i < count && unique; i++) unique = (items[i].name[common] == '\0');
+
+    if (unique || common > typed) {
+        char *insert = arenaAlloc(&lineArena, common - typed + 1);
+        memcpy(insert, items[0].name + typed, common - typed);
+        size_t insertLength = common - typed;
+        if (unique) {
+            // A directory is followed by a '/', to go on into it, and anything else by a space
+            int directory = (items[0].type == DT_DIR);
+            if (!command && (items[0].type == DT_LNK || items[0].type == DT_UNKNOWN)) {
+                struct stat info;
+                size_t pathLength = strlen(path);
+                snprintf(path + pathLength, sizeof(path) - pathLength, "/%s", items[0].name);
+                directory = (stat(path, &info) == 0 && S_ISDIR(info.st_mode));
+            }
+            insert[insertLength++] = (!command && directory) ? '/' : ' ';
+        }
+        editorReplace(editor.position, editor.position, insert, insertLength);
+    } else if (list && count > 0) {
+        showCompletions(items, count, !command);
+    } else {
+        editorAppend("\a", 1);
+    }
+    free(items);
+}
+
+void showCompletions(struct completionItem *items, size_t count, int files) {
+    // Sorted, and without the duplicates of a function or alias that is also a command
+    qsort(items, count, sizeof(struct completionItem), compareCompletions);
+    size_t unique = 0, width = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && strcmp(items[unique - 1].name, items[i].name) == 0) continue;
+        items[unique++] = items[i];
+        size_t nameWidth = displayWidth(items[i].name, strlen(items[i].name)) + (files && items[i].type == DT_DIR);
+        if (nameWidth > width) width = nameWidth;
+    }
+    count = unique;
+
+    editorMove(editor.length);
+    editorAppend("\r\n", 2);
+    if (count > MAX_COMPLETIONS_SHOWN) {
+        char message[64];
+        editorAppend(message, snprintf(message, sizeof(message), "%zu possibilities\r\n", count));
+    } else {
+        // Column-major like ls, as many columns as fit
+        width += 2;
+        size_t columns = (editor.columns / width > 0) ? editor.columns / width : 1;
+        size_t rows = (count + columns - 1) / columns;
+        for (size_t row = 0; row < rows; row++) {
+            for (size_t column = 0; column < columns; column++) {
+                size_t i = column * rows + row;
+                if (i >= count) break;
+                size_t nameLength = strlen(items[i].name);
+                editorAppendText(items[i].name, nameLength);
+                size_t shown = displayWidth(items[i].name, nameLength);
+                if (files && items[i].type == DT_DIR) {
+                    editorAppend("/", 1);
+                    shown++;
+                }
+                if (i + rows < count) {
+                    while (shown++ < width) editorAppend(" ", 1);
+                }
+            }
+            editorAppend("\r\n", 2);
+        }
+    }
+    editor.cursor = 0;  // The prompt starts on the fresh row after the list
+    editorRedraw(0);
+}
+
+int compareCompletions(const void *a, const void *b) {
+    return strcmp(((const struct completionItem *)a)->name, ((const struct completionItem *)b)->name);
+}
+
+void startCompletionBuild() {
+    if (completion.building) {
+        completion.stale = 1;
+        return;
+    }
+    completion.stale = 0;
+    const char *path = getVariable("PATH");
+    char *copy = strdup(path != NULL ? path : "");
+    if (copy == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+
+    // The watches are in place before the directories are read, so no change can slip in between
+    if (completion.changes.fd != -1) {
+        removeEventSource(&completion.changes);
+        close(completion.changes.fd);
+    }
+    completion.changes.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    completion.changes.handler = handleCompletionChanges;
+    if (completion.changes.fd != -1) {
+        for (const char *dir = copy; *dir != '\0'; dir += (dir[0] == ':')) {
+            char directory[PATH_MAX];
+            size_t length = strcspn(dir, ":");
+            if (length > 0 && length < sizeof(directory)) {
+                memcpy(directory, dir, length);
+                directory[length] = '\0';
+                inotify_add_watch(completion.changes.fd, directory,
+                                  IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+            }
+            dir += length;
+        }
+        addEventSource(&completion.changes);
+    }
+    if (completion.done.fd == -1) {
+        completion.done.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        completion.done.handler = handleCompletionBuilt;
+        if (completion.done.fd != -1) addEventSource(&completion.done);
+    }
+
+    // Signals are for the shell's own thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    completion.finished = 0;
+    completion.building = (pthread_create(&completion.builder, NULL, completionThread, copy) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!completion.building) {
+        freeCommandTrie(completion.trie);
+        completion.trie = buildCommandTrie(copy);
+    }
+}
+
+void finishCompletionBuild(int wait) {
+    if (!completion.building) return;
+    if (!wait && !__atomic_load_n(&completion.finished, __ATOMIC_ACQUIRE)) return;
+    pthread_join(completion.builder, NULL);  // Once finished is set, the thread is only returning
+    completion.building = 0;
+    freeCommandTrie(completion.trie);
+    completion.trie = completion.built;
+    completion.built = NULL;
+    if (completion.stale) startCompletionBuild();
+}
+
+void *completionThread(void *arg) {
+    uint64_t one = 1;
+    completion.built = buildCommandTrie(arg);
+    __atomic_store_n(&completion.finished, 1, __ATOMIC_RELEASE);
+    if (completion.done.fd != -1 && write(completion.done.fd, &one, sizeof(one)) == -1) perror("completion");
+    return NULL;
+}
+
+void handleCompletionChanges(struct eventSource *source) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(source->fd, buffer, sizeof(buffer)) > 0) {}
+    startCompletionBuild();
+}
+
+void handleCompletionBuilt(struct eventSource *source) {
+    uint64_t count;
+    if (read(source->fd, &count, sizeof(count)) != sizeof(count)) return;
+    finishCompletionBuild(0);
+}
+
+struct commandTrie *buildCommandTrie(char *path) {
+    struct commandTrie *trie = calloc(1, sizeof(struct commandTrie));
+    if (trie == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    trie->path = path;
+
+    // Each directory is read like a glob's, and only what is an executable file (or links to one) counts.
+    // An empty entry of PATH would mean whatever the current directory is at the time, so it is skipped.
+    for (const char *dir = path; *dir != '\0'; dir += (dir[0] == ':')) {
+        char directory[PATH_MAX];
+        size_t length = strcspn(dir, ":");
+        int fd = -1;
+        if (length > 0 && length < sizeof(directory)) {
+            memcpy(directory, dir, length);
+            directory[length] = '\0';
+            fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        dir += length;
+        if (fd == -1) continue;
+
+        struct globListing listing = { 0 };
+        readListing(fd, &listing);
+        for (size_t i = 0; i < listing.count; i++) {
+            const char *name = listing.names + listing.offsets[i];
+            struct stat info;
+            if (listing.types[i] == DT_DIR || fstatat(fd, name, &info, 0) == -1) continue;
+            if (S_ISREG(info.st_mode) && (info.st_mode & 0111)) addTrieName(trie, name);
+        }
+        freeListing(&listing);
+        close(fd);
+    }
+    for (int i = 0; builtins[i].name != NULL; i++) addTrieName(trie, builtins[i].name);
+    addTrieName(trie, "cd");
+    addTrieName(trie, "exit");
+
+    // Sorted and without duplicates (the same command in several directories), the names under any
+    // prefix are one range
+    trie->list = malloc((trie->count + 1) * sizeof(char *));
+    if (trie->list == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < trie->count; i++) trie->list[i] = trie->names + trie->offsets[i];
+    qsort(trie->list, trie->count, sizeof(char *), compareStrings);
+    size_t unique = 0;
+    for (size_t i = 0; i < trie->count; i++) {
+        if (unique == 0 || strcmp(trie->list[unique - 1], trie->list[i]) != 0) trie->list[unique++] = trie->list[i];
+    }
+    trie->count = unique;
+    free(trie->offsets);
+    trie->offsets = NULL;
+
+    trie->nodeCapacity = 1024;
+    trie->nodes = malloc(trie->nodeCapacity * sizeof(struct trieNode));
+    if (trie->nodes == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    trie->nodes[0] = (struct trieNode){ 0, 0, trie->count, 0, 0 };
+    trie->nodeCount = 1;
+    addTrieChildren(trie, 0, 0, trie->count, 0);
+    return trie;
+}
+
+void addTrieName(struct commandTrie *trie, const char *name) {
+    size_t length = strlen(name) + 1;
+    if (trie->count == trie->capacity) {
+        trie->capacity = trie->capacity ? trie->capacity * 2 : 1024;
+        trie->offsets = realloc(trie->offsets, trie->capacity * sizeof(size_t));
+    }
+    if (trie->namesLength + length > trie->namesCapacity) {
+        if (trie->namesCapacity == 0) trie->namesCapacity = 16384;
+        while (trie->namesLength + length > trie->namesCapacity) trie->namesCapacity *= 2;
+        trie->names = realloc(trie->names, trie->namesCapacity);
+    }
+    if (trie->offsets == NULL || trie->names == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    memcpy(trie->names + trie->namesLength, name, length);
+    trie->offsets[trie->count++] = trie->namesLength;
+    trie->namesLength += length;
+}
+
+void addTrieChildren(struct commandTrie *trie, size_t node, size_t first, size_t last, size_t depth) {
+    char **list = trie->list;
+
+    // A name that ends at this node sorts before the longer ones, and has no child
+    if (first < last && list[first][depth] == '\0') first++;
+    if (first == last) return;
+
+    // The children are allocated together, one per distinct next byte
+    size_t children = 1;
+    for (size_t i = first + 1; i < last; i++) children += (list[i][depth] != list[i - 1][depth]);
+    if (trie->nodeCount + children > trie->nodeCapacity) {
+        while (trie->nodeCount + children > trie->nodeCapacity) trie->nodeCapacity *= 2;
+        trie->nodes = realloc(trie->nodes, trie->nodeCapacity * sizeof(struct trieNode));
+        if (trie->nodes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    size_t child = trie->nodeCount;
+    trie->nodes[node].firstChild = child;
+    trie->nodes[node].childCount = children;
+    trie->nodeCount += children;
+
+    for (size_t i = first; i < last; child++) {
+        size_t end = i + 1;
+        while (end < last && list[end][depth] == list[i][depth]) end++;
+        trie->nodes[child] = (struct trieNode){ 0, i, end, 0, (unsigned char)list[i][depth] };
+        addTrieChildren(trie, child, i, end, depth + 1);
+        i = end;
+    }
+}
+
+int findCommands(struct commandTrie *trie, const char *prefix, size_t length, size_t *first, size_t *last) {
+    struct trieNode *node = &trie->nodes[0];
+    for (size_t i = 0; i < length; i++) {
+        struct trieNode *child = trie->nodes + node->firstChild, *end = child + node->childCount;
+        while (child < end && child->byte != (unsigned char)prefix[i]) child++;
+        if (child == end) return 0;
+        node = child;
+    }
+    *first = node->first;
+    *last = node->last;
+    return *first < *last;
+}
+
+void freeCommandTrie(struct commandTrie *trie) {
+    if (trie == NULL) return;
+    free(trie->path);
+    free(trie->names);
+    free(trie->offsets);
+    free(trie->list);
+    free(trie->nodes);
+    free(trie);
+}
+
+size_t editorCell(size_t offset) {
+    if (offset <= editor.position) return editor.cursor - displayWidth(editor.text + offset, editor.position - offset);
+    return editor.cursor + displayWidth(editor.text + editor.position, offset - editor.position);
+}
+
+void moveCursor(size_t cell) {
+    size_t columns = editor.columns;
+    size_t fromRow = editor.cursor / columns, toRow = cell / columns;
+    size_t fromColumn = editor.cursor % columns, toColumn = cell % columns;
+    char sequence[64];
+    int length = 0;
+
+    if (toRow < fromRow) length += snprintf(sequence, sizeof(sequence), "\033[%zuA", fromRow - toRow);
+    if (toRow > fromRow) length += snprintf(sequence, sizeof(sequence), "\033[%zuB", toRow - fromRow);
+    if (toColumn == 0 && fromColumn != 0) {
+        sequence[length++] = '\r';
+    } else if (toColumn < fromColumn) {
+        length += snprintf(sequence + length, sizeof(sequence) - length, "\033[%zuD", fromColumn - toColumn);
+    } else if (toColumn > fromColumn) {
+        length += snprintf(sequence + length, sizeof(sequence) - length, "\033[%zuC", toColumn - fromColumn);
+    }
+    editorAppend(sequence, length);
+    editor.cursor = cell;
+}
+
+void editorAppendText(const char *text, size_t length) {
+    size_t start = editor.outputLength;
+    editorAppend(text, length);
+    for (size_t i = start; i < editor.outputLength; i++) {
+        if ((unsigned char)editor.output[i] < 0x20 || editor.output[i] == 0x7f) editor.output[i] = ' ';
+    }
+}
+
+void editorAppend(const char *data, size_t length) {
+    if (editor.outputLength + length > editor.outputCapacity) {
+        editor.outputCapacity = editor.outputCapacity ? editor.outputCapacity : 4096;
+        while (editor.outputLength + length > editor.outputCapacity) editor.outputCapacity *= 2;
+        editor.output = realloc(editor.output, editor.outputCapacity);
+        if (editor.output == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(editor.output + editor.outputLength, data, length);
+    editor.outputLength += length;
+}
+
+void editorFlush() {
+    if (editor.outputLength > 0 && writeAll(STDOUT_FILENO, editor.output, editor.outputLength) == -1) perror("write");
+    editor.outputLength = 0;
+}
+
+size_t displayWidth(const char *text, size_t length) {
+    size_t width = 0;
+    for (size_t i = 0; i < length; i++) width += (((unsigned char)text[i] & 0xc0) != 0x80);
+    return width;
+}
+
+size_t terminalColumns() {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 || size.ws_col == 0) return 80;
+    return size.ws_col;
+}
+
+int storeCommand(struct storedCommand *command, char **args, struct redirections *redirs) {
+    int count = 0;
+    while (args[count] != NULL) count++;
+
+    // The words are compiled once, as a line of their own would be
+    struct capture text = { &lineArena, NULL, 0, 0 };
+    for (int i = 0; i < count; i++) {
+        if (i > 0) captureAppend(&text, " ", 1);
+        captureAppend(&text, args[i], strlen(args[i]));
+    }
+    char *source = text.data;
+    size_t length = text.length;
+    if (length >= 2 && (source[0] == '\'' || source[0] == '"') && source[length - 1] == source[0]) {
+        source++;
+        length -= 2;
+    }
+    int status = compileProgram(source, length, &command->program);
+    if (status == COMPILE_INCOMPLETE) fprintf(stderr, "smallsh: syntax error: unexpected end of input\n");
+    if (status != COMPILE_OK) return -1;
+    if (command->program->root == -1) {
+        fprintf(stderr, "smallsh: syntax error: empty command\n");
+        releaseProgram(command->program);
+        return -1;
+    }
+
+    command->args = malloc((count + 1) * sizeof(char *));
+    for (int i = 0; i < count; i++) command->args[i] = strdup(args[i]);
+    command->args[count] = NULL;
+    command->redirs = *redirs;
+    for (int i = 0; i < redirs->count; i++) {
+        struct redirection *r = &command->redirs.list[i];
+        if (r->path != NULL) r->path = strdup(r->path);
+        if (r->type == REDIR_DATA) r->source = fcntl(r->source, F_DUPFD_CLOEXEC, 10);  // Outlives the line's memfd
+    }
+    return 0;
+}
+
+void freeStoredCommand(struct storedCommand *command) {
+    for (int i = 0; command->args[i] != NULL; i++) free(command->args[i]);
+    free(command->args);
+    releaseProgram(command->program);
+    for (int i = 0; i < command->redirs.count; i++) free(command->redirs.list[i].path);
+    releaseRedirections(&command->redirs);
+}
+
+struct job *startStoredCommand(struct storedCommand *command) {
+    pid_t spawnpid = startSubshell(&command->redirs, 1);
+    if (spawnpid == 0) {
+        // The event that started the run may have come in the middle of a loop or function; none of it applies
+        exitRequested = breakLevels = continueLevels = programInterrupted = nestingExceeded = returnRequested = 0;
+        loopDepth = functionDepth = 0;
+        runList(command->program, command->program->root);
+        exitSubshell();
+    }
+    setpgid(spawnpid, spawnpid);
+    printf("background pid is %d\n", spawnpid);
+    fflush(stdout);
+    return addJob(spawnpid);
+}
+
+char *absolutePath(const char *path) {
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved) != NULL) return strdup(resolved);
+
+    // A file that does not exist yet (or is mid-rename): resolve its directory and keep the name
+    const char *slash = strrchr(path, '/');
+    const char *name = (slash != NULL) ? slash + 1 : path;
+    char directory[PATH_MAX];
+    if (slash == path) {
+        strcpy(directory, "/");
+    } else if (slash == NULL) {
+        strcpy(directory, ".");
+    } else if (snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path), path) >= (int)sizeof(directory)) {
+        return strdup(path);
+    }
+    if (realpath(directory, resolved) == NULL) return strdup(path);  // Reported when the watch is added
+
+    struct capture joined = { &lineArena, NULL, 0, 0 };
+    captureAppend(&joined, resolved, strlen(resolved));
+    if (strcmp(resolved, "/") != 0) captureAppend(&joined, "/", 1);
+    captureAppend(&joined, name, strlen(name) + 1);
+    return strdup(joined.data);
+}
+
+struct job *addJob(pid_t pid) {
+    struct job *job = calloc(1, sizeof(struct job));
+    trackJob(job, pid);
+
+    if (jobCount == jobCapacity) {
+        jobCapacity = jobCapacity ? jobCapacity * 2 : 16;
+        jobs = realloc(jobs, jobCapacity * sizeof(struct job *));
+    }
+    jobs[jobCount++] = job;
+    return job;
+}
+
+void trackJob(struct job *job, pid_t pid) {
+    job->pid = pid;
+    job->timer.fd = -1;
+
+    // Watch the pidfd so the job is reaped as soon as it exits, even while the shell waits for input
+    job->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (job->pidfd != -1) {
+        job->source.fd = job->pidfd;
+        job->source.handler = handleJobExit;
+        job->source.data = job;
+        addEventSource(&job->source);
+    }
+    // WHY: Without pidfd support the job is still reaped, just later, by checkBackgroundProcesses().
+}
+
+void jobReaped(struct job *job, int status) {
+    job->status = status;
+    job->done = 1;
+    if (job->pidfd != -1) {
+        removeEventSource(&job->source);
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+    if (job->timer.fd != -1) {
+        removeEventSource(&job->timer);
+        close(job->timer.fd);
+        job->timer.fd = -1;
+    }
+    if (job->onExit != NULL) job->onExit(job);
+}
+
+void handleJobExit(struct eventSource *source) {
+    struct job *job = source->data;
+    int childStatus;
+
+    if (waitpid(job->pid, &childStatus, WNOHANG) == job->pid) jobReaped(job, childStatus);
+}
+
+void watchCommand(char **args, struct redirections *redirs, int background) {
+    int debounceMs = DEFAULT_DEBOUNCE_MS;
+    int restart = 0;
+    int i = 1;
+
+    // With no arguments, list the active watchers
+    if (args[1] == NULL) {
+        for (struct watcher *w = watchers; w != NULL; w = w->next) {
+            printf("[%d]", w->id);
+            for (int p = 0; p < w->pathCount; p++) printf(" %s", w->paths[p]);
+            printf(" --");
+            for (int a = 0; w->command.args[a] != NULL; a++) printf(" %s", w->command.args[a]);
+            printf("%s\n", w->running ? " (running)" : "");
+        }
+        fflush(stdout);
+        return;
+    }
+
+    // Parse the options that precede the paths
+    for (; args[i] != NULL && args[i][0] == '-' && strcmp(args[i], "--") != 0; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            restart = 1;
+        } else if (strcmp(args[i], "-d") == 0 && args[i + 1] != NULL) {
+            char *end;
+            long ms = strtol(args[++i], &end, 10);
+            if (*end != '\0' || ms < 0) {
+                fprintf(stderr, "watch: -d expects milliseconds\n");
+                setStatus(1 << 8);
+                return;
+            }
+            debounceMs = ms;
+        } else {
+            fprintf(stderr, "watch: unknown option %s\n", args[i]);
+            setStatus(1 << 8);
+            return;
+        }
+    }
+
+    // The paths run up to "--"; the command follows it
+    int firstPath = i;
+    while (args[i] != NULL && strcmp(args[i], "--") != 0) i++;
+    if (i == firstPath || args[i] == NULL || args[i + 1] == NULL) {
+        fprintf(stderr, "usage: watch [-d ms] [-r] path... -- command [args...]\n");
+        setStatus(1 << 8);
+        return;
+    }
+
+    // All watchers share one inotify instance, created on first use
+    if (inotifyFD == -1) {
+        static struct eventSource inotifySource;
+        inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFD == -1) {
+            perror("inotify_init1");
+            setStatus(1 << 8);
+            return;
+        }
+        inotifySource.fd = inotifyFD;
+        inotifySource.handler = handleInotifyEvents;
+        addEventSource(&inotifySource);
+    }
+
+    struct watcher *watcher = calloc(1, sizeof(struct watcher));
+    if (storeCommand(&watcher->command, args + i + 1, redirs) == -1) {
+        free(watcher);
+        setStatus(1 << 8);
+        return;
+    }
+    watcher->pathCount = i - firstPath;
+    watcher->paths = malloc(watcher->pathCount * sizeof(char *));
+    watcher->wds = malloc(watcher->pathCount * sizeof(int));
+    for (int p = 0; p < watcher->pathCount; p++) {
+        watcher->paths[p] = absolutePath(args[firstPath + p]);  // Re-added by path later, maybe from elsewhere
+        watcher->wds[p] = inotify_add_watch(inotifyFD, watcher->paths[p], WATCH_EVENTS);
+        if (watcher->wds[p] == -1) perror(watcher->paths[p]);  // Keep it; it is retried once it exists
+    }
+
+    // The debounce window is a timerfd in the same event loop, so quiet periods cost no wakeups
+    watcher->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    watcher->timer.handler = handleWatcherTimer;
+    watcher->timer.data = watcher;
+    addEventSource(&watcher->timer);
+
+    watcher->id = nextWatcherId++;
+    watcher->debounceMs = debounceMs;
+    watcher->restart = restart;
+    watcher->next = watchers;
+    watchers = watcher;
+
+    printf("watch %d started\n", watcher->id);
+    fflush(stdout);
+    setStatus(0);
+}
+
+void unwatchCommand(char **args, struct redirections *redirs, int background) {
+    int id = args[1] ? atoi(args[1]) : 0;
+
+    for (struct watcher *watcher = watchers; watcher != NULL; watcher = watcher->next) {
+        if (watcher->id == id) {
+            removeWatcher(watcher);
+            setStatus(0);
+            return;
+        }
+    }
+    fprintf(stderr, "unwatch: no such watcher\n");
+    setStatus(1 << 8);
+}
+
+void removeWatcher(struct watcher *watcher) {
+    for (struct watcher **link = &watchers; *link != NULL; link = &(*link)->next) {
+        if (*link == watcher) {
+            *link = watcher->next;
+            break;
+        }
+    }
+
+    // Drop each inotify watch unless another watcher shares it (inotify hands out one wd per inode)
+    for (int p = 0; p < watcher->pathCount; p++) {
+        int shared = 0;
+        for (struct watcher *w = watchers; w != NULL && !shared; w = w->next) {
+            for (int q = 0; q < w->pathCount; q++) {
+                if (w->wds[q] == watcher->wds[p]) shared = 1;
+            }
+        }
+        if (watcher->wds[p] != -1 && !shared) inotify_rm_watch(inotifyFD, watcher->wds[p]);
+        free(watcher->paths[p]);
+    }
+
+    // A run still in progress carries on as an ordinary background job
+    if (watcher->running != NULL) watcher->running->onExit = NULL;
+
+    removeEventSource(&watcher->timer);
+    close(watcher->timer.fd);
+    freeStoredCommand(&watcher->command);
+    free(watcher->paths);
+    free(watcher->wds);
+    free(watcher);
+}
+
+void handleInotifyEvents(struct eventSource *source) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    // Drain every queued event; one read may return many
+    while ((n = read(source->fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+
+            for (struct watcher *w = watchers; w != NULL; w = w->next) {
+                int hit = 0;
+                for (int q = 0; q < w->pathCount; q++) {
+                    if (w->wds[q] != event->wd) continue;
+                    hit = 1;
+                    // Deleted, or renamed away (the watch would follow the old inode): re-added on the next run
+                    if (event->mask & IN_MOVE_SELF) inotify_rm_watch(inotifyFD, w->wds[q]);
+                    if (event->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF)) w->wds[q] = -1;
+                }
+                if (!hit) continue;
+
+                // (Re)start the debounce window: the command runs once the burst is over
+                struct itimerspec window = {{0, 0}, {w->debounceMs / 1000, (w->debounceMs % 1000) * 1000000L}};
+                if (w->debounceMs == 0) window.it_value.tv_nsec = 1;  // A zero value would disarm the timer
+                timerfd_settime(w->timer.fd, 0, &window, NULL);
+            }
+        }
+    }
+}
+
+void handleWatcherTimer(struct eventSource *source) {
+    struct watcher *watcher = source->data;
+    uint64_t expirations;
+
+    if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    // Paths replaced by an editor (write to a temp file, then rename over) lost their watch; pick up the new file
+    for (int p = 0; p < watcher->pathCount; p++) {
+        if (watcher->wds[p] == -1) watcher->wds[p] = inotify_add_watch(inotifyFD, watcher->paths[p], WATCH_EVENTS);
+    }
+
+    if (watcher->running == NULL) {
+        startWatcherRun(watcher);
+    } else {
+        // Queue behind the running instance, or with -r cancel it and start over once it is gone
+        watcher->pending = 1;
+        if (watcher->restart) kill(-watcher->running->pid, SIGTERM);
+    }
+}
+
+void startWatcherRun(struct watcher *watcher) {
+    struct storedCommand *command = &watcher->command;
+
+    watcher->pending = 0;
+    watcher->running = startStoredCommand(command);
+    watcher->running->onExit = watcherRunExited;
+    watcher->running->owner = watcher;
+}
+
+void watcherRunExited(struct job *job) {
+    struct watcher *watcher = job->owner;
+
+    watcher->running = NULL;
+    if (watcher->pending) startWatcherRun(watcher);
+}
+
+int waitForeground(pid_t pid) {
+    struct eventSource source = { -1, handleForegroundExit, NULL };
+    int childStatus;
+
+    // Without pidfd support fall back to a plain blocking wait
+    source.fd = syscall(SYS_pidfd_open, pid, 0);
+    if (source.fd == -1 || addEventSource(&source) == -1) {
+        if (source.fd != -1) close(source.fd);
+        waitpid(pid, &childStatus, 0);
+        return childStatus;
+    }
+
+    // WHY: Scheduled runs and watchers must keep firing while a long foreground command runs.
+    // WHAT: The pidfd becomes readable when the child exits; until then the loop serves the other sources.
+    foregroundExited = 0;
+    while (waitpid(pid, &childStatus, WNOHANG) != pid) {
+        while (!foregroundExited) runEvents(-1);
+        foregroundExited = 0;
+    }
+    removeEventSource(&source);
+    close(source.fd);
+    return childStatus;
+}
+
+void handleForegroundExit(struct eventSource *source) {
+    foregroundExited = 1;
+}
+
+int parseDuration(const char *text, long long *nanoseconds) {
+    char *unit;
+    double scale;
+
+    if (*text == '+') text++;
+    double value = strtod(text, &unit);
+    if (unit == text || !(value > 0)) return -1;  // Also rejects NaN
+
+    if (strcmp(unit, "") == 0 || strcmp(unit, "s") == 0) {
+        scale = NSEC_PER_SEC;
+    } else if (strcmp(unit, "ms") == 0) {
+        scale = 1000000.0;
+    } else if (strcmp(unit, "m") == 0) {
+        scale = 60.0 * NSEC_PER_SEC;
+    } else if (strcmp(unit, "h") == 0) {
+        scale = 3600.0 * NSEC_PER_SEC;
+    } else if (strcmp(unit, "d") == 0) {
+        scale = 86400.0 * NSEC_PER_SEC;
+    } else {
+        return -1;
+    }
+
+    // WHY: Converting a double beyond the range of long long is undefined ("timeout 1e300 cmd").
+    // WHAT: Check the product first; 2^63 is exact as a double, so anything below it converts.
+    double product = value * scale;
+    if (product >= 9223372036854775808.0) return -1;
+    *nanoseconds = product;
+    return *nanoseconds > 0 ? 0 : -1;
+}
+
+void scheduleCommand(char **args, struct redirections *redirs, int background) {
+    int repeat = strcmp(args[0], "every") == 0;
+    long long delay;
+
+    // With no arguments, list the pending schedules
+    if (args[1] == NULL) {
+        for (struct schedule *s = schedules; s != NULL; s = s->next) {
+            struct itimerspec left;
+            timerfd_gettime(s->timer.fd, &left);
+            printf("[%d] %s next in %.3fs:", s->id, s->interval ? "every" : "at",
+                   left.it_value.tv_sec + left.it_value.tv_nsec / 1e9);
+            for (int a = 0; s->command.args[a] != NULL; a++) printf(" %s", s->command.args[a]);
+            if (s->skipped) printf(" (%d skipped)", s->skipped);
+            printf("\n");
+        }
+        fflush(stdout);
+        return;
+    }
+
+    if (parseDuration(args[1], &delay) == -1 || args[2] == NULL) {
+        fprintf(stderr, "usage: %s\n", repeat ? "every interval command [args...]" : "at +delay command [args...]");
+        setStatus(1 << 8);
+        return;
+    }
+
+    struct schedule *schedule = calloc(1, sizeof(struct schedule));
+    if (storeCommand(&schedule->command, args + 2, redirs) == -1) {
+        free(schedule);
+        setStatus(1 << 8);
+        return;
+    }
+    schedule->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (schedule->timer.fd == -1) {
+        perror("timerfd_create");
+        freeStoredCommand(&schedule->command);
+        free(schedule);
+        setStatus(1 << 8);
+        return;
+    }
+
+    // The kernel keeps an interval timer drift-free, so the shell never computes or polls deadlines itself
+    struct itimerspec when = {{0, 0}, {delay / NSEC_PER_SEC, delay % NSEC_PER_SEC}};
+    if (repeat) when.it_interval = when.it_value;
+    timerfd_settime(schedule->timer.fd, 0, &when, NULL);
+
+    schedule->timer.handler = handleScheduleTimer;
+    schedule->timer.data = schedule;
+    addEventSource(&schedule->timer);
+
+    schedule->id = nextScheduleId++;
+    schedule->interval = repeat ? delay : 0;
+    schedule->next = schedules;
+    schedules = schedule;
+
+    printf("schedule %d started\n", schedule->id);
+    fflush(stdout);
+    setStatus(0);
+}
+
+void unscheduleCommand(char **args, struct redirections *redirs, int background) {
+    int id = args[1] ? atoi(args[1]) : 0;
+
+    for (struct schedule *schedule = schedules; schedule != NULL; schedule = schedule->next) {
+        if (schedule->id == id) {
+            removeSchedule(schedule);
+            setStatus(0);
+            return;
+        }
+    }
+    fprintf(stderr, "unschedule: no such schedule\n");
+    setStatus(1 << 8);
+}
+
+void handleScheduleTimer(struct eventSource *source) {
+    struct schedule *schedule = source->data;
+    uint64_t expirations;
+
+    if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    // Skip-if-running: a slow run swallows the ticks that land while it is still going
+    // WHY: Overlapping copies of housekeeping jobs tend to fight over the same files.
+    // WHAT: Several expirations at once (the shell was busy) also collapse into a single run.
+    if (schedule->running != NULL) {
+        schedule->skipped += expirations;
+        return;
+    }
+    schedule->skipped += expirations - 1;
+
+    struct job *job = startStoredCommand(&schedule->command);
+    if (schedule->interval == 0) {
+        removeSchedule(schedule);  // A one-shot `at` is finished once its run has started
+    } else {
+        schedule->running = job;
+        job->onExit = scheduledRunExited;
+        job->owner = schedule;
+    }
+}
+
+void scheduledRunExited(struct job *job) {
+    struct schedule *schedule = job->owner;
+
+    schedule->running = NULL;
+}
+
+void removeSchedule(struct schedule *schedule) {
+    for (struct schedule **link = &schedules; *link != NULL; link = &(*link)->next) {
+        if (*link == schedule) {
+            *link = schedule->next;
+            break;
+        }
+    }
+    if (schedule->running != NULL) schedule->running->onExit = NULL;
+    removeEventSource(&schedule->timer);
+    close(schedule->timer.fd);
+    freeStoredCommand(&schedule->command);
+    free(schedule);
+}
+
+void walkCommand(char **args, struct redirections *redirs, int background) {
+    struct walker walker = {0};
+    struct globMatcher matcher;
+    const char *root = ".";
+    int arg = 1;
+
+    // Options, then the optional directory and pattern, then the optional "-- cmd args..."
+    for (; args[arg] != NULL && args[arg][0] == '-' && strcmp(args[arg], "--") != 0; arg++) {
+        char *end = "";
+        if (strcmp(args[arg], "-a") == 0) {
+            walker.hidden = 1;
+        } else if (strcmp(args[arg], "-j") == 0 && args[arg + 1] != NULL &&
+                   (walker.threadCount = strtol(args[arg + 1], &end, 10)) > 0 && *end == '\0') {
+            arg++;
+        } else {
+            fprintf(stderr, "usage: walk [-a] [-j threads] [dir [pattern]] [-- command [args...]]\n");
+            setStatus(1 << 8);
+            return;
+        }
+    }
+    if (args[arg] != NULL && strcmp(args[arg], "--") != 0) root = args[arg++];
+    if (args[arg] != NULL && strcmp(args[arg], "--") != 0) {
+        // Quotes around the pattern keep the shell from expanding it ("walk src '*.c'")
+        char *pattern = args[arg++];
+        size_t length = strlen(pattern);
+        if (length >= 2 && (pattern[0] == '\'' || pattern[0] == '"') && pattern[length - 1] == pattern[0]) {
+            pattern[length - 1] = '\0';
+            pattern++;
+        }
+        compileGlob(pattern, &matcher);
+        matcher.dotOK |= walker.hidden;
+        walker.matcher = &matcher;
+    }
+    if (args[arg] != NULL && (strcmp(args[arg], "--") != 0 || args[arg + 1] == NULL)) {
+        fprintf(stderr, "usage: walk [-a] [-j threads] [dir [pattern]] [-- command [args...]]\n");
+        setStatus(1 << 8);
+        return;
+    }
+    char **cmd = (args[arg] != NULL) ? args + arg + 1 : NULL;
+    size_t rootLength = strlen(root);
+    char prefix[rootLength + 2];
+    snprintf(prefix, sizeof(prefix), (root[rootLength - 1] == '/') ? "%s" : "%s/", root);
+
+    // With a command, the paths go down a pipe to its stdin; its stdout is the builtin's own
+    int out = currentIO->fd[1];
+    int held = -1;
+    pid_t pid = -1;
+    struct sigaction ignorePipe = {{0}}, oldPipe;
+    if (cmd != NULL) {
+        int pipeFDs[2];
+        if (pipe2(pipeFDs, O_CLOEXEC) == -1 ||
+            (out == CAPTURE_FD && (held = memfd_create("smallsh-walk", MFD_CLOEXEC)) == -1)) {
+            perror("walk");
+            setStatus(1 << 8);
+            return;
+        }
+        fflush(stdout);
+        pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        } else if (pid == 0) {
+            struct sigaction SIGINT_action = {{0}};
+            SIGINT_action.sa_handler = SIG_DFL;
+            sigaction(SIGINT, &SIGINT_action, NULL);
+            sigaction(SIGPIPE, &inheritedPipeAction, NULL);  // A pipeline running this may be ignoring it
+
+            // Inside "$(...)" the output is held in a memfd and captured once the command is done
+            int stdoutFD = (held != -1) ? held : out;
+            if (dup2(pipeFDs[0], 0) == -1 || (stdoutFD != 1 && (stdoutFD == -1 ? close(1) : dup2(stdoutFD, 1)) == -1) ||
+                (currentIO->fd[2] != 2 && (currentIO->fd[2] == -1 ? close(2) : dup2(currentIO->fd[2], 2)) == -1)) {
+                perror("dup2");
+                exit(1);
+            }
+            execCommand(cmd);
+        }
+        close(pipeFDs[0]);
+        out = pipeFDs[1];
+        ignorePipe.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignorePipe, &oldPipe);  // A command that quits early just ends the walk
+    }
+
+    setStatus(0);
+    if (walkTree(root, prefix, &walker, writeWalkBatch, &out) == -1) {
+        fprintf(stderr, "walk: %s: %s\n", root, strerror(errno));
+        setStatus(1 << 8);
+    } else if (walker.errors || builtinInterrupted) {
+        setStatus(1 << 8);
+    }
+    if (cmd == NULL) return;
+
+    // The command's status is the walk's
+    sigaction(SIGPIPE, &oldPipe, NULL);
+    close(out);
+    setStatus(waitForeground(pid));
+    if (WIFSIGNALED(lastStatus) && WTERMSIG(lastStatus) == SIGINT) programInterrupted = 1;
+    if (held != -1) {
+        lseek(held, 0, SEEK_SET);
+        copyFD(held, CAPTURE_FD);
+        close(held);
+    }
+}
+
+int writeWalkBatch(struct walkBatch *batch, void *context) {
+    for (size_t i = 0; i < batch->used; i++) {
+        if (batch->data[i] == '\0') batch->data[i] = '\n';
+    }
+    return builtinWrite(*(int *)context, batch->data, batch->used);
+}
+
+void timeoutCommand(char **args, struct redirections *redirs, int background) {
+    long long limit, grace = DEFAULT_KILL_GRACE;
+    int i = 1;
+
+    // Parse "-k grace" and the time limit
+    if (args[i] != NULL && strcmp(args[i], "-k") == 0) {
+        if (args[i + 1] == NULL || parseDuration(args[i + 1], &grace) == -1) {
+            fprintf(stderr, "timeout: -k expects a duration\n");
+            setStatus(1 << 8);
+            return;
+        }
+        i += 2;
+    }
+    if (args[i] == NULL || parseDuration(args[i], &limit) == -1 || args[i + 1] == NULL) {
+        fprintf(stderr, "usage: timeout [-k grace] duration command [args...]\n");
+        setStatus(1 << 8);
+        return;
+    }
+    char **cmd = args + i + 1;
+
+    // The command always gets its own process group, so the escalation also reaches its children
+    int terminal = !background && ownsTerminal();  // spawnCommand() hands it to the job
+    pid_t spawnpid = spawnCommand(cmd, redirs, background, 1);
+    if (background) {
+        printf("background pid is %d\n", spawnpid);
+        fflush(stdout);
+        setJobTimeout(addJob(spawnpid), limit, grace);
+        return;
+    }
+
+    // Foreground: run the event loop until the job's pidfd reports its exit
+    // WHY: The shell waits on the command itself, not on a `timeout` helper, so Ctrl+C and status stay exact.
+    // WHAT: Ctrl+C reaches the job's group from the terminal it now has, or through handle_SIGINT otherwise.
+    struct job job = {0};
+    struct sigaction SIGINT_action = {{0}}, oldAction;
+    trackJob(&job, spawnpid);
+    setJobTimeout(&job, limit, grace);
+    SIGINT_action.sa_handler = handle_SIGINT;
+    timedGroup = spawnpid;
+    sigaction(SIGINT, &SIGINT_action, &oldAction);
+
+    while (!job.done) {
+        if (job.pidfd == -1) {
+            // No pidfd: poll the child between timer events instead
+            int childStatus;
+            if (waitpid(spawnpid, &childStatus, WNOHANG) == spawnpid) jobReaped(&job, childStatus);
+            else runEvents(10);
+        } else {
+            runEvents(-1);
+        }
+    }
+
+    sigaction(SIGINT, &oldAction, NULL);
+    timedGroup = 0;
+    if (terminal) setTerminalGroup(getpgrp());
+    setStatus(job.status);
+    lastTimedOut = job.timedOut;  // After setStatus(), which clears it
+    if (WIFSIGNALED(lastStatus) && WTERMSIG(lastStatus) == SIGINT) programInterrupted = 1;  // Ctrl+C reached the job directly
+    if (WIFSIGNALED(lastStatus)) {
+        printf("terminated by signal %d\n", WTERMSIG(lastStatus));
+        fflush(stdout);
+    }
+}
+
+void setJobTimeout(struct job *job, long long limit, long long grace) {
+    job->grace = grace;
+    job->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (job->timer.fd == -1) {
+        perror("timerfd_create");
+        return;
+    }
+    job->timer.handler = handleJobTimeout;
+    job->timer.data = job;
+
+    struct itimerspec when = {{0, 0}, {limit / NSEC_PER_SEC, limit % NSEC_PER_SEC}};
+    timerfd_settime(job->timer.fd, 0, &when, NULL);
+    addEventSource(&job->timer);
+}
+
+void handleJobTimeout(struct eventSource *source) {
+    struct job *job = source->data;
+    uint64_t expirations;
+
+    if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    if (!job->timedOut) {
+        // First expiry: ask the whole group to stop, and give it the grace period to do so
+        job->timedOut = 1;
+        kill(-job->pid, SIGTERM);
+        kill(-job->pid, SIGCONT);  // A stopped group would not act on SIGTERM until it is continued
+        struct itimerspec when = {{0, 0}, {job->grace / NSEC_PER_SEC, job->grace % NSEC_PER_SEC}};
+        timerfd_settime(source->fd, 0, &when, NULL);
+    } else {
+        kill(-job->pid, SIGKILL);  // Still there after the grace period
+    }
+}
+
+struct builtin *findBuiltin(const char *name) {
+    for (struct builtin *builtin = builtins; builtin->name != NULL; builtin++) {
+        if (strcmp(builtin->name, name) == 0) return builtin;
+    }
+    return NULL;
+}
+
+void runBuiltin(struct builtin *builtin, char **args, struct redirections *redirs, int background) {
+    struct builtinIO io;
+
+    // Builtins that launch commands (timeout, watch, ...) pass the redirections on themselves
+    if (!builtin->ownIO) {
+        builtin->run(args, redirs, background);
+        return;
+    }
+
+    // A background builtin still has to run concurrently with the shell, so it gets a child of its own
+    if (background) {
+        fflush(stdout);
+        pid_t spawnpid = fork();
+        if (spawnpid == -1) {
+            perror("fork");
+            exit(1);
+        } else if (spawnpid == 0) {
+            struct sigaction SIGINT_action = {{0}};
+            SIGINT_action.sa_handler = SIG_IGN;
+            sigaction(SIGINT, &SIGINT_action, NULL);
+            setpgid(0, 0);
+            io = (struct builtinIO){ {devNullFD, devNullFD, 2}, {0}, 0, NULL };
+            if (openBuiltinIO(redirs, &io) == -1) exit(1);
+            currentIO = &io;
+            builtin->run(args, redirs, background);
+            exit(WIFEXITED(lastStatus) ? WEXITSTATUS(lastStatus) : 1);
+        }
+        setpgid(spawnpid, spawnpid);
+        printf("background pid is %d\n", spawnpid);
+        fflush(stdout);
+        addJob(spawnpid);
+        lastBackgroundPid = spawnpid;
+        return;
+    }
+
+    io = (struct builtinIO){ {commandFD[0], commandFD[1], commandFD[2]}, {0}, 0, NULL };
+    runBuiltinWith(builtin, args, redirs, &io);
+}
+
+void runBuiltinWith(struct builtin *builtin, char **args, struct redirections *redirs, struct builtinIO *io) {
+    if (openBuiltinIO(redirs, io) == -1) {
+        setStatus(1 << 8);
+        return;
+    }
+
+    // Let Ctrl+C interrupt the builtin: without SA_RESTART a blocked read() or splice() returns EINTR
+    // (in a pipeline stage the pipeline has set this up, for all of its stages at once)
+    struct sigaction SIGINT_action = {{0}}, oldAction;
+    int ownsInterrupt = (currentCoroutine == NULL);
+    SIGINT_action.sa_handler = handle_SIGINT;
+    if (ownsInterrupt) {
+        builtinInterrupted = 0;
+        sigaction(SIGINT, &SIGINT_action, &oldAction);
+    }
+
+    // Substitutions run builtins while another builtin's context may be current
+    struct builtinIO *savedIO = currentIO;
+    fflush(stdout);
+    currentIO = io;
+    builtin->run(args, redirs, 0);
+    currentIO = savedIO;
+    if (builtinInterrupted) programInterrupted = 1;
+
+    if (ownsInterrupt) sigaction(SIGINT, &oldAction, NULL);
+    closeBuiltinIO(io);
+}
+
+int openBuiltinIO(struct redirections *redirs, struct builtinIO *io) {
+    int numbers[MAX_REDIRS], targets[MAX_REDIRS], extra = 0;  // What "3>x" and the like set up, for "1>&3"
+    io->openedCount = 0;
+
+    resolveRedirections(redirs);
+    for (int i = 0; i < redirs->count; i++) {
+        struct redirection *r = &redirs->list[i];
+        int target;
+
+        if (r->type == REDIR_OPEN) {
+            target = (r->dirFD != -1) ? openat(r->dirFD, r->name, r->flags | O_CLOEXEC, 0644)
+                                      : open(r->path, r->flags | O_CLOEXEC, 0644);
+            if (target == -1) {
+                perror(r->flags == O_RDONLY ? "cannot open input file" : "cannot open output file");
+                closeBuiltinIO(io);
+                return -1;
+            }
+            io->opened[io->openedCount++] = target;
+        } else if (r->type == REDIR_DUP) {
+            target = (r->source <= 2) ? io->fd[r->source] : r->source;
+            for (int k = extra - 1; k >= 0 && r->source > 2; k--) {
+                if (numbers[k] == r->source) {
+                    target = targets[k];  // Set up earlier in this list, not one of the shell's own
+                    break;
+                }
+            }
+        } else if (r->type == REDIR_DATA) {
+            target = r->source;  // Owned by the redirection list, which closes it
+        } else {
+            target = -1;
+        }
+
+        // Builtins only use stdin, stdout and stderr; higher descriptors matter as sources of later dups
+        if (r->fd <= 2) {
+            io->fd[r->fd] = target;
+        } else {
+            numbers[extra] = r->fd;
+            targets[extra++] = target;
+        }
+    }
+    return 0;
+}
+
+void closeBuiltinIO(struct builtinIO *io) {
+    for (int i = 0; i < io->openedCount; i++) close(io->opened[i]);
+    io->openedCount = 0;
+}
+
+int writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        // A pipeline stage waits for room, then writes no more than a pipe with room takes without blocking
+        size_t chunk = length;
+        if (currentCoroutine != NULL) {
+            if (waitDescriptor(fd, EPOLLOUT) == -1) return -1;
+            if (chunk > PIPE_BUF) chunk = PIPE_BUF;
+        }
+        ssize_t n = write(fd, data, chunk);
+        if (n == -1) {
+            if (errno == EINTR && !builtinInterrupted) continue;
+            return writeFailed();
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+void builtinPrintf(const char *format, ...) {
+    char buffer[1024];
+    va_list list;
+
+    va_start(list, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, list);
+    va_end(list);
+    if (length > (int)sizeof(buffer) - 1) length = sizeof(buffer) - 1;
+    builtinWrite(currentIO->fd[1], buffer, length);
+}
+
+int builtinWrite(int fd, const char *data, size_t length) {
+    if (fd == CAPTURE_FD) {
+        captureAppend(currentIO->capture, data, length);
+        return 0;
+    }
+    return writeAll(fd, data, length);
+}
+
+int copyFD(int in, int out) {
+    struct stat inStat, outStat;
+    ssize_t n;
+
+    // Inside "$(...)": read straight into the capture buffer (captureRead() waits in a pipeline stage)
+    if (out == CAPTURE_FD) {
+        while ((n = captureRead(currentIO->capture, in)) != 0) {
+            if (n == -1 && (errno != EINTR || builtinInterrupted)) return -1;
+        }
+        return 0;
+    }
+
+    if (fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1) return -1;
+
+    // Regular file to regular file: let the filesystem copy (or share) the extents
+    // WHY: copy_file_range refuses O_APPEND outputs (>>), which only the buffered copy handles.
+    int appending = fcntl(out, F_GETFL) & O_APPEND;
+    if (S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode) && !appending) {
+        while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) {}
+        if (n == 0) return 0;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return writeFailed();
+        // Cross-filesystem copies and special files (e.g. /proc) refuse it; carry on below
+    }
+
+    // A pipe on either side: move pages between the pipe and the other end without copying them
+    // (a pipeline stage waits for input, and splices without blocking so that a full output waits too)
+    if ((S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode)) && !appending) {
+        int flags = SPLICE_F_MOVE | SPLICE_F_MORE | (currentCoroutine != NULL ? SPLICE_F_NONBLOCK : 0);
+        while (1) {
+            if (waitDescriptor(in, EPOLLIN) == -1) return -1;
+            if ((n = splice(in, NULL, out, NULL, 1 << 20, flags)) > 0) continue;
+            if (n == 0) return 0;
+            if (errno != EAGAIN || waitDescriptor(out, EPOLLOUT) == -1) break;
+        }
+        if (errno != EINVAL) return writeFailed();
+    }
+
+    // Regular file to anything else (a terminal, a socket)
+    if (S_ISREG(inStat.st_mode) && !appending) {
+        while ((n = sendfile(out, in, NULL, 1 << 30)) > 0) {}
+        if (n == 0) return 0;
+        if (errno != EINVAL && errno != ENOSYS) return writeFailed();
+    }
+
+    // Last resort: through a buffer
+    char buffer[65536];
+    while (1) {
+        if (waitDescriptor(in, EPOLLIN) == -1) return -1;
+        if ((n = read(in, buffer, sizeof(buffer))) == 0) return 0;
+        if (n == -1) {
+            if (errno == EINTR && !builtinInterrupted) continue;
+            return -1;
+        }
+        if (writeAll(out, buffer, n) == -1) return -1;
+    }
+}
+
+int isOutputFile(int in, int out) {
+    struct stat inStat, outStat;
+
+    if (out == CAPTURE_FD || fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1) return 0;
+    return S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode) &&
+           inStat.st_dev == outStat.st_dev && inStat.st_ino == outStat.st_ino;
+}
+
+void statusCommand(char **args, struct redirections *redirs, int background) {
+    displayStatus();
+}
+
+void catCommand(char **args, struct redirections *redirs, int background) {
+    int failed = 0;
+
+    // No operands: copy stdin
+    if (args[1] == NULL && isOutputFile(currentIO->fd[0], currentIO->fd[1])) {
+        fprintf(stderr, "cat: -: input file is output file\n");
+        failed = 1;
+    } else if (args[1] == NULL && copyFD(currentIO->fd[0], currentIO->fd[1]) == -1) {
+        if (!builtinInterrupted && errno != EPIPE) perror("cat");  // A closed pipe ends it quietly, as SIGPIPE would
+        failed = 1;
+    }
+
+    for (int i = 1; args[i] != NULL && !builtinInterrupted; i++) {
+        int fd = (strcmp(args[i], "-") == 0) ? currentIO->fd[0] : open(args[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            failed = 1;
+            continue;
+        }
+        if (isOutputFile(fd, currentIO->fd[1])) {
+            fprintf(stderr, "cat: %s: input file is output file\n", args[i]);
+            failed = 1;
+        } else if (copyFD(fd, currentIO->fd[1]) == -1 && !builtinInterrupted && errno != EPIPE) {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            failed = 1;
+        }
+        if (fd != currentIO->fd[0]) close(fd);
+    }
+    setStatus((failed || builtinInterrupted) ? 1 << 8 : 0);
+}
+
+void exportCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(0);
+
+    // Without arguments, list the exported variables in a form that can be read back in
+    if (args[1] == NULL) {
+        struct capture list = { &lineArena, NULL, 0, 0 };
+        for (size_t i = 0; i < variables.capacity; i++) {
+            struct variable *variable = &variables.slots[i];
+            if (variable->name == NULL || !variable->exported || variable->value == NULL) continue;
+            captureAppend(&list, "export ", 7);
+            captureAppend(&list, variable->name, variable->length);
+            captureAppend(&list, "=", 1);
+            captureAppend(&list, variable->value, strlen(variable->value));
+            captureAppend(&list, "\n", 1);
+        }
+        if (list.length > 0 && builtinWrite(currentIO->fd[1], list.data, list.length) == -1) setStatus(1 << 8);
+        return;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t length = nameLength(args[i]);
+        if (length == 0 || (args[i][length] != '\0' && args[i][length] != '=')) {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", args[i]);
+            setStatus(1 << 8);
+            continue;
+        }
+        struct variable *variable = findVariable(args[i], length, 1);
+        variable->exported = 1;
+        if (args[i][length] == '=') {
+            setVariable(args[i], length, args[i] + length + 1);
+        } else {
+            publishVariable(variable);
+        }
+    }
+}
+
+void unsetCommand(char **args, struct redirections *redirs, int background) {
+    int functions = (args[1] != NULL && strcmp(args[1], "-f") == 0);
+    for (int i = 1 + functions; args[i] != NULL; i++) {
+        struct variable *variable = findVariable(args[i], strlen(args[i]), 0);
+        if (variable == NULL) continue;
+        if (functions) {
+            if (variable->function != NULL) releaseProgram(variable->function);
+            variable->function = NULL;
+            continue;
+        }
+        variable->exported = 0;
+        setVariable(variable->name, variable->length, NULL);
+    }
+    setStatus(0);
+}
+
+void setCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(0);
+
+    // Without arguments, list every variable that has a value
+    if (args[1] == NULL) {
+        struct capture list = { &lineArena, NULL, 0, 0 };
+        for (size_t i = 0; i < variables.capacity; i++) {
+            struct variable *variable = &variables.slots[i];
+            if (variable->name == NULL || variable->value == NULL) continue;
+            captureAppend(&list, variable->name, variable->length);
+            captureAppend(&list, "=", 1);
+            captureAppend(&list, variable->value, strlen(variable->value));
+            captureAppend(&list, "\n", 1);
+        }
+        if (list.length > 0 && builtinWrite(currentIO->fd[1], list.data, list.length) == -1) setStatus(1 << 8);
+        return;
+    }
+
+    // "set -- a b c" (or "set a b c") replaces $1, $2, ...
+    int first = (strcmp(args[1], "--") == 0) ? 2 : 1;
+    int count = 0;
+    while (args[first + count] != NULL) count++;
+
+    if (functionDepth > 0) {
+        // Inside a function, only the call's frame changes; it is released when the call returns
+        char **frame = arenaAlloc(&frameArena, (count + 1) * sizeof(char *));
+        frame[0] = positional[0];
+        for (int i = 1; i <= count; i++) frame[i] = arenaCopy(&frameArena, args[first + i - 1]);
+        positional = frame;
+    } else {
+        for (int i = 1; i <= positionalCount; i++) free(positional[i]);
+        positional = realloc(positional, (count + 1) * sizeof(char *));
+        for (int i = 1; i <= count; i++) positional[i] = strdup(args[first + i - 1]);
+    }
+    positionalCount = count;
+}
+
+void letCommand(char **args, struct redirections *redirs, int background) {
+    long long value = 0;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "let: expression expected\n");
+        setStatus(1 << 8);
+        return;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (evalArithmetic(args[i], &value) == -1) {
+            setStatus(1 << 8);
+            return;
+        }
+    }
+    setStatus((value != 0) ? 0 : 1 << 8);
+}
+
+void loopControlCommand(char **args, struct redirections *redirs, int background) {
+    int levels = (args[1] != NULL) ? atoi(args[1]) : 1;
+
+    if (loopDepth == 0 || levels < 1) {
+        fprintf(stderr, "%s: %s\n", args[0], loopDepth == 0 ? "only meaningful in a loop" : "loop count out of range");
+        setStatus(1 << 8);
+        return;
+    }
+    if (levels > loopDepth) levels = loopDepth;
+    if (args[0][0] == 'b') {
+        breakLevels = levels;
+    } else {
+        continueLevels = levels;
+    }
+    setStatus(0);
+}
+
+void returnCommand(char **args, struct redirections *redirs, int background) {
+    if (functionDepth == 0) {
+        fprintf(stderr, "return: can only be used in a function\n");
+        setStatus(1 << 8);
+        return;
+    }
+    if (args[1] != NULL) setStatus((atoi(args[1]) & 0xff) << 8);
+    returnRequested = 1;
+}
+
+void aliasCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(0);
+
+    // "alias name=value...": the value is the rest of the line
+    char *equals = (args[1] != NULL) ? strchr(args[1], '=') : NULL;
+    if (equals != NULL) {
+        struct capture text = { &lineArena, NULL, 0, 0 };
+        captureAppend(&text, equals + 1, strlen(equals + 1));
+        for (int i = 2; args[i] != NULL; i++) {
+            captureAppend(&text, " ", 1);
+            captureAppend(&text, args[i], strlen(args[i]));
+        }
+        captureAppend(&text, "", 1);
+
+        // Quotes around the whole value are not part of it ("alias ll='ls -l'")
+        char *value = text.data;
+        size_t length = text.length - 1;
+        if (length >= 2 && (value[0] == '\'' || value[0] == '"') && value[length - 1] == value[0]) {
+            value[length - 1] = '\0';
+            value++;
+        }
+
+        struct program *program = NULL;
+        size_t nameEnd = equals - args[1];
+        if (nameEnd == 0 || compileProgram(value, strlen(value), &program) != COMPILE_OK ||
+            program->root == -1 || program->nodes[program->root].type != NODE_COMMAND ||
+            program->nodes[program->root].next != -1) {
+            fprintf(stderr, "alias: %.*s: the value must be one simple command\n", (int)nameEnd, args[1]);
+            if (program != NULL) releaseProgram(program);
+            setStatus(1 << 8);
+            return;
+        }
+
+        struct variable *alias = findVariable(args[1], nameEnd, 1);
+        if (alias->aliasProgram != NULL) releaseProgram(alias->aliasProgram);
+        free(alias->alias);
+        alias->alias = strdup(value);
+        alias->aliasProgram = program;
+        return;
+    }
+
+    // "alias name..." prints those aliases, and "alias" all of them
+    struct capture list = { &lineArena, NULL, 0, 0 };
+    for (size_t i = 0; i < variables.capacity; i++) {
+        struct variable *alias = &variables.slots[i];
+        if (alias->name == NULL || alias->alias == NULL) continue;
+        int listed = (args[1] == NULL);
+        for (int j = 1; args[j] != NULL; j++) listed = listed || strcmp(args[j], alias->name) == 0;
+        if (!listed) continue;
+        captureAppend(&list, "alias ", 6);
+        captureAppend(&list, alias->name, alias->length);
+        captureAppend(&list, "='", 2);
+        captureAppend(&list, alias->alias, strlen(alias->alias));
+        captureAppend(&list, "'\n", 2);
+    }
+    for (int j = 1; args[j] != NULL; j++) {
+        struct variable *alias = findVariable(args[j], strlen(args[j]), 0);
+        if (alias != NULL && alias->alias != NULL) continue;
+        fprintf(stderr, "alias: %s: not found\n", args[j]);
+        setStatus(1 << 8);
+    }
+    if (list.length > 0 && builtinWrite(currentIO->fd[1], list.data, list.length) == -1) setStatus(1 << 8);
+}
+
+void unaliasCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(0);
+    for (int i = 1; args[i] != NULL; i++) {
+        struct variable *alias = findVariable(args[i], strlen(args[i]), 0);
+        if (alias == NULL || alias->alias == NULL) {
+            fprintf(stderr, "unalias: %s: not found\n", args[i]);
+            setStatus(1 << 8);
+            continue;
+        }
+        releaseProgram(alias->aliasProgram);
+        free(alias->alias);
+        alias->alias = NULL;
+        alias->aliasProgram = NULL;
+    }
+}
+
+void trueCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(0);
+}
+
+void falseCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(1 << 8);
+}
+
+void echoCommand(char **args, struct redirections *redirs, int background) {
+    struct capture line = { &lineArena, NULL, 0, 0 };
+    int i = 1, newline = 1;
+
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (; args[i] != NULL; i++) {
+        captureAppend(&line, args[i], strlen(args[i]));
+        if (args[i + 1] != NULL) captureAppend(&line, " ", 1);
+    }
+    if (newline) captureAppend(&line, "\n", 1);
+
+    setStatus((line.length > 0 && builtinWrite(currentIO->fd[1], line.data, line.length) == -1) ? 1 << 8 : 0);
+}
+
+void pwdCommand(char **args, struct redirections *redirs, int background) {
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        setStatus(1 << 8);
+        return;
+    }
+
+    size_t length = strlen(cwd);
+    cwd[length] = '\n';  // Replaces the terminator, so the path and newline go out in one write
+    setStatus((builtinWrite(currentIO->fd[1], cwd, length + 1) == -1) ? 1 << 8 : 0);
+    free(cwd);
+}
+
+void teeCommand(char **args, struct redirections *redirs, int background) {
+    int outputs[MAX_ARGS];
+    int count = 0, failed = 0, append = 0, i = 1;
+    struct stat inStat;
+
+    if (args[i] != NULL && strcmp(args[i], "-a") == 0) {
+        append = 1;
+        i++;
+    }
+
+    // stdout first, then every file operand
+    outputs[count++] = currentIO->fd[1];
+    for (; args[i] != NULL; i++) {
+        int fd = open(args[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        if (fd == -1) {
+            fprintf(stderr, "tee: %s: %s\n", args[i], strerror(errno));
+            failed = 1;
+            continue;
+        }
+        outputs[count++] = fd;
+    }
+
+    int in = currentIO->fd[0];
+    int scratch[2] = {-1, -1};
+    if (outputs[0] != CAPTURE_FD && fstat(in, &inStat) == 0 && S_ISFIFO(inStat.st_mode) && pipe2(scratch, O_CLOEXEC) == 0) {
+        // Zero-copy path: tee(2) references the buffered pages into a scratch pipe once per output,
+        // splice moves them on, and the input is finally consumed into /dev/null
+        // WHY: tee(2) never consumes its input, so each output gets a fresh reference to the same pages.
+        // WHAT: The scratch pipe is as large as the input pipe, so a full input duplicates in one call.
+        // In a pipeline stage, a full output waits for room while the other stages run
+        fcntl(scratch[1], F_SETPIPE_SZ, fcntl(in, F_GETPIPE_SZ));
+        int nonblocking = (currentCoroutine != NULL) ? SPLICE_F_NONBLOCK : 0;
+        while (!builtinInterrupted && waitDescriptor(in, EPOLLIN) == 0) {
+            ssize_t n = tee(in, scratch[1], 1 << 20, 0);  // Blocks until data arrives; 0 means EOF
+            if (n == 0) break;
+            if (n == -1) {
+                if (errno != EINTR) failed = 1;
+                break;
+            }
+
+            for (int k = 0; k < count; k++) {
+                // The first duplicate is already in the scratch pipe
+                if (k > 0 && tee(in, scratch[1], n, 0) != n) {
+                    failed = 1;
+                    break;
+                }
+                for (ssize_t left = n; left > 0; ) {
+                    ssize_t moved = splice(scratch[0], NULL, outputs[k], NULL, left, SPLICE_F_MOVE | nonblocking);
+                    if (moved == -1 && errno == EAGAIN) {
+                        if (waitDescriptor(outputs[k], EPOLLOUT) == 0) continue;
+                    } else if (moved == -1 && errno == EINVAL) {
+                        // Outputs that cannot take spliced pages (e.g. O_APPEND files) get a plain copy
+                        char buffer[65536];
+                        moved = read(scratch[0], buffer, left < (ssize_t)sizeof(buffer) ? left : (ssize_t)sizeof(buffer));
+                        if (moved > 0 && writeAll(outputs[k], buffer, moved) == -1) moved = -1;
+                    }
+                    if (moved <= 0) {
+                        if (moved == -1) writeFailed();
+                        failed = 1;
+                        break;
+                    }
+                    left -= moved;
+                }
+                if (failed) break;
+            }
+            if (failed) break;
+
+            // Everything is out; drop the original pages
+            for (ssize_t left = n; left > 0; ) {
+                ssize_t dropped = splice(in, NULL, devNullFD, NULL, left, SPLICE_F_MOVE);
+                if (dropped <= 0) {
+                    char buffer[65536];
+                    dropped = read(in, buffer, left < (ssize_t)sizeof(buffer) ? left : (ssize_t)sizeof(buffer));
+                    if (dropped <= 0) break;
+                }
+                left -= dropped;
+            }
+        }
+        close(scratch[0]);
+        close(scratch[1]);
+    } else {
+        // Not a pipe: copy through a buffer to each output
+        char buffer[65536];
+        ssize_t n;
+        while (!builtinInterrupted && waitDescriptor(in, EPOLLIN) == 0 && (n = read(in, buffer, sizeof(buffer))) != 0) {
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                failed = 1;
+                break;
+            }
+            for (int k = 0; k < count; k++) {
+                if (builtinWrite(outputs[k], buffer, n) == -1) failed = 1;
+            }
+        }
+    }
+
+    for (int k = 1; k < count; k++) close(outputs[k]);
+    setStatus((failed || builtinInterrupted) ? 1 << 8 : 0);
+}
+
+void promptCommand(char **args, struct redirections *redirs, int background) {
+    setStatus(0);
+    if (args[1] == NULL) {
+        const char *template = getVariable("PROMPT");
+        if (template != NULL) builtinPrintf("%s\n", template);
+        return;
+    }
+
+    struct capture text = { &lineArena, NULL, 0, 0 };
+    for (int i = 1; args[i] != NULL; i++) {
+        if (i > 1) captureAppend(&text, " ", 1);
+        captureAppend(&text, args[i], strlen(args[i]));
+    }
+    captureAppend(&text, "", 1);
+    char *value = text.data;
+    size_t length = text.length - 1;
+    if (length >= 2 && (value[0] == '\'' || value[0] == '"') && value[length - 1] == value[0]) {
+        value[length - 1] = '\0';
+        value++;
+    }
+    setVariable("PROMPT", 6, value);
+}
@@ -0,0 +1,101 @@
+#!/bin/sh
+# Regression tests for smallsh. Each test runs a script with smallsh in a scratch directory and compares
+# what it prints with the expected output.
+#
+#     tests/run.sh [path/to/smallsh]
+
+SMALLSH=$(cd "$(dirname "${1:-./smallsh}")" && pwd)/$(basename "${1:-./smallsh}")
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+export XDG_CACHE_HOME="$SCRATCH/cache" HISTFILE="$SCRATCH/history" SMALLSH_Z="$SCRATCH/z"
+failures=0
+
+# check NAME EXPECTED: runs the script on stdin in a fresh directory and compares its output with EXPECTED
+# (leaving out the "background pid ..." notices, whose numbers change from run to run)
+check() {
+    mkdir "$SCRATCH/$1"
+    cat > "$SCRATCH/$1.sh"
+    actual=$(cd "$SCRATCH/$1" && "$SMALLSH" "$SCRATCH/$1.sh" 2>&1 | grep -v '^background pid')
+    if [ "$actual" = "$2" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        printf '  expected: %s\n  actual:   %s\n' "$2" "$actual"
+        failures=$((failures + 1))
+    fi
+}
+
+# The README's template, where single-character file names would match "[{git}]" as a glob pattern
+check prompt-template '{cwd} [{git}]  {duration}: ' <<'END'
+touch t g i a
+prompt '{cwd} [{git}]  {duration}: '
+prompt
+END
+
+# "(timed out)" belongs to the timed-out command only, not to the builtins and assignments after it
+check timeout-status 'terminated by signal 15
+terminated by signal 15
+(timed out)
+after
+exit value 0
+terminated by signal 15
+exit value 0
+terminated by signal 15
+exit value 0' <<'END'
+timeout 100ms sleep 5
+status
+echo after
+status
+timeout 100ms sleep 5
+true
+status
+timeout 100ms sleep 5
+x=1
+status
+END
+
+# Runaway recursion fails the command it started from, and the script goes on
+check function-nesting 'smallsh: f: maximum function nesting level exceeded
+exit value 1
+after' <<'END'
+f() { f; echo never; }
+f
+status
+echo after
+END
+
+# Watched paths are absolute, so they are re-added after a rename even from another directory, and the
+# command may be a function
+check watch-function 'watch 1 started
+changed: f
+changed: f' <<'END'
+mkdir sub
+touch sub/f
+changed() { echo changed: $1 >> log; }
+cd sub
+watch -d 20 f -- changed f
+cd ..
+touch sub/f
+sleep 0.3
+mv sub/f sub/g
+touch sub/f
+sleep 0.3
+unwatch 1
+cat log
+END
+
+# Scheduled functions run as jobs; a run still going when the next tick comes swallows it
+check schedule-function 'schedule 1 started
+schedule 2 started
+once
+slow' <<'END'
+slow() { echo slow >> log; sleep 0.5; }
+once() { echo once >> log; }
+every 100ms slow
+at +50ms once
+sleep 0.35
+unschedule 1
+cat log
+END
+
+[ "$failures" -eq 0 ] || { echo "$failures failed"; exit 1; }